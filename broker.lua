@@ -0,0 +1,387 @@
+-- Session broker: keeps warm, logged-in sessions per target and lends
+-- their pty masters to client scripts over a unix domain socket.
+--
+-- The broker process:
+--
+--   local Broker = require "broker"
+--   Broker.new{
+--       path = "/tmp/expect-broker.sock",
+--       targets = {
+--           web1 = {
+--               spawn = function() ... return session end,  -- required
+--               login = function(session) ... return true end,
+--               check = function(session) ... return true end,
+--               min = 1, max = 4, idle = 300,
+--           },
+--       },
+--       interval = 5,
+--   }:serve()
+--
+-- A client script:
+--
+--   local session = Broker.checkout("/tmp/expect-broker.sock", "web1")
+--   session:send("uptime\r")
+--   ...
+--   Broker.release(session)
+--
+-- The protocol is one short line per message: "CHECKOUT <target>" is
+-- answered with "OK <id>" and the master fd, "RELEASE <id>" with "OK";
+-- failures come back as "ERR <reason>". A session whose client goes
+-- away counts as released. Released sessions are health checked before
+-- they are lent again; idle ones are checked every interval seconds,
+-- and those beyond min that sat unused for idle seconds are closed.
+
+local Expect = require "expect"
+
+local lio = require "lio"
+local ltimeout = require "ltimeout"
+
+local gettime = ltimeout.gettime
+local match = string.match
+local format = string.format
+
+
+local _M = {}
+
+local mt = { __index = _M }
+
+
+local MSGSIZE = 512
+
+
+local fdobj_mt = {
+    __index = {
+        getfd = function(self)
+            return self.fd
+        end,
+    },
+}
+
+local function fdobj(fd)
+    return setmetatable({ fd = fd, sessions = {} }, fdobj_mt)
+end
+
+
+local function default_check(session, timeout)
+    return session:ping(timeout)
+end
+
+
+function _M.new(conf)
+    local targets = {}
+
+    for name, target in pairs(conf.targets or {}) do
+        if type(target.spawn) ~= "function" then
+            error("target " .. name .. ": spawn function required")
+        end
+
+        targets[name] = {
+            name = name,
+            spawn = target.spawn,
+            login = target.login,
+            check = target.check or default_check,
+            min = target.min or 1,
+            max = target.max or 4,
+            idle = target.idle or 300,
+            free = {},
+            count = 0,
+        }
+    end
+
+    return setmetatable({
+        path = conf.path or "/tmp/expect-broker.sock",
+        interval = conf.interval or 5,
+        timeout = conf.timeout or 5,
+        targets = targets,
+        clients = {},
+        lent = {},
+        nextid = 0,
+    }, mt)
+end
+
+
+function _M.open(self, target)
+    local session, err = target.spawn()
+    if not session then
+        return nil, err
+    end
+
+    if target.login then
+        local ok, err = target.login(session)
+        if not ok then
+            session:clean()
+            return nil, err or "login failed"
+        end
+    end
+
+    self.nextid = self.nextid + 1
+    target.count = target.count + 1
+
+    return { id = self.nextid, target = target, session = session,
+             used = gettime() }
+end
+
+
+function _M.close(self, entry)
+    entry.session:clean()
+    entry.target.count = entry.target.count - 1
+end
+
+
+function _M.refill(self)
+    for _, target in pairs(self.targets) do
+        while target.count < target.min do
+            local entry, err = self:open(target)
+            if not entry then
+                io.stderr:write(format("broker: %s: %s\n", target.name,
+                                       tostring(err)))
+                break
+            end
+            target.free[#target.free + 1] = entry
+        end
+    end
+end
+
+
+-- health checks idle sessions and expires the ones nobody wanted
+function _M.maintain(self)
+    local now = gettime()
+
+    for _, target in pairs(self.targets) do
+        local keep = {}
+
+        for _, entry in ipairs(target.free) do
+            if target.count > target.min and now - entry.used > target.idle
+            then
+                self:close(entry)
+            elseif not target.check(entry.session, self.timeout) then
+                self:close(entry)
+            else
+                keep[#keep + 1] = entry
+            end
+        end
+
+        target.free = keep
+    end
+
+    self:refill()
+end
+
+
+function _M.lend(self, client, name)
+    local target = self.targets[name]
+    if not target then
+        return nil, "unknown target"
+    end
+
+    local entry = table.remove(target.free)
+    if not entry then
+        if target.count >= target.max then
+            return nil, "busy"
+        end
+
+        local err
+        entry, err = self:open(target)
+        if not entry then
+            return nil, err
+        end
+    end
+
+    local ok, err = lio.sendfd(client.fd, "OK " .. entry.id .. "\n",
+                               entry.session.pty, self.timeout)
+    if not ok then
+        target.free[#target.free + 1] = entry
+        return nil, err
+    end
+
+    entry.client = client
+    client.sessions[entry.id] = entry
+    self.lent[entry.id] = entry
+
+    return true
+end
+
+
+function _M.reclaim(self, entry)
+    local target = entry.target
+
+    entry.client.sessions[entry.id] = nil
+    entry.client = nil
+    self.lent[entry.id] = nil
+
+    -- the client may have left it in any state
+    lio.clear(entry.session.pty)
+    if not target.check(entry.session, self.timeout) then
+        self:close(entry)
+        return
+    end
+
+    entry.used = gettime()
+    target.free[#target.free + 1] = entry
+end
+
+
+function _M.request(self, client)
+    local msg, err = lio.recvfd(client.fd, MSGSIZE, 0)
+    if not msg then
+        if err == "timeout" then
+            return true
+        end
+
+        -- client gone, take back whatever it had
+        for _, entry in pairs(client.sessions) do
+            self:reclaim(entry)
+        end
+        lio.destroy(client.fd)
+        return nil
+    end
+
+    local cmd, arg = match(msg, "^(%u+) ([^\n]*)")
+
+    if cmd == "CHECKOUT" then
+        local ok, err = self:lend(client, arg)
+        if not ok then
+            lio.sendfd(client.fd, "ERR " .. tostring(err) .. "\n", nil,
+                       self.timeout)
+        end
+    elseif cmd == "RELEASE" then
+        local entry = client.sessions[tonumber(arg)]
+        if entry then
+            self:reclaim(entry)
+            lio.sendfd(client.fd, "OK\n", nil, self.timeout)
+        else
+            lio.sendfd(client.fd, "ERR unknown session\n", nil,
+                       self.timeout)
+        end
+    else
+        lio.sendfd(client.fd, "ERR bad request\n", nil, self.timeout)
+    end
+
+    return true
+end
+
+
+function _M.serve(self)
+    os.remove(self.path)
+
+    local lfd, err = lio.listen(self.path)
+    if not lfd then
+        return nil, err
+    end
+
+    local listener = fdobj(lfd)
+    local rset, rout, wout = {}, {}, {}
+    local nextcheck = gettime() + self.interval
+
+    self:refill()
+
+    while not self.stopped do
+        rset[1] = listener
+        for i, client in ipairs(self.clients) do
+            rset[i + 1] = client
+        end
+        rset[#self.clients + 2] = nil
+
+        local wait = nextcheck - gettime()
+        if wait < 0 then
+            wait = 0
+        end
+
+        local r, _, err = lio.select(rset, nil, wait, rout, wout)
+        if err and err ~= "timeout" then
+            return nil, err
+        end
+
+        for i = 1, #r do
+            local obj = r[i]
+            if obj == listener then
+                local fd = lio.accept(lfd, 0)
+                if fd then
+                    self.clients[#self.clients + 1] = fdobj(fd)
+                end
+            elseif not self:request(obj) then
+                for j, client in ipairs(self.clients) do
+                    if client == obj then
+                        table.remove(self.clients, j)
+                        break
+                    end
+                end
+            end
+        end
+
+        if gettime() >= nextcheck then
+            self:maintain()
+            nextcheck = gettime() + self.interval
+        end
+    end
+
+    lio.destroy(lfd)
+    os.remove(self.path)
+
+    return true
+end
+
+
+function _M.stop(self)
+    self.stopped = true
+end
+
+
+--[[ client side ]]
+
+-- borrows a warm session for target from the broker listening on path
+function _M.checkout(path, target, timeout)
+    local sock, err = lio.connect(path)
+    if not sock then
+        return nil, err
+    end
+
+    local ok, err = lio.sendfd(sock, "CHECKOUT " .. target .. "\n", nil,
+                               timeout)
+    if not ok then
+        lio.destroy(sock)
+        return nil, err
+    end
+
+    local msg, fd = lio.recvfd(sock, MSGSIZE, timeout)
+    local id = msg and match(msg, "^OK (%d+)")
+    if not id or not fd then
+        lio.destroy(sock)
+        if fd then
+            lio.destroy(fd)
+        end
+        return nil, msg and match(msg, "^ERR ([^\n]*)") or fd
+    end
+
+    local session = Expect.attach(fd, timeout)
+    session.broker = { sock = sock, id = id }
+
+    return session
+end
+
+
+-- hands a borrowed session back to the broker
+function _M.release(session, timeout)
+    local broker = session.broker
+    if not broker then
+        return nil, "not a borrowed session"
+    end
+
+    session.broker = nil
+    session:clean()
+
+    local ok, err = lio.sendfd(broker.sock, "RELEASE " .. broker.id .. "\n",
+                               nil, timeout)
+    if ok then
+        local msg
+        msg, err = lio.recvfd(broker.sock, MSGSIZE, timeout)
+        ok = msg and match(msg, "^OK") ~= nil
+    end
+
+    lio.destroy(broker.sock)
+
+    return ok, err
+end
+
+
+return _M
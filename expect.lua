@@ -1,26 +1,51 @@
 package.cpath = package.cpath .. ";lib/?.so;lib/?.dylib;;"
 
+-- one combined native module, where built, loads faster than three
+if not package.loaded.expect_native then
+    pcall(require, "expect_native")
+end
+
 local io = require "io"
 local lio = require "lio"
 local lpty = require "lpty"
 local timeout = require "ltimeout"
 
-local find = string.find
-local concat = table.concat
-
+-- on LuaJIT the hot I/O functions go through the FFI so that the
+-- read/match loop can be compiled
+if jit then
+    local ok, fast = pcall(require, "lio.ffi")
+    if ok then
+        lio = fast
+    end
+end
 
 local _M = {}
 
 local mt = { __index = _M }
 
 
-function _M.new(cols, rows, timeout, blocking)
+-- compiled patterns, so the literal prefilter is worked out only once
+local patterns = setmetatable({}, { __mode = "v" })
+
+local function compile(pattern)
+    local pat = patterns[pattern]
+    if not pat then
+        pat = lio.pattern(pattern)
+        patterns[pattern] = pat
+    end
+    return pat
+end
+
+
+-- termios is an optional profile applied to the pty before spawn, e.g.
+-- "raw", "noecho" or { echo = false, onlcr = false, vmin = 1, vtime = 0 }
+function _M.new(cols, rows, timeout, blocking, termios)
     cols = tonumber(cols) or 128
     rows = tonumber(rows) or 64
     -- -1: no time limit
     timeout = tonumber(timeout) or -1
 
-    local pty, err = lpty.open(cols, rows)
+    local pty, err = lpty.open(cols, rows, termios)
     if not pty then
         return nil, err
     end
@@ -39,54 +64,322 @@ function _M.new(cols, rows, timeout, blocking)
 
     return setmetatable({
         cols = cols, rows = rows, timeout = timeout,
-        master = pty.master, slave = pty.slave, name = pty.name,
-        fresh = false, buffer = "",
+        pty = pty, master = pty.master, slave = pty.slave, name = pty.name,
+    }, mt)
+end
+
+
+-- wraps a pty master that was opened elsewhere, e.g. one received from
+-- a session broker; the session has no slave and cannot spawn
+function _M.attach(master, timeout, name)
+    local pty = lpty.attach(master, name)
+
+    return setmetatable({
+        cols = 0, rows = 0, timeout = tonumber(timeout) or -1,
+        pty = pty, master = pty.master, name = pty.name,
     }, mt)
 end
 
 
-function _M.spawn(self, file, args, cwd)
+-- a session on pipes instead of a pty, for children that need no
+-- terminal: no echo, no CRLF translation and pipes of size bytes (1 MB
+-- by default, where the system allows) for bulk output; scripts drive it
+-- like any other session, eof() stands in for ^D
+function _M.pipe(timeout, size)
+    local pty, err = lpty.pipe(size)
+    if not pty then
+        return nil, err
+    end
+
+    return setmetatable({
+        cols = 0, rows = 0, timeout = tonumber(timeout) or -1,
+        pty = pty, master = pty.master, slave = pty.slave, name = pty.name,
+        piped = true,
+    }, mt)
+end
+
+
+local ENV = { "PATH=/bin:/usr/bin:/usr/sbin:/usr/local/bin" }
+
+-- opts sets up the child before exec: cpus, sched, nice, rlimits and
+-- cgroup, e.g. { cpus = { 2, 3 }, sched = "idle", rlimits = { as = 1e9 } };
+-- on pipes opts.stderr = "pipe" keeps stderr apart, readable through
+-- self.stderr, and "inherit" leaves it ours
+function _M.spawn(self, file, args, cwd, opts)
     if not self.master then
         return nil, "no master"
     end
 
-    self.fresh = true
+    if not self.slave then
+        return nil, "no slave"
+    end
+
+    local pid, err
+    if self.piped then
+        pid, err = lpty.spawn_pipe(self.pty, file, args, ENV, cwd, opts)
+        if pid and err then
+            self.stderr = lpty.attach(err, "stderr")
+        end
+    else
+        pid, err = lpty.spawn(self.master, self.slave, file, args, ENV,
+                              cwd, self.cols, self.rows, opts)
+    end
+    if not pid then
+        return nil, err
+    end
+
+    self.pid = pid
+    return pid
+end
+
 
-    return lpty.spawn(self.master, self.slave, file, args,
-                      { "PATH=/bin:/usr/bin:/usr/sbin:/usr/local/bin" },
-                      cwd, self.cols, self.rows)
+-- ends the child's input: closes its stdin on pipes, sends ^D on a pty
+function _M.eof(self)
+    if self.piped then
+        return lpty.closeinput(self.pty)
+    end
+    return self:send("\4")
 end
 
 
-function _M.expect(self, pattern, timeout)
-    if not self.fresh and find(self.buf, pattern) then
-        return true
+-- hands the session to the watchdog: its child is stopped with SIGHUP,
+-- SIGTERM and SIGKILL once silent for opts.idle seconds or older than
+-- opts.ttl, opts.grace seconds apart; waits on the session then fail with
+-- "expired (idle)" or "expired (ttl)", and opts.onexpire is called with
+-- the session, the reason and the child's exit status
+function _M.watch(self, opts)
+    if not self.pid then
+        return nil, "not spawned"
     end
 
-    local buf = {}
-    local try = (timeout or 1) / 0.1
+    local ok, err = lpty.watch(self.pty, self.pid, opts)
+    if not ok then
+        return nil, err
+    end
 
-    while try > 0 do
-        local data, err = self:read(4096, 0.1)
-        if data then
-            io.write(data)
-            buf[#buf + 1] = data
-        elseif err == "timeout" then
-            try = try - 1
-        else
-            return nil, err
+    self.watched = true
+    self.onexpire = opts.onexpire
+    return true
+end
+
+
+-- descriptors the spawned child holds besides stdin, stdout and stderr,
+-- by number; anything here was leaked into it
+function _M.fds(self)
+    if not self.pid then
+        return nil, "not spawned"
+    end
+    return lpty.fds(self.pid)
+end
+
+
+-- changes the termios profile of a live session
+function _M.tcsetattr(self, profile)
+    return lpty.tcsetattr(self.pty, profile)
+end
+
+
+-- a session whose child the watchdog stopped reads as closed; turns that
+-- into the reason, closes the master and tells the owner
+local function expired(self, err)
+    if err ~= "closed" or not self.watched then
+        return err
+    end
+
+    local reason, status = lpty.expired(self.pty)
+    if not reason then
+        return err
+    end
+
+    self.watched = nil
+    lio.destroy(self.pty)
+    if self.onexpire then
+        self.onexpire(self, reason, status)
+    end
+    return "expired (" .. reason .. ")"
+end
+
+
+-- wait hook: with lio.sethook(true) calls that would block fail with
+-- "wait" instead. Inside a coroutine the wait is handed to whoever
+-- resumes it, as coroutine.yield("wait", fd, mode, deadline), and the
+-- call retried with what is left of its timeout; see loop.lua. On the
+-- main thread nothing could resume it, so the call blocks after all.
+local gettime = timeout.gettime
+
+local function rehook(...)
+    lio.sethook(true)
+    return ...
+end
+
+local function retry(call, stop, ...)
+    if (...) ~= nil or select(2, ...) ~= "wait" then
+        return ...
+    end
+
+    local co, main = coroutine.running()
+    if not co or main then
+        lio.sethook(false)
+        return rehook(call(stop and math.max(stop - gettime(), 0) or -1))
+    end
+
+    coroutine.yield("wait", lio.waiting())
+    return retry(call, stop,
+                 call(stop and math.max(stop - gettime(), 0) or -1))
+end
+
+local function hooked(call, t)
+    return retry(call, t >= 0 and gettime() + t or nil, call(t))
+end
+
+
+local function matched(self, keep, pos, stop, ...)
+    if not pos then
+        if stop == "timeout" then
+            return nil, "unexpected output: " .. lio.peek(self.pty)
         end
+        return nil, expired(self, stop)
     end
 
-    self.fresh = false
-    self.buf = concat(buf)
+    if self.logging and not keep then
+        io.write(lio.consumed(self.pty))
+    end
 
-    local pos = find(self.buf, pattern)
-    if pos then
-        return true
+    if self.pacing then
+        self:sent()
+    end
+
+    return pos, stop, ...
+end
+
+
+-- waits for pattern and returns start, stop and captures, as offsets
+-- into the output consumed through the end of the match; output() gives
+-- that text, like expect_out(buffer), and keep leaves it buffered
+function _M.expect(self, pattern, timeout, keep)
+    local p = compile(pattern)
+    return matched(self, keep, hooked(function(t)
+        return lio.expect(self.pty, p, t, keep)
+    end, timeout or 1))
+end
+
+
+-- compiled dialogs, by spec table
+local dialogs = setmetatable({}, { __mode = "k" })
+
+local function dialog_alt(spec, state, alt)
+    local st = spec[state]
+    if st.match then
+        return st
+    end
+    return st[alt]
+end
+
+-- runs a dialog table in C until it ends, e.g.
+--   session:dialog{
+--       { { match = "[Pp]assword:", send = pass .. "\r", next = "shell" },
+--         { match = "yes/no", send = "yes\r", next = 1 } },
+--       { name = "shell", match = "%$ $", done = true },
+--   }
+-- alternatives with a call function hand over to Lua, which gets the
+-- session and the captures and may return false, msg to stop; returns
+-- true, or nil, err
+function _M.dialog(self, spec, timeout)
+    local d = dialogs[spec]
+    if not d then
+        d = lio.dialog(spec)
+        dialogs[spec] = d
+    end
+
+    local function ended(kind, state, alt, ...)
+        if not kind then
+            if state == "timeout" then
+                return nil, "unexpected output: " .. lio.peek(self.pty)
+            end
+            return nil, expired(self, state)
+        end
+        if self.logging then
+            io.write(lio.consumed(self.pty))
+        end
+        if kind == "call" then
+            local resume = ...
+            local ok, err = dialog_alt(spec, state, alt).call(self,
+                                                               select(2, ...))
+            if ok == false then
+                return nil, err
+            end
+            return resume or true
+        elseif kind == "done" then
+            return true
+        elseif kind == "fail" then
+            return nil, (...)
+        end
+        return nil, "dialog loops in state " .. state
+    end
+
+    -- a run that fails, "wait" included, tells the state it stopped in;
+    -- a hooked retry goes on from there, not from where the run started
+    local state = 1
+    local function stopped(kind, err, at, ...)
+        if not kind and at then
+            state = at
+        end
+        return kind, err, at, ...
     end
+    local function run(t)
+        return stopped(lio.run(self.pty, d, t, state))
+    end
+
+    repeat
+        local err
+        state, err = ended(hooked(run, timeout or self.timeout))
+    until type(state) ~= "number"
 
-    return nil, "unexpected output: " .. self.buf
+    return state, err
+end
+
+
+-- the output consumed by the last expect, or the part of it from i to j;
+-- only valid until the next read from the session
+function _M.output(self, i, j)
+    return lio.consumed(self.pty, i, j)
+end
+
+
+-- echoes the output consumed by expect to stdout
+function _M.log(self, on)
+    self.logging = on ~= false
+end
+
+
+-- sink mode for output that need not be kept: expect matches it in
+-- place and drops it, keeping only counters and, with opts.tail, the
+-- last bytes seen; opts.window bounds how far a match may straddle reads
+function _M.sink(self, on, opts)
+    opts = opts or {}
+    self.sinking = on ~= false
+    lio.sink(self.pty, self.sinking, opts.window, opts.tail)
+end
+
+
+-- keeps output beyond size bytes in a mapped temporary file instead of
+-- the heap; slices are still read with peek/output as usual
+function _M.spill(self, size)
+    return lio.spill(self.pty, size or 16 * 1024 * 1024)
+end
+
+
+-- returns a cursor over all output from now on, for a transcript, a live
+-- tail or a parser next to the matcher; see lio.subscribe for maxlag and
+-- policy ("block", "drop" or "detach")
+function _M.subscribe(self, maxlag, policy)
+    return lio.subscribe(self.pty, maxlag, policy)
+end
+
+
+-- returns the bytes and lines dropped in sink mode, and the kept tail
+function _M.sinkstats(self)
+    return lio.sinkstats(self.pty)
 end
 
 
@@ -98,13 +391,122 @@ end
 
 
 function _M.read(self, size, timeout)
-    return lio.read(self.master, size, timeout or self.timeout)
+    return hooked(function(t)
+        return lio.read(self.pty, size, t)
+    end, timeout or self.timeout)
+end
+
+
+-- returns the next line of output, without the line break
+function _M.readline(self, timeout)
+    return hooked(function(t)
+        return lio.readline(self.pty, t)
+    end, timeout or self.timeout)
+end
+
+
+-- returns output up to delim; fails with "limit" once max bytes are
+-- buffered without one
+function _M.read_until(self, delim, max, timeout)
+    return hooked(function(t)
+        return lio.read_until(self.pty, delim, max, t)
+    end, timeout or self.timeout)
+end
+
+
+-- reads everything the child has produced so far into the session
+-- buffer, returns the number of bytes appended and whether the child
+-- hung up
+function _M.drain(self, timeout, limit)
+    return hooked(function(t)
+        return lio.drain(self.pty, nil, limit, t)
+    end, timeout or self.timeout)
+end
+
+
+-- waits until the child has printed nothing for idle_ms, for at most
+-- timeout seconds; the output read meanwhile stays buffered
+function _M.settle(self, idle_ms, timeout)
+    local idle = (idle_ms or 200) / 1000
+    timeout = timeout or self.timeout
+
+    local co, main = coroutine.running()
+    if not co or main or not lio.sethook() then
+        return hooked(function(t)
+            return lio.settle(self.pty, idle, t)
+        end, timeout)
+    end
+
+    -- hooked: retrying settle would start the idle time over, so the
+    -- quiet spell is timed here, draining whatever is there at each turn
+    local stop = timeout >= 0 and gettime() + timeout or math.huge
+    local quiet = gettime() + idle
+    local total = 0
+    while true do
+        local n, hup = lio.drain(self.pty, nil, nil, 0)
+        if n then
+            total = total + n
+            if hup then
+                return total, true
+            elseif n > 0 then
+                quiet = gettime() + idle
+            end
+        elseif hup ~= "timeout" then
+            return nil, hup
+        end
+
+        local now = gettime()
+        if now >= quiet then
+            return total, false
+        elseif now >= stop then
+            return nil, "timeout"
+        end
+        coroutine.yield("wait", self.master, "r", math.min(quiet, stop))
+    end
 end
 
 
+-- with a table instead of a timeout the data is paced: queued and
+-- written opts.chunk bytes every opts.interval ms, plus up to opts.jitter
+-- ms, while the session is waited on; returns at once with a ticket for
+-- sent(), and opts.done is called with the session once it is through
 function _M.write(self, data, timeout)
-    self.fresh = true
-    return lio.write(self.master, data, timeout or self.timeout)
+    if type(timeout) ~= "table" then
+        return hooked(function(t)
+            return lio.write(self.pty, data, t)
+        end, timeout or self.timeout)
+    end
+
+    local opts = timeout
+    local ticket, err = lio.queue(self.pty, data, opts.chunk or 1,
+                                  (opts.interval or 0) / 1000,
+                                  (opts.jitter or 0) / 1000)
+    if not ticket then
+        return nil, err
+    end
+
+    if opts.done then
+        self.pacing = self.pacing or {}
+        table.insert(self.pacing, { ticket = ticket, done = opts.done })
+    end
+    return ticket
+end
+
+
+-- whether the paced send with ticket is through, or without one whether
+-- nothing is queued; calls the done callbacks of finished sends
+function _M.sent(self, ticket)
+    local sent, pending = lio.queued(self.pty)
+
+    local pacing = self.pacing
+    while pacing and pacing[1] and pacing[1].ticket <= sent do
+        table.remove(pacing, 1).done(self)
+    end
+
+    if ticket then
+        return sent >= ticket
+    end
+    return pending == 0
 end
 
 
@@ -116,7 +518,10 @@ end
 
 
 function _M.clean(self)
-    lio.destroy(self.master)
+    lio.destroy(self.pty)
+    if self.stderr then
+        lio.destroy(self.stderr)
+    end
 end
 
 
@@ -125,14 +530,318 @@ function _M.getfd(self)
 end
 
 
+-- true while output read ahead by readline/read_until is pending
 function _M.dirty(self)
-    return false
+    return self.pty:dirty()
 end
 
 
+-- sleeps for time seconds; hooked inside a coroutine the loop does the
+-- sleeping, with a wait on no descriptor
 function _M.wait(self, time)
+    local co, main = coroutine.running()
+    if co and not main and lio.sethook() then
+        coroutine.yield("wait", nil, nil, gettime() + time)
+        return
+    end
     lio.sleep(time)
 end
 
 
+-- sentinel round trip through the shell; the marker is split in the
+-- command so the echo of the command itself does not match
+function _M.ping(self, timeout)
+    local ok, err = self:send("printf '%s%s\\n' __EXPECT_ PING__\r")
+    if not ok then
+        return nil, err
+    end
+
+    local pos, err = hooked(function(t)
+        return lio.expect(self.pty, "__EXPECT_PING__", t)
+    end, timeout or self.timeout)
+    if not pos then
+        return nil, err
+    end
+
+    lio.clear(self.pty)
+
+    return true
+end
+
+
+local batches = 0
+
+-- runs cmds through the shell of the session in one go, so that the lot
+-- costs one round trip and no prompt matching. Each command goes on a
+-- line of its own between marker printfs, the one after it carrying its
+-- $?; the prompt and the echo of the line come before the first marker,
+-- so only what the command printed lies between them. The commands run
+-- through eval, so a trailing & or comment cannot swallow the marker,
+-- and the markers are split like ping's and tagged per batch. Returns an
+-- array of { output = ..., status = ... }, the output without its last
+-- line break (on a tty, lines end in \r\n). The commands must not read
+-- stdin, where the ones after them wait; on an error the output read so
+-- far stays buffered.
+function _M.run_batch(self, cmds, timeout)
+    if #cmds == 0 then
+        return {}
+    end
+
+    batches = batches + 1
+    local tok = string.format("%x%x%x", os.time(), self.pid or 0, batches)
+
+    local lines = {}
+    for i, cmd in ipairs(cmds) do
+        lines[#lines + 1] = string.format(
+            "printf '%%s%%s_%d_B__\\n' __EXPECT_ %s; eval '%s'; " ..
+            "printf '%%s%%s_%d_%%d__\\n' __EXPECT_ %s \"$?\"\r",
+            i, tok, (string.gsub(cmd, "'", "'\\''")), i, tok)
+    end
+
+    -- queued, so that it goes out while the output is read and neither
+    -- side can fill the tty while waiting on the other
+    local ok, err = lio.queue(self.pty, table.concat(lines))
+    if not ok then
+        return nil, err
+    end
+
+    local results
+    results, err = hooked(function(t)
+        return lio.batch(self.pty, "__EXPECT_" .. tok, #cmds, t)
+    end, timeout or self.timeout)
+    if not results then
+        return nil, expired(self, err)
+    end
+
+    if self.logging then
+        io.write(lio.consumed(self.pty))
+    end
+
+    if self.pacing then
+        self:sent()
+    end
+
+    return results
+end
+
+
+-- copies src, a file or with opts.data a string, to remote through the
+-- shell of the session. The file is mapped and sent base64 encoded to a
+-- remote base64 -d, at most opts.window blocks of opts.block lines ahead
+-- of the acknowledgements; with opts.raw it goes as is through a raw tty
+-- into head -c instead, paced by the tty alone. The remote cksum is
+-- checked at the end. Returns the number of bytes uploaded.
+function _M.upload(self, src, remote, opts)
+    opts = opts or {}
+    local timeout = opts.timeout or self.timeout
+
+    local source, err = lio.source(src, opts.data)
+    if not source then
+        return nil, err
+    end
+
+    local crc, total = source:cksum()
+    local file = "'" .. (remote:gsub("'", "'\\''")) .. "'"
+
+    -- markers are split in the command so that its echo does not match
+    local cmd
+    if opts.raw then
+        cmd = "stty raw -echo; printf '%s%s\\n' __EXPECT_ READY__; " ..
+              "head -c " .. total .. " > " .. file .. "; stty sane; "
+    else
+        cmd = "stty -echo; printf '%s%s\\n' __EXPECT_ READY__; " ..
+              "{ while IFS= read -r l; do case $l in " ..
+              "__EXPECT_ACK_*) printf '%s\\n' \"$l\" >&2;; " ..
+              "__EXPECT_EOF__) break;; " ..
+              "*) printf '%s\\n' \"$l\";; esac; done; } | " ..
+              "base64 -d > " .. file .. "; stty echo; "
+    end
+    cmd = cmd .. "printf '%s%s %s\\n' __EXPECT_ SUM__ \"$(cksum < " ..
+          file .. ")\"\r"
+
+    local ok
+    ok, err = self:send(cmd, timeout)
+    if ok then
+        ok, err = self:expect("__EXPECT_READY__", timeout)
+    end
+
+    if ok and opts.raw then
+        ok, err = lio.upload(self.pty, source, 0, total, timeout, true)
+    elseif ok then
+        local block = (opts.block or 16) * 57
+        local window = opts.window or 4
+        local off, seq, acked = 0, 0, 0
+        while ok and off < total do
+            local n = math.min(block, total - off)
+            ok, err = lio.upload(self.pty, source, off, n, timeout)
+            off = off + n
+            seq = seq + 1
+            if ok then
+                ok, err = self:send("__EXPECT_ACK_" .. seq .. "\n", timeout)
+            end
+            while ok and seq - acked >= window do
+                local ack
+                ok, err, ack = self:expect("__EXPECT_ACK_(%d+)", timeout)
+                acked = tonumber(ack) or acked
+            end
+        end
+        if ok then
+            ok, err = self:send("__EXPECT_EOF__\n", timeout)
+        end
+    end
+    source:close()
+    if not ok then
+        return nil, err
+    end
+
+    local pos, stop, sum, len = self:expect("__EXPECT_SUM__ (%d+) (%d+)",
+                                            timeout)
+    if not pos then
+        return nil, stop
+    end
+    if tonumber(sum) ~= crc or tonumber(len) ~= total then
+        return nil, "checksum mismatch"
+    end
+
+    return total
+end
+
+
+--[[ session pool ]]
+
+local pool = {}
+
+local pool_mt = { __index = pool }
+
+
+local function pool_reset(session, timeout)
+    return session:ping(timeout)
+end
+
+
+-- keeps conf.size (default conf.max) sessions spawned and logged in:
+--   conf.spawn()           -> session, required
+--   conf.login(session)    -> true on success
+--   conf.reset(session)    -> true if the session can be reused,
+--                             defaults to a ping
+--   conf.max               upper bound on open sessions, default 4
+function _M.pool(conf)
+    if type(conf.spawn) ~= "function" then
+        error("pool{spawn: function, login: function, reset: function, "
+              .. "max: int}")
+    end
+
+    local self = setmetatable({
+        spawn = conf.spawn, login = conf.login,
+        reset = conf.reset or pool_reset,
+        max = conf.max or 4,
+        timeout = conf.timeout or 5,
+        free = {}, busy = {}, count = 0,
+    }, pool_mt)
+
+    local size = conf.size or self.max
+    while self.count < size do
+        local session, err = self:open()
+        if not session then
+            self:close()
+            return nil, err
+        end
+        self.free[#self.free + 1] = session
+    end
+
+    return self
+end
+
+
+function pool.open(self)
+    local session, err = self.spawn()
+    if not session then
+        return nil, err
+    end
+
+    if self.login then
+        local ok, err = self.login(session)
+        if not ok then
+            session:clean()
+            return nil, err or "login failed"
+        end
+    end
+
+    self.count = self.count + 1
+
+    return session
+end
+
+
+function pool.discard(self, session)
+    session:clean()
+    self.count = self.count - 1
+end
+
+
+-- hands out an idle session, spawning one if none is idle and the pool
+-- is below max; fails with "busy" otherwise
+function pool.checkout(self)
+    local session = table.remove(self.free)
+    if not session then
+        if self.count >= self.max then
+            return nil, "busy"
+        end
+
+        local err
+        session, err = self:open()
+        if not session then
+            return nil, err
+        end
+    end
+
+    self.busy[session] = true
+
+    return session
+end
+
+
+-- takes a session back; one that fails the reset is replaced
+function pool.release(self, session)
+    if not self.busy[session] then
+        return nil, "not checked out"
+    end
+
+    self.busy[session] = nil
+
+    if session.sinking then
+        session:sink(false)
+    end
+    lio.clear(session.pty)
+
+    if self.reset(session, self.timeout) then
+        self.free[#self.free + 1] = session
+        return true
+    end
+
+    self:discard(session)
+
+    local fresh, err = self:open()
+    if not fresh then
+        return nil, err
+    end
+    self.free[#self.free + 1] = fresh
+
+    return true
+end
+
+
+function pool.close(self)
+    for _, session in ipairs(self.free) do
+        self:discard(session)
+    end
+    self.free = {}
+
+    for session in pairs(self.busy) do
+        self:discard(session)
+    end
+    self.busy = {}
+end
+
+
 return _M
@@ -0,0 +1,244 @@
+-- LuaJIT FFI binding of the hot lio functions.
+--
+-- Returns a table with the same interface as the lio C module: read,
+-- write, drain and the buffer methods go straight to the plain C entry
+-- points in lio_abi.c so the read/match loop can be JIT compiled, while
+-- everything else falls through to the classic module.
+
+local ffi = require "ffi"
+local lio = require "lio"
+
+local open = io.open
+local find = string.find
+local gsub = string.gsub
+local gmatch = string.gmatch
+
+
+ffi.cdef[[
+int lio_abi_version(void);
+const char *lio_abi_strerror(int err);
+int lio_abi_waitfd(int fd, int sw, double timeout);
+int lio_abi_read(int fd, char *data, size_t count, size_t *got,
+                 double timeout);
+int lio_abi_write(int fd, const char *data, size_t count, size_t *sent,
+                  double timeout);
+int lio_abi_drain(int fd, void *buf, size_t limit, size_t *got,
+                  double timeout);
+size_t lio_abi_buffer_len(void *buf);
+const char *lio_abi_buffer_ptr(void *buf);
+void lio_abi_buffer_consume(void *buf, size_t n);
+void lio_abi_buffer_clear(void *buf);
+int lio_abi_handle_fd(void *h);
+int lio_abi_handle_wfd(void *h);
+void *lio_abi_handle_buffer(void *h);
+]]
+
+
+local ABI_VERSION = 2
+
+local IO_DONE = 0
+local IO_CLOSED = -2
+
+-- default byte limit of a single drain(), as in lio.h
+local DRAINLIMIT = 1024 * 1024
+
+
+local function findlib(name)
+    for pattern in gmatch(package.cpath, "[^;]+") do
+        local path = gsub(pattern, "%?", name)
+        local f = open(path, "rb")
+        if f then
+            f:close()
+            return path
+        end
+    end
+end
+
+
+-- the ABI lives in lio, in the combined module, or in the launcher that
+-- links the combined module in and exports its symbols
+local native = package.loaded.expect_native
+local C
+if native and native.static then
+    C = ffi.C
+else
+    local name = native and "expect_native" or "lio"
+    local path = findlib(name)
+    if not path then
+        error(name .. " library not found in package.cpath")
+    end
+    C = ffi.load(path)
+end
+if C.lio_abi_version() ~= ABI_VERSION then
+    error("lio library ABI mismatch")
+end
+
+
+local size_out = ffi.new("size_t[1]")
+local scratch_size = 4096
+local scratch = ffi.new("char[?]", scratch_size)
+
+
+local buffer_mt = getmetatable(lio.buffer())
+
+
+local function strerror(rc)
+    return ffi.string(C.lio_abi_strerror(rc))
+end
+
+
+-- anything that is not a fd number is taken to be a pty handle
+local function tofd(fd)
+    if type(fd) == "number" then
+        return fd
+    end
+    return C.lio_abi_handle_fd(fd)
+end
+
+
+-- handles on pipes are written through a descriptor of their own
+local function towfd(fd)
+    if type(fd) == "number" then
+        return fd
+    end
+    return C.lio_abi_handle_wfd(fd)
+end
+
+
+local function tobuffer(buf)
+    if getmetatable(buf) == buffer_mt then
+        return buf
+    end
+    return C.lio_abi_handle_buffer(buf)
+end
+
+
+local _M = setmetatable({}, { __index = lio })
+
+
+function _M.read(fd, size, timeout)
+    -- handles may have input buffered, leave those to the C module
+    if type(fd) ~= "number" then
+        return lio.read(fd, size, timeout)
+    end
+
+    if size <= 0 then
+        error("invalid size")
+    end
+
+    if size > scratch_size then
+        scratch_size = size
+        scratch = ffi.new("char[?]", scratch_size)
+    end
+
+    local rc = C.lio_abi_read(fd, scratch, size, size_out, timeout)
+    if rc ~= IO_DONE then
+        return nil, strerror(rc)
+    end
+
+    return ffi.string(scratch, size_out[0])
+end
+
+
+function _M.write(fd, data, timeout)
+    if #data == 0 then
+        error("zero size")
+    end
+
+    local rc = C.lio_abi_write(towfd(fd), data, #data, size_out, timeout)
+    if rc ~= IO_DONE then
+        return nil, strerror(rc)
+    end
+
+    return tonumber(size_out[0])
+end
+
+
+function _M.drain(fd, buf, limit, timeout)
+    -- handles may have sends queued, leave those to the C module
+    if type(fd) ~= "number" then
+        return lio.drain(fd, buf, limit, timeout)
+    end
+
+    local rc = C.lio_abi_drain(tofd(fd), tobuffer(buf or fd),
+                               limit or DRAINLIMIT, size_out, timeout or -1)
+    if rc ~= IO_DONE and rc ~= IO_CLOSED then
+        return nil, strerror(rc)
+    end
+
+    return tonumber(size_out[0]), rc == IO_CLOSED
+end
+
+
+-- mode is "r", "w" or "rw"
+function _M.waitfd(fd, mode, timeout)
+    local sw = 0
+    if find(mode, "r", 1, true) then
+        sw = sw + 1
+    end
+    if find(mode, "w", 1, true) then
+        sw = sw + 2
+    end
+    if sw == 0 then
+        error("invalid mode")
+    end
+
+    local rc = C.lio_abi_waitfd(sw == 2 and towfd(fd) or tofd(fd), sw,
+                                timeout or -1)
+    if rc ~= IO_DONE then
+        return nil, strerror(rc)
+    end
+
+    return true
+end
+
+
+-- buffer methods, installed into the lio.buffer metatable so existing
+-- buf:get() style calls take the FFI path too
+local meths = buffer_mt.__index
+
+local function buffer_len(buf)
+    return tonumber(C.lio_abi_buffer_len(buf))
+end
+
+function meths.len(buf)
+    return buffer_len(buf)
+end
+
+function meths.get(buf, i, j)
+    local len = buffer_len(buf)
+    i = i or 1
+    j = j or -1
+
+    if i < 0 then
+        i = i + len + 1
+    end
+    if i < 1 then
+        i = 1
+    end
+    if j < 0 then
+        j = j + len + 1
+    end
+    if j > len then
+        j = len
+    end
+
+    if i > j then
+        return ""
+    end
+
+    return ffi.string(C.lio_abi_buffer_ptr(buf) + i - 1, j - i + 1)
+end
+
+function meths.consume(buf, n)
+    if n > 0 then
+        C.lio_abi_buffer_consume(buf, n)
+    end
+end
+
+function meths.clear(buf)
+    C.lio_abi_buffer_clear(buf)
+end
+
+
+return _M
@@ -0,0 +1,223 @@
+-- Reference event loop for the wait hook: runs functions as coroutines
+-- that share one thread, e.g. several sessions side by side.
+--
+--   local Loop = require "loop"
+--   local loop = Loop.new()
+--   for _, host in ipairs{ "web1", "web2" } do
+--       loop:spawn(function(host)
+--           local session = Expect.new()
+--           session:spawn("ssh", { host })
+--           session:expect("%$ ")
+--           ...
+--       end, host)
+--   end
+--   loop:run()
+--
+-- While run() goes the hook is set (lio.sethook), so that expect, read,
+-- write and the like yield ("wait", fd, mode, deadline) instead of
+-- blocking. The loop selects over the descriptors waited for and
+-- resumes a task once its descriptor is ready or its deadline passed;
+-- a wait without a descriptor is a plain timer. A host with a loop of
+-- its own does the same with its watchers and timers.
+
+local lio = require "lio"
+local ltimeout = require "ltimeout"
+
+local gettime = ltimeout.gettime
+local create = coroutine.create
+local resume = coroutine.resume
+local costatus = coroutine.status
+local unpack = unpack or table.unpack
+
+
+local _M = {}
+
+local mt = { __index = _M }
+
+
+-- select reports a descriptor once, so tasks waiting on the same one
+-- share an object
+local fdobj_mt = {
+    __index = {
+        getfd = function(self)
+            return self.fd
+        end,
+    },
+}
+
+
+function _M.new()
+    return setmetatable({
+        tasks = {},
+        objs = {},
+        rset = {}, wset = {}, rout = {}, wout = {},
+    }, mt)
+end
+
+
+-- adds fn(...) as a task, started by run(); returns the task, whose
+-- results are in task.results once it is done
+function _M.spawn(self, fn, ...)
+    local task = {
+        co = create(fn),
+        args = { n = select("#", ...), ... },
+        ready = true,
+    }
+    self.tasks[#self.tasks + 1] = task
+    return task
+end
+
+
+local function resumed(task, ok, ...)
+    if not ok then
+        error(debug.traceback(task.co, (...)), 0)
+    end
+
+    if costatus(task.co) == "dead" then
+        task.done = true
+        task.results = { n = select("#", ...), ... }
+        return
+    end
+
+    -- anything but a wait just lets the others run first
+    local what, fd, mode, deadline = ...
+    if what ~= "wait" or (not fd and not deadline) then
+        task.ready = true
+        return
+    end
+    task.fd = fd
+    task.mode = mode
+    task.deadline = deadline
+end
+
+local function step(task)
+    local args = task.args
+    task.args = nil
+    task.ready = false
+    task.fd, task.mode, task.deadline = nil, nil, nil
+    if args then
+        return resumed(task, resume(task.co, unpack(args, 1, args.n)))
+    end
+    return resumed(task, resume(task.co))
+end
+
+
+local function watch(self, set, n, task)
+    local obj = self.objs[task.fd]
+    if not obj then
+        obj = setmetatable({ fd = task.fd, tasks = {} }, fdobj_mt)
+        self.objs[task.fd] = obj
+    end
+
+    if #obj.tasks == 0 then
+        n = n + 1
+        set[n] = obj
+    end
+    obj.tasks[#obj.tasks + 1] = task
+
+    return n
+end
+
+local function wake(out)
+    for i = 1, #out do
+        local tasks = out[i].tasks
+        for j = 1, #tasks do
+            tasks[j].ready = true
+        end
+    end
+end
+
+
+-- one turn: runs the ready tasks, then waits for the next to become so;
+-- returns whether any task is left
+local function turn(self)
+    local tasks = self.tasks
+    local i = 1
+    while tasks[i] do
+        local task = tasks[i]
+        if task.ready then
+            step(task)
+        end
+        if task.done then
+            table.remove(tasks, i)
+        else
+            i = i + 1
+        end
+    end
+    if #tasks == 0 then
+        return false
+    end
+
+    for _, obj in pairs(self.objs) do
+        obj.tasks = {}
+    end
+
+    local rset, wset = self.rset, self.wset
+    local nr, nw = 0, 0
+    local stop
+    for _, task in ipairs(tasks) do
+        if task.ready then
+            stop = 0
+        elseif task.deadline and (not stop or task.deadline < stop) then
+            stop = task.deadline
+        end
+        if task.fd and not task.ready then
+            if task.mode ~= "w" then
+                nr = watch(self, rset, nr, task)
+            end
+            if task.mode ~= "r" then
+                nw = watch(self, wset, nw, task)
+            end
+        end
+    end
+    for j = nr + 1, #rset do
+        rset[j] = nil
+    end
+    for j = nw + 1, #wset do
+        wset[j] = nil
+    end
+
+    local wait = -1
+    if stop then
+        wait = math.max(stop - gettime(), 0)
+    end
+
+    local r, w, err = lio.select(rset, wset, wait, self.rout, self.wout)
+    if err and err ~= "timeout" then
+        error(err, 0)
+    end
+    if not err then
+        wake(r)
+        wake(w)
+    end
+
+    local now = gettime()
+    for _, task in ipairs(tasks) do
+        if task.deadline and task.deadline <= now then
+            task.ready = true
+        end
+    end
+
+    return true
+end
+
+
+-- runs the tasks until all are done; an error in one ends the loop and
+-- is raised again with the task's traceback
+function _M.run(self)
+    local hook = lio.sethook(true)
+    local ok, err = pcall(function()
+        while turn(self) do
+        end
+    end)
+    lio.sethook(hook)
+
+    if not ok then
+        error(err, 0)
+    end
+
+    return true
+end
+
+
+return _M
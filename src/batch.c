@@ -0,0 +1,205 @@
+/*=========================================================================*\
+* Batches
+\*=========================================================================*/
+#define _GNU_SOURCE /* memmem */
+#include "batch.h"
+#include "io.h"
+#include "sendq.h"
+
+#include <string.h>
+
+/* what batch_marker found */
+enum {
+    MARK_NONE = -1, /* not a marker */
+    MARK_PART = 0,  /* may be one, the rest has not arrived */
+    MARK_BEGIN,
+    MARK_END
+};
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int batch_marker(const char *p, const char *end, long *index,
+                        int *status, const char **next);
+static size_t batch_chomp(const char *p, size_t len);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+void batch_init(batch_t *b, const char *tag, size_t taglen,
+                batch_cmd_t *cmds, int n) {
+    b->tag = tag;
+    b->taglen = taglen;
+    b->cmds = cmds;
+    b->n = n;
+    b->next = 0;
+    b->open = 0;
+    b->scan = 0;
+    b->end = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Scans the input p (all of it, from its start every time) on from where
+* the last scan stopped
+* Returns
+*   1 once the end marker of the last command was seen, 0 before
+\*-------------------------------------------------------------------------*/
+int batch_scan(batch_t *b, const char *p, size_t len) {
+    const char *end;
+    const char *q;
+    const char *next;
+    batch_cmd_t *cmd;
+    long index;
+    int status;
+    int kind;
+
+    end = p + len;
+    while (b->next < b->n) {
+        q = (const char *)memmem(p + b->scan, len - b->scan, b->tag,
+                                 b->taglen);
+        if (q == NULL) {
+            /* a tag cut short may still complete */
+            b->scan = len >= b->taglen ? len - b->taglen + 1 : 0;
+            return 0;
+        }
+
+        kind = batch_marker(q + b->taglen, end, &index, &status, &next);
+        if (kind == MARK_PART) {
+            b->scan = q - p;
+            return 0;
+        }
+        b->scan = q - p + 1;
+        if (kind == MARK_NONE || index != b->next + 1)
+            continue;
+
+        cmd = &b->cmds[b->next];
+        if (kind == MARK_BEGIN) {
+            /* the output starts on the next line; a second begin marker
+             * is the command printing one of its own */
+            if (!b->open) {
+                cmd->off = next - p;
+                b->open = 1;
+            }
+        } else if (b->open) {
+            cmd->len = batch_chomp(p + cmd->off, (q - p) - cmd->off);
+            cmd->status = status;
+            b->open = 0;
+            b->next++;
+        }
+        b->scan = next - p;
+    }
+    b->end = b->scan;
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads the input of h until all commands of b are through; the input
+* stays buffered, b gives offsets into it
+* Returns
+*   IO_DONE, or the error that stopped it
+\*-------------------------------------------------------------------------*/
+int batch_run(batch_t *b, handle_t *h, timeout_t *tm) {
+    size_t got;
+    int eof;
+    int rc;
+
+    eof = 0;
+    for (;;) {
+        if (batch_scan(b, buffer_ptr(&h->in), buffer_len(&h->in)))
+            return IO_DONE;
+        if (eof)
+            return IO_CLOSED;
+
+        rc = sendq_drain(h, &h->in, BATCH_DRAINLIMIT, &got, tm);
+        if (rc == IO_CLOSED)
+            eof = 1;
+        else if (rc != IO_DONE)
+            return rc;
+    }
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Parses what follows a tag: _index_B__ or _index_status__, and the line
+* break ending the marker line
+* Output
+*   next: the start of the line after the marker
+* Returns
+*   MARK_BEGIN, MARK_END, MARK_PART or MARK_NONE
+\*-------------------------------------------------------------------------*/
+static int batch_marker(const char *p, const char *end, long *index,
+                        int *status, const char **next) {
+    int kind;
+    int digits;
+
+#define NEED(n) \
+    if (end - p < (n)) \
+        return MARK_PART
+
+    *status = 0;
+    NEED(1);
+    if (*p++ != '_')
+        return MARK_NONE;
+
+    *index = 0;
+    for (digits = 0;; digits++, p++) {
+        NEED(1);
+        if (*p < '0' || *p > '9' || digits > 9)
+            break;
+        *index = *index * 10 + (*p - '0');
+    }
+    if (digits == 0 || *p++ != '_')
+        return MARK_NONE;
+
+    NEED(1);
+    if (*p == 'B') {
+        kind = MARK_BEGIN;
+        p++;
+    } else {
+        kind = MARK_END;
+        for (digits = 0;; digits++, p++) {
+            NEED(1);
+            if (*p < '0' || *p > '9' || digits > 3)
+                break;
+            *status = *status * 10 + (*p - '0');
+        }
+        if (digits == 0)
+            return MARK_NONE;
+    }
+
+    NEED(2);
+    if (p[0] != '_' || p[1] != '_')
+        return MARK_NONE;
+    p += 2;
+
+    /* the tty may turn the newline into \r\n */
+    NEED(1);
+    if (*p == '\r') {
+        p++;
+        NEED(1);
+    }
+    if (*p != '\n')
+        return MARK_NONE;
+    *next = p + 1;
+
+#undef NEED
+
+    return kind;
+}
+
+/*-------------------------------------------------------------------------*\
+* Length of p without its last line break, if it ends in one
+\*-------------------------------------------------------------------------*/
+static size_t batch_chomp(const char *p, size_t len) {
+    if (len > 0 && p[len - 1] == '\n')
+        len--;
+    if (len > 0 && p[len - 1] == '\r')
+        len--;
+
+    return len;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
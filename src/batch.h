@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+/*=========================================================================*\
+* Batches
+*
+* Commands sent in one go are framed by marker lines the shell prints
+* around each of them, tag_i_B__ before command i and tag_i_s__ after
+* it, s being its $?. The splitter finds the markers in a handle's input
+* and slices it into the output and exit status of each command. Markers
+* only count once complete and in order, so input may arrive in any
+* pieces and stray text that looks like one is passed over.
+\*=========================================================================*/
+
+#include "handle.h"
+#include "timeout.h"
+
+/* byte limit of a single read */
+#define BATCH_DRAINLIMIT (1024 * 1024)
+
+typedef struct batch_cmd_s {
+    size_t off; /* output, as offsets into the input */
+    size_t len;
+    int status; /* $? of the command */
+} batch_cmd_t;
+
+typedef struct batch_s {
+    const char *tag;
+    size_t taglen;
+    batch_cmd_t *cmds;
+    int n;
+    int next;    /* command whose markers come next */
+    int open;    /* whether its begin marker was seen */
+    size_t scan; /* input offset to scan from */
+    size_t end;  /* input offset past the last marker line once done */
+} batch_t;
+
+void batch_init(batch_t *b, const char *tag, size_t taglen,
+                batch_cmd_t *cmds, int n);
+int batch_scan(batch_t *b, const char *p, size_t len);
+int batch_run(batch_t *b, handle_t *h, timeout_t *tm);
+
+#endif /* BATCH_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
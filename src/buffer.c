@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+/*=========================================================================*\
+* Growable input buffer
+\*=========================================================================*/
+#include "buffer.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int buffer_map(buffer_t *buf, size_t size);
+static void buffer_unmap(buffer_t *buf);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+void buffer_init(buffer_t *buf) {
+    buf->data = NULL;
+    buf->mark = 0;
+    buf->first = 0;
+    buf->last = 0;
+    buf->size = 0;
+    buf->spill = 0;
+    buf->fd = -1;
+    buf->seen = 0;
+    buf->tap = NULL;
+    buf->tapctx = NULL;
+}
+
+void buffer_free(buffer_t *buf) {
+    if (buf->fd >= 0)
+        buffer_unmap(buf);
+    else
+        free(buf->data);
+    buffer_init(buf);
+}
+
+/*-------------------------------------------------------------------------*\
+* Makes room for at least n more bytes at the tail
+* Input
+*   buf: buffer control structure
+*   n: number of bytes the caller is about to write
+* Returns
+*   pointer to the writable tail, or NULL if out of memory
+\*-------------------------------------------------------------------------*/
+char *buffer_reserve(buffer_t *buf, size_t n) {
+    size_t len;
+    size_t size;
+    char *data;
+
+    if (buf->size - buf->last >= n)
+        return buf->data + buf->last;
+
+    len = buffer_len(buf);
+    /* reclaim consumed space first, grow only if that is not enough */
+    if (buf->first > 0 && buf->size - len >= n) {
+        memmove(buf->data, buf->data + buf->first, len);
+    } else {
+        size = buf->size ? buf->size : BUFFER_MINSIZE;
+        while (size - len < n)
+            size *= 2;
+        /* storage that spilled stays file backed until cleared, even if
+         * the threshold was raised or turned off since */
+        if (buf->fd >= 0 || (buf->spill > 0 && size > buf->spill)) {
+            if (buffer_map(buf, size) < 0)
+                return NULL;
+            return buf->data + buf->last;
+        }
+        data = (char *)malloc(size);
+        if (data == NULL)
+            return NULL;
+        if (len > 0)
+            memcpy(data, buf->data + buf->first, len);
+        free(buf->data);
+        buf->data = data;
+        buf->size = size;
+    }
+    buf->mark = 0;
+    buf->first = 0;
+    buf->last = len;
+
+    return buf->data + buf->last;
+}
+
+/*-------------------------------------------------------------------------*\
+* Accounts for n bytes written into the area returned by buffer_reserve
+\*-------------------------------------------------------------------------*/
+void buffer_commit(buffer_t *buf, size_t n) {
+    if (buf->tap != NULL)
+        buf->tap(buf->tapctx, buf->data + buf->last, n);
+    buf->last += n;
+    buf->seen += n;
+}
+
+int buffer_append(buffer_t *buf, const char *data, size_t n) {
+    char *tail;
+
+    if (n == 0)
+        return 0;
+    tail = buffer_reserve(buf, n);
+    if (tail == NULL)
+        return -1;
+    memcpy(tail, data, n);
+    buffer_commit(buf, n);
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Drops n bytes from the head. They are not overwritten until the tail
+* has to grow, so they remain available as the consumed region.
+\*-------------------------------------------------------------------------*/
+void buffer_consume(buffer_t *buf, size_t n) {
+    if (n > buffer_len(buf))
+        n = buffer_len(buf);
+    buf->mark = buf->first;
+    buf->first += n;
+}
+
+/*-------------------------------------------------------------------------*\
+* Empties the buffer; a backing file is given up, the next spill starts
+* over with a fresh one
+\*-------------------------------------------------------------------------*/
+void buffer_clear(buffer_t *buf) {
+    if (buf->fd >= 0)
+        buffer_unmap(buf);
+    buf->mark = 0;
+    buf->first = 0;
+    buf->last = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sets the size beyond which the storage is moved into a temporary file;
+* storage already there stays until the buffer is cleared
+* Input
+*   spill: threshold in bytes, 0 to keep everything on the heap
+* Returns
+*   0 on success, -1 if spilling is not supported
+\*-------------------------------------------------------------------------*/
+int buffer_setspill(buffer_t *buf, size_t spill) {
+#ifdef _WIN32
+    if (spill > 0)
+        return -1;
+#endif
+    buf->spill = spill;
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sets a function that sees every byte committed to the buffer, or none
+\*-------------------------------------------------------------------------*/
+void buffer_settap(buffer_t *buf, void (*tap)(void *, const char *, size_t),
+                   void *ctx) {
+    buf->tap = tap;
+    buf->tapctx = ctx;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+#ifndef _WIN32
+/*-------------------------------------------------------------------------*\
+* Creates an unlinked, close-on-exec temporary file in $TMPDIR or /tmp
+\*-------------------------------------------------------------------------*/
+static int buffer_tempfile(void) {
+    char path[4096];
+    const char *dir;
+    int fd;
+
+    dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    if (snprintf(path, sizeof(path), "%s/lio-spill-XXXXXX", dir) >=
+        (int)sizeof(path))
+        return -1;
+
+#ifdef O_CLOEXEC
+    fd = mkostemp(path, O_CLOEXEC);
+#else
+    fd = mkstemp(path);
+#endif
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/*-------------------------------------------------------------------------*\
+* Moves the unconsumed bytes to the head of file backed storage of the
+* given size, creating the backing file on the first spill
+* Returns
+*   0 on success, -1 on failure with the bytes left in place
+\*-------------------------------------------------------------------------*/
+static int buffer_map(buffer_t *buf, size_t size) {
+    size_t len;
+    char *data;
+    int fd;
+
+    len = buffer_len(buf);
+    if (buf->fd >= 0) {
+        /* the old pages are part of the file, compact them in place */
+        memmove(buf->data, buf->data + buf->first, len);
+        buf->mark = 0;
+        buf->first = 0;
+        buf->last = len;
+        if (ftruncate(buf->fd, (off_t)size) < 0)
+            return -1;
+#ifdef MREMAP_MAYMOVE
+        data = (char *)mremap(buf->data, buf->size, size, MREMAP_MAYMOVE);
+#else
+        data = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            buf->fd, 0);
+        if (data != MAP_FAILED)
+            munmap(buf->data, buf->size);
+#endif
+        if (data == MAP_FAILED)
+            return -1;
+        buf->data = data;
+        buf->size = size;
+        return 0;
+    }
+
+    if ((fd = buffer_tempfile()) < 0)
+        return -1;
+    if (ftruncate(fd, (off_t)size) < 0) {
+        close(fd);
+        return -1;
+    }
+    data = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (len > 0)
+        memcpy(data, buf->data + buf->first, len);
+    free(buf->data);
+
+    buf->data = data;
+    buf->size = size;
+    buf->fd = fd;
+    buf->mark = 0;
+    buf->first = 0;
+    buf->last = len;
+
+    return 0;
+}
+
+static void buffer_unmap(buffer_t *buf) {
+    munmap(buf->data, buf->size);
+    close(buf->fd);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->fd = -1;
+}
+#else
+static int buffer_map(buffer_t *buf, size_t size) {
+    return -1;
+}
+
+static void buffer_unmap(buffer_t *buf) {
+}
+#endif
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
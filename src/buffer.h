@@ -0,0 +1,57 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+/*=========================================================================*\
+* Growable input buffer
+*
+* Bytes are appended at the tail and consumed from the head; consumed
+* space is reclaimed lazily, the next time the tail needs to grow. Until
+* then the bytes taken by the last consume stay readable, which is how
+* the text of a match is handed out after it has been consumed.
+*
+* Past an optional spill threshold the storage moves from the heap into
+* an unlinked temporary file mapped into memory, so that large outputs
+* sit in the page cache instead of the process heap. Nothing changes for
+* users of the buffer: the data stays contiguous behind buffer_ptr.
+\*=========================================================================*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_MINSIZE 4096
+
+/* buffer control structure */
+typedef struct buffer_s {
+    char *data;   /* storage */
+    size_t mark;  /* index of the bytes taken by the last consume */
+    size_t first; /* index of the first unconsumed byte */
+    size_t last;  /* index one past the last stored byte */
+    size_t size;  /* allocated size of storage */
+    size_t spill; /* size beyond which storage is file backed, 0 never */
+    int fd;       /* backing file of the storage, -1 if on the heap */
+    size_t seen;  /* bytes committed over the buffer's life */
+    /* called with every byte committed, for fan-out */
+    void (*tap)(void *ctx, const char *data, size_t n);
+    void *tapctx;
+} buffer_t;
+
+void buffer_init(buffer_t *buf);
+void buffer_free(buffer_t *buf);
+char *buffer_reserve(buffer_t *buf, size_t n);
+void buffer_commit(buffer_t *buf, size_t n);
+int buffer_append(buffer_t *buf, const char *data, size_t n);
+void buffer_consume(buffer_t *buf, size_t n);
+void buffer_clear(buffer_t *buf);
+int buffer_setspill(buffer_t *buf, size_t spill);
+void buffer_settap(buffer_t *buf, void (*tap)(void *, const char *, size_t),
+                   void *ctx);
+
+#define buffer_len(buf) ((buf)->last - (buf)->first)
+#define buffer_ptr(buf) ((buf)->data + (buf)->first)
+
+/* bytes taken by the last consume, valid until the tail grows again */
+#define buffer_consumedlen(buf) ((buf)->first - (buf)->mark)
+#define buffer_consumedptr(buf) ((buf)->data + (buf)->mark)
+
+#endif /* BUFFER_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,109 @@
+/*=========================================================================*\
+* Transfer encodings
+\*=========================================================================*/
+#include "codec.h"
+
+static const char codec_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* CRC-32 with the POSIX polynomial 0x04c11db7, most significant bit first */
+static unsigned long codec_table[256];
+static int codec_ready = 0;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static void codec_init(void);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Encodes n bytes as base64 lines of 76 characters, each ending in a
+* newline; dst must hold codec_b64size(n) bytes. Chunks whose sizes are
+* multiples of 3 encode to text that can simply be concatenated.
+* Returns
+*   length of the text written to dst
+\*-------------------------------------------------------------------------*/
+size_t codec_b64encode(const unsigned char *src, size_t n, char *dst) {
+    char *d;
+    size_t col;
+    unsigned long v;
+
+    d = dst;
+    col = 0;
+    while (n >= 3) {
+        v = ((unsigned long)src[0] << 16) | (src[1] << 8) | src[2];
+        *d++ = codec_alphabet[(v >> 18) & 63];
+        *d++ = codec_alphabet[(v >> 12) & 63];
+        *d++ = codec_alphabet[(v >> 6) & 63];
+        *d++ = codec_alphabet[v & 63];
+        src += 3;
+        n -= 3;
+        if (++col == CODEC_LINEBYTES / 3) {
+            *d++ = '\n';
+            col = 0;
+        }
+    }
+    if (n > 0) {
+        v = (unsigned long)src[0] << 16;
+        if (n > 1)
+            v |= src[1] << 8;
+        *d++ = codec_alphabet[(v >> 18) & 63];
+        *d++ = codec_alphabet[(v >> 12) & 63];
+        *d++ = n > 1 ? codec_alphabet[(v >> 6) & 63] : '=';
+        *d++ = '=';
+        col++;
+    }
+    if (col > 0)
+        *d++ = '\n';
+
+    return d - dst;
+}
+
+/*-------------------------------------------------------------------------*\
+* Runs n more bytes through the CRC of cksum(1), starting from 0
+\*-------------------------------------------------------------------------*/
+unsigned long codec_crc(unsigned long crc, const unsigned char *p, size_t n) {
+    if (!codec_ready)
+        codec_init();
+    while (n-- > 0)
+        crc = ((crc << 8) ^ codec_table[((crc >> 24) ^ *p++) & 0xff]) &
+              0xffffffffUL;
+
+    return crc;
+}
+
+/*-------------------------------------------------------------------------*\
+* Finishes a CRC over len bytes into the value cksum(1) prints: the length
+* goes in as well, low byte first, and the result is complemented
+\*-------------------------------------------------------------------------*/
+unsigned long codec_cksum(unsigned long crc, double len) {
+    unsigned char c;
+
+    for (; len >= 1; len = (double)(unsigned long long)(len / 256)) {
+        c = (unsigned char)((unsigned long long)len & 0xff);
+        crc = codec_crc(crc, &c, 1);
+    }
+
+    return ~crc & 0xffffffffUL;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static void codec_init(void) {
+    unsigned long c;
+    int i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        c = (unsigned long)i << 24;
+        for (j = 0; j < 8; j++)
+            c = c & 0x80000000UL ? (c << 1) ^ 0x04c11db7UL : c << 1;
+        codec_table[i] = c & 0xffffffffUL;
+    }
+    codec_ready = 1;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,26 @@
+#ifndef CODEC_H
+#define CODEC_H
+/*=========================================================================*\
+* Transfer encodings
+*
+* Base64 in the line format base64(1) writes and decodes, and the CRC of
+* POSIX cksum(1), so that an upload can be decoded and checked with the
+* tools a remote shell already has.
+\*=========================================================================*/
+
+#include <stddef.h>
+
+/* input bytes per encoded line, 76 characters of base64 */
+#define CODEC_LINEBYTES 57
+
+/* room codec_b64encode needs for n bytes, newlines included */
+#define codec_b64size(n) \
+    (((n) + CODEC_LINEBYTES - 1) / CODEC_LINEBYTES * 77 + 4)
+
+size_t codec_b64encode(const unsigned char *src, size_t n, char *dst);
+unsigned long codec_crc(unsigned long crc, const unsigned char *p, size_t n);
+unsigned long codec_cksum(unsigned long crc, double len);
+
+#endif /* CODEC_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
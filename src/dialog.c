@@ -0,0 +1,180 @@
+/*=========================================================================*\
+* Dialogs
+\*=========================================================================*/
+#include "dialog.h"
+#include "io.h"
+#include "sendq.h"
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int dialog_match(dialog_state_t *st, lua_State *L, const char *p,
+                        size_t len, const char **end, match_state_t *ms);
+static int dialog_send(handle_t *h, dialog_alt_t *alt, timeout_t *tm);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+void dialog_free(dialog_t *d) {
+    dialog_state_t *st;
+    int i;
+    int j;
+
+    for (i = 0; i < d->nstates; i++) {
+        st = &d->states[i];
+        for (j = 0; j < st->nalts; j++) {
+            pattern_free(&st->alts[j].pat);
+            free(st->alts[j].send);
+            free(st->alts[j].msg);
+        }
+        free(st->alts);
+        free(st->name);
+    }
+    free(d->states);
+    d->states = NULL;
+    d->nstates = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Runs a dialog on a handle from *state until it ends
+* Input
+*   timeout: seconds each state may wait, for states without their own
+* Output
+*   state, alt: where it ended, alt is -1 if no alternative matched
+*   action: DIALOG_DONE, DIALOG_FAIL, DIALOG_CALL or DIALOG_LOOP
+*   ms: captures of the last match, they point into the consumed input
+* Returns
+*   IO_DONE once the dialog ended, or the error that stopped it
+\*-------------------------------------------------------------------------*/
+int dialog_run(dialog_t *d, handle_t *h, lua_State *L, double timeout,
+               int *state, int *alt, int *action, match_state_t *ms) {
+    dialog_state_t *st;
+    dialog_alt_t *a;
+    const char *p;
+    const char *end;
+    size_t len;
+    size_t got;
+    timeout_t tm;
+    long steps;
+    int eof;
+    int rc;
+
+    *alt = -1;
+    for (steps = 0; steps < DIALOG_MAXSTEPS; steps++) {
+        st = &d->states[*state];
+        timeout_init(&tm, -1, st->timeout >= 0 ? st->timeout : timeout);
+        timeout_markstart(&tm);
+
+        eof = 0;
+        for (;;) {
+            p = buffer_ptr(&h->in);
+            len = buffer_len(&h->in);
+            if ((*alt = dialog_match(st, L, p, len, &end, ms)) >= 0)
+                break;
+
+            if (h->sink.on && len > h->sink.window)
+                handle_discard(h, len - h->sink.window);
+            if (eof)
+                return IO_CLOSED;
+
+            rc = sendq_drain(h, &h->in, DIALOG_DRAINLIMIT, &got, &tm);
+            if (rc == IO_CLOSED) {
+                eof = 1;
+            } else if (rc == IO_TIMEOUT && st->ontimeout >= 0) {
+                break;
+            } else if (rc != IO_DONE) {
+                return rc;
+            }
+        }
+
+        if (*alt < 0) {
+            *state = st->ontimeout;
+            continue;
+        }
+
+        a = &st->alts[*alt];
+        if (h->sink.on)
+            handle_discard(h, end - p);
+        else
+            buffer_consume(&h->in, end - p);
+
+        if (a->send != NULL) {
+            timeout_init(&tm, -1, st->timeout >= 0 ? st->timeout : timeout);
+            timeout_markstart(&tm);
+            if ((rc = dialog_send(h, a, &tm)) != IO_DONE)
+                return rc;
+        }
+
+        if (a->action != DIALOG_GOTO) {
+            *action = a->action;
+            return IO_DONE;
+        }
+        *state = a->next;
+    }
+
+    *action = DIALOG_LOOP;
+
+    return IO_DONE;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Finds the alternative matching earliest in the input; the first one
+* listed wins a tie
+* Returns
+*   index of the alternative, or -1 if none matches
+\*-------------------------------------------------------------------------*/
+static int dialog_match(dialog_state_t *st, lua_State *L, const char *p,
+                        size_t len, const char **end, match_state_t *ms) {
+    match_state_t cand;
+    const char *best;
+    const char *start;
+    const char *e;
+    int found;
+    int i;
+
+    best = NULL;
+    found = -1;
+    for (i = 0; i < st->nalts; i++) {
+        start = pattern_find(&st->alts[i].pat, &cand, L, p, len, 0, &e);
+        if (start != NULL && (best == NULL || start < best)) {
+            best = start;
+            *end = e;
+            *ms = cand;
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+/*-------------------------------------------------------------------------*\
+* Writes the reply of an alternative in full. The match it answers is
+* already consumed, so the wait hook is held off: a reply cut short could
+* not be resumed.
+\*-------------------------------------------------------------------------*/
+static int dialog_send(handle_t *h, dialog_alt_t *alt, timeout_t *tm) {
+    size_t total;
+    size_t sent;
+    int hook;
+    int rc;
+
+    hook = io_gethook();
+    io_sethook(0);
+    rc = IO_DONE;
+    total = 0;
+    while (total < alt->sendlen) {
+        rc = io_write(&h->wfd, alt->send + total, alt->sendlen - total, &sent,
+                      tm);
+        if (rc != IO_DONE)
+            break;
+        total += sent;
+    }
+    io_sethook(hook);
+
+    return rc;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,58 @@
+#ifndef DIALOG_H
+#define DIALOG_H
+/*=========================================================================*\
+* Dialogs
+*
+* A dialog is a state machine compiled from a Lua table. Each state waits
+* for the earliest match among its alternatives; the matching alternative
+* sends its reply and moves on to another state, or ends the dialog. The
+* whole exchange runs in C on a handle's input, Lua only sees the end.
+\*=========================================================================*/
+
+#include "handle.h"
+#include "match.h"
+
+/* what an alternative does after its reply */
+enum {
+    DIALOG_GOTO = 0, /* continue with state next */
+    DIALOG_DONE,     /* end the dialog successfully */
+    DIALOG_FAIL,     /* end the dialog with msg */
+    DIALOG_CALL,     /* return to Lua, which may resume at next */
+    DIALOG_LOOP      /* not an action: gave up after too many steps */
+};
+
+/* transitions before a run is considered to loop */
+#define DIALOG_MAXSTEPS 100000
+
+/* byte limit of a single read */
+#define DIALOG_DRAINLIMIT (1024 * 1024)
+
+typedef struct dialog_alt_s {
+    pattern_t pat;  /* what to wait for */
+    char *send;     /* reply, NULL for none */
+    size_t sendlen;
+    int action;     /* DIALOG_GOTO, DIALOG_DONE, DIALOG_FAIL or DIALOG_CALL */
+    int next;       /* state for DIALOG_GOTO and after DIALOG_CALL */
+    char *msg;      /* message of DIALOG_FAIL */
+} dialog_alt_t;
+
+typedef struct dialog_state_s {
+    char *name;          /* label, NULL for none */
+    dialog_alt_t *alts;
+    int nalts;
+    double timeout;      /* seconds, negative for the run's timeout */
+    int ontimeout;       /* state to go to on timeout, -1 to fail */
+} dialog_state_t;
+
+typedef struct dialog_s {
+    dialog_state_t *states;
+    int nstates;
+} dialog_t;
+
+void dialog_free(dialog_t *d);
+int dialog_run(dialog_t *d, handle_t *h, lua_State *L, double timeout,
+               int *state, int *alt, int *action, match_state_t *ms);
+
+#endif /* DIALOG_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,48 @@
+/*=========================================================================*\
+* Combined native module
+\*=========================================================================*/
+#include "expect_native.h"
+#include "lio.h"
+#include "lpty.h"
+#include "ltimeout.h"
+
+static const luaL_Reg expect_native_mods[] = {{"lpty", luaopen_lpty},
+                                              {"lio", luaopen_lio},
+                                              {"ltimeout", luaopen_ltimeout},
+                                              {NULL, NULL}};
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Initializes module; returns a table with the names of the modules it
+* holds and static = false, which a launcher linking it in sets to true
+\*-------------------------------------------------------------------------*/
+LUALIB_API int luaopen_expect_native(lua_State *L) {
+    const luaL_Reg *mod;
+    int i;
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_newtable(L);
+    for (mod = expect_native_mods, i = 1; mod->name != NULL; mod++, i++) {
+        lua_pushcfunction(L, mod->func);
+        lua_setfield(L, -3, mod->name);
+        lua_pushstring(L, mod->name);
+        lua_rawseti(L, -2, i);
+    }
+
+    lua_newtable(L);
+    lua_insert(L, -2);
+    lua_setfield(L, -2, "modules");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "static");
+
+    /* leave only the module table */
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
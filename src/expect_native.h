@@ -0,0 +1,19 @@
+#ifndef EXPECT_NATIVE_H
+#define EXPECT_NATIVE_H
+/*=========================================================================*\
+* Combined native module
+*
+* lpty, lio and ltimeout built into a single shared object, so startup
+* loads and resolves one library instead of three. Requiring it registers
+* the three modules in package.preload; they are opened, and found by
+* require under their usual names, on first use.
+\*=========================================================================*/
+
+#include "lauxlib.h"
+#include "lua.h"
+
+LUALIB_API int luaopen_expect_native(lua_State *L);
+
+#endif /* EXPECT_NATIVE_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
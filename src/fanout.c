@@ -0,0 +1,299 @@
+/*=========================================================================*\
+* Output fan-out
+\*=========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "fanout.h"
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static chunk_t *fanout_chunk(fanout_t *fan, size_t n);
+static void fanout_collect(fanout_t *fan);
+static void fanout_police(fanout_t *fan);
+static double cursor_pos(cursor_t *cur);
+static void cursor_move(cursor_t *cur, chunk_t *chunk, size_t off);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+fanout_t *fanout_new(size_t chunksize) {
+    fanout_t *fan;
+
+    fan = (fanout_t *)calloc(1, sizeof(fanout_t));
+    if (fan == NULL)
+        return NULL;
+    fan->chunksize = chunksize ? chunksize : FANOUT_CHUNKSIZE;
+
+    return fan;
+}
+
+/*-------------------------------------------------------------------------*\
+* Frees the chunks; cursors still attached are detached, not freed, as
+* they belong to their consumers
+\*-------------------------------------------------------------------------*/
+void fanout_free(fanout_t *fan) {
+    chunk_t *chunk;
+
+    if (fan == NULL)
+        return;
+    while (fan->cursors != NULL)
+        cursor_detach(fan->cursors);
+    while ((chunk = fan->head) != NULL) {
+        fan->head = chunk->next;
+        free(chunk);
+    }
+    free(fan);
+}
+
+/*-------------------------------------------------------------------------*\
+* Appends input for all cursors. Nothing is kept while no cursor is
+* attached.
+* Returns
+*   0 on success, -1 if out of memory
+\*-------------------------------------------------------------------------*/
+int fanout_append(fanout_t *fan, const char *data, size_t n) {
+    chunk_t *chunk;
+    size_t count;
+
+    fan->pos += n;
+    if (fan->cursors == NULL)
+        return 0;
+
+    while (n > 0) {
+        chunk = fan->tail;
+        if (chunk == NULL || chunk->len == chunk->size) {
+            /* policing may have detached the last cursor */
+            if ((chunk = fanout_chunk(fan, n)) == NULL)
+                return fan->cursors != NULL ? -1 : 0;
+        }
+        count = chunk->size - chunk->len;
+        if (count > n)
+            count = n;
+        memcpy(chunk->data + chunk->len, data, count);
+        chunk->len += count;
+        data += count;
+        n -= count;
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Buffer tap feeding a fan-out, see buffer_settap
+\*-------------------------------------------------------------------------*/
+void fanout_tap(void *fan, const char *data, size_t n) {
+    fanout_append((fanout_t *)fan, data, n);
+}
+
+/*-------------------------------------------------------------------------*\
+* Attaches a cursor at the current end of the stream
+* Input
+*   maxlag: bytes the cursor may fall behind before policy applies, 0 for
+*           no limit
+\*-------------------------------------------------------------------------*/
+void cursor_attach(cursor_t *cur, fanout_t *fan, double maxlag, int policy) {
+    memset(cur, 0, sizeof(cursor_t));
+    cur->fan = fan;
+    cur->maxlag = maxlag;
+    cur->policy = policy;
+
+    cur->next = fan->cursors;
+    if (fan->cursors != NULL)
+        fan->cursors->prev = cur;
+    fan->cursors = cur;
+
+    if (fan->tail != NULL)
+        cursor_move(cur, fan->tail, fan->tail->len);
+}
+
+void cursor_detach(cursor_t *cur) {
+    fanout_t *fan;
+
+    if ((fan = cur->fan) == NULL)
+        return;
+    cursor_move(cur, NULL, 0);
+    if (cur->prev != NULL)
+        cur->prev->next = cur->next;
+    else
+        fan->cursors = cur->next;
+    if (cur->next != NULL)
+        cur->next->prev = cur->prev;
+    cur->fan = NULL;
+    cur->prev = cur->next = NULL;
+    fanout_collect(fan);
+}
+
+/*-------------------------------------------------------------------------*\
+* Points data at the next unread bytes, in place
+* Returns
+*   how many contiguous bytes there are, 0 if none
+\*-------------------------------------------------------------------------*/
+size_t cursor_peek(cursor_t *cur, const char **data) {
+    fanout_t *fan;
+    chunk_t *chunk;
+
+    *data = NULL;
+    if ((fan = cur->fan) == NULL)
+        return 0;
+
+    chunk = cur->chunk;
+    if (chunk == NULL) {
+        /* attached before anything was appended */
+        if (fan->head == NULL)
+            return 0;
+        cursor_move(cur, fan->head, 0);
+        chunk = cur->chunk;
+    }
+    if (cur->off == chunk->len && chunk->next != NULL) {
+        cursor_move(cur, chunk->next, 0);
+        fanout_collect(fan);
+        chunk = cur->chunk;
+    }
+
+    *data = chunk->data + cur->off;
+
+    return chunk->len - cur->off;
+}
+
+/*-------------------------------------------------------------------------*\
+* Marks n bytes returned by cursor_peek as read
+\*-------------------------------------------------------------------------*/
+void cursor_advance(cursor_t *cur, size_t n) {
+    if (cur->chunk != NULL)
+        cur->off += n;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the number of bytes the cursor has not read yet
+\*-------------------------------------------------------------------------*/
+double cursor_pending(cursor_t *cur) {
+    if (cur->fan == NULL)
+        return 0;
+
+    return cur->fan->pos - cursor_pos(cur);
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Links a new chunk at the tail; cursors get no reference on it, they
+* move in when they have read the chunk before
+* Returns
+*   the chunk, NULL if out of memory or if no cursor is left to fill it for
+\*-------------------------------------------------------------------------*/
+static chunk_t *fanout_chunk(fanout_t *fan, size_t n) {
+    chunk_t *chunk;
+    size_t size;
+
+    size = n > fan->chunksize ? n : fan->chunksize;
+    chunk = (chunk_t *)malloc(sizeof(chunk_t) + size - 1);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->pos = fan->pos - n;
+    chunk->len = 0;
+    chunk->size = size;
+    chunk->refs = 0;
+
+    if (fan->tail != NULL)
+        fan->tail->next = chunk;
+    else
+        fan->head = chunk;
+    fan->tail = chunk;
+
+    /* lag is only looked at once per chunk; the chunk is held meanwhile,
+     * cursors detached on the way collect the ones before it only */
+    chunk->refs++;
+    fanout_police(fan);
+    chunk->refs--;
+    fanout_collect(fan);
+
+    /* with the last cursor gone it was collected too */
+    if (fan->cursors == NULL)
+        return NULL;
+
+    return chunk;
+}
+
+/*-------------------------------------------------------------------------*\
+* Frees chunks at the head no cursor needs any more. A cursor that has not
+* got a chunk yet needs everything from the head.
+\*-------------------------------------------------------------------------*/
+static void fanout_collect(fanout_t *fan) {
+    chunk_t *chunk;
+    cursor_t *cur;
+
+    for (cur = fan->cursors; cur != NULL; cur = cur->next) {
+        if (cur->chunk == NULL)
+            return;
+    }
+
+    while ((chunk = fan->head) != NULL && chunk->refs == 0 &&
+           (chunk->next != NULL || fan->cursors == NULL)) {
+        fan->head = chunk->next;
+        if (fan->head == NULL)
+            fan->tail = NULL;
+        free(chunk);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Applies the lag policy of every cursor
+\*-------------------------------------------------------------------------*/
+static void fanout_police(fanout_t *fan) {
+    cursor_t *cur;
+    cursor_t *next;
+    chunk_t *chunk;
+    double pos;
+
+    for (cur = fan->cursors; cur != NULL; cur = next) {
+        next = cur->next;
+        if (cur->policy == FANOUT_BLOCK || cur->maxlag <= 0)
+            continue;
+        pos = cursor_pos(cur);
+        if (fan->pos - pos <= cur->maxlag)
+            continue;
+        if (cur->policy == FANOUT_DETACH) {
+            cursor_detach(cur);
+            continue;
+        }
+        /* skip whole chunks until within the limit */
+        chunk = cur->chunk != NULL ? cur->chunk : fan->head;
+        while (chunk->next != NULL &&
+               fan->pos - chunk->next->pos > cur->maxlag)
+            chunk = chunk->next;
+        if (chunk->next != NULL)
+            chunk = chunk->next;
+        cur->dropped += chunk->pos - pos;
+        cursor_move(cur, chunk, 0);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the stream offset of the next byte the cursor reads
+\*-------------------------------------------------------------------------*/
+static double cursor_pos(cursor_t *cur) {
+    if (cur->chunk != NULL)
+        return cur->chunk->pos + cur->off;
+    if (cur->fan->head != NULL)
+        return cur->fan->head->pos;
+
+    return cur->fan->pos;
+}
+
+/*-------------------------------------------------------------------------*\
+* Moves a cursor to another chunk, passing its reference along
+\*-------------------------------------------------------------------------*/
+static void cursor_move(cursor_t *cur, chunk_t *chunk, size_t off) {
+    if (cur->chunk != NULL)
+        cur->chunk->refs--;
+    if (chunk != NULL)
+        chunk->refs++;
+    cur->chunk = chunk;
+    cur->off = off;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,65 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+/*=========================================================================*\
+* Output fan-out
+*
+* Input of a session is appended once to a list of chunks; every consumer
+* reads it through its own cursor, straight out of the chunks. A chunk is
+* counted by the cursors positioned in it and freed once the slowest one
+* has moved past. Consumers that fall more than maxlag bytes behind are
+* either skipped ahead or detached, as they choose.
+\*=========================================================================*/
+
+#include <stddef.h>
+
+/* default size of a chunk */
+#define FANOUT_CHUNKSIZE 65536
+
+/* what happens to a cursor lagging more than maxlag bytes */
+enum {
+    FANOUT_BLOCK = 0, /* nothing, the chunks are kept for it */
+    FANOUT_DROP,      /* skip it ahead, counting the skipped bytes */
+    FANOUT_DETACH     /* detach it, further reads fail */
+};
+
+typedef struct chunk_s {
+    struct chunk_s *next;
+    double pos;  /* stream offset of data[0] */
+    size_t len;  /* bytes stored */
+    size_t size; /* bytes allocated */
+    int refs;    /* cursors positioned in this chunk */
+    char data[1];
+} chunk_t;
+
+typedef struct cursor_s {
+    struct fanout_s *fan; /* NULL once detached */
+    struct cursor_s *prev;
+    struct cursor_s *next;
+    chunk_t *chunk; /* chunk holding the next unread byte */
+    size_t off;     /* offset of that byte in chunk */
+    double maxlag;  /* bytes it may fall behind, 0 for no limit */
+    int policy;     /* FANOUT_BLOCK, FANOUT_DROP or FANOUT_DETACH */
+    double dropped; /* bytes skipped by FANOUT_DROP */
+} cursor_t;
+
+typedef struct fanout_s {
+    chunk_t *head;
+    chunk_t *tail;
+    double pos;       /* stream offset of the next byte appended */
+    size_t chunksize; /* size of new chunks */
+    cursor_t *cursors;
+} fanout_t;
+
+fanout_t *fanout_new(size_t chunksize);
+void fanout_free(fanout_t *fan);
+int fanout_append(fanout_t *fan, const char *data, size_t n);
+void fanout_tap(void *fan, const char *data, size_t n);
+void cursor_attach(cursor_t *cur, fanout_t *fan, double maxlag, int policy);
+void cursor_detach(cursor_t *cur);
+size_t cursor_peek(cursor_t *cur, const char **data);
+void cursor_advance(cursor_t *cur, size_t n);
+double cursor_pending(cursor_t *cur);
+
+#endif /* FANOUT_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
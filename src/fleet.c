@@ -0,0 +1,943 @@
+/*=========================================================================*\
+* Fleet runner
+*
+*   expect-fleet run [-w workers] [-c sessions] [-r retries] [-b backoff]
+*                    [-s board] [-o output] script inventory
+*   expect-fleet status [-a] [board]
+*
+* The script is loaded once, before the workers are forked, and returns
+* a function called as fn(host, args...) for every inventory line of the
+* form "host [args...]". Each call runs as a coroutine, so a script that
+* waits through fleet.wait(fd, mode, timeout) or fleet.sleep(seconds)
+* lets its worker drive other hosts meanwhile, up to the worker's share
+* of the sessions. A true first result is success; nil, err or an error
+* is a failure, retried with exponential backoff.
+*
+* Progress is kept in a status board, a file mapped shared by all
+* workers. Every entry has a single writer and a sequence count, so the
+* status command reads it without taking locks. Results are written as
+* one JSON line per host.
+\*=========================================================================*/
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#include "buffer.h"
+#include "timeout.h"
+
+#define FLEET_MAGIC 0x31544c46 /* "FLT1" */
+#define FLEET_HOSTLEN 64
+#define FLEET_MSGLEN 128
+#define FLEET_BOARD "/dev/shm/expect-fleet"
+#define FLEET_MAXSLOTS 256
+#define FLEET_JSONDEPTH 16
+
+#define FLEET_WAITR 1
+#define FLEET_WAITW 2
+
+enum {
+    FLEET_PENDING = 0,
+    FLEET_RUNNING,
+    FLEET_RETRY,
+    FLEET_OK,
+    FLEET_FAILED,
+    FLEET_NSTATES
+};
+
+static const char *fleet_states[] = {"pending", "running", "retry", "ok",
+                                     "failed"};
+
+/* status of one host, written only by the worker running it */
+typedef struct fleet_entry_s {
+    unsigned seq; /* odd while an update is in progress */
+    int state;
+    int attempts;
+    int worker;
+    double started;
+    double finished;
+    char host[FLEET_HOSTLEN];
+    char msg[FLEET_MSGLEN];
+} fleet_entry_t;
+
+/* status board, mapped shared from a file */
+typedef struct fleet_board_s {
+    unsigned magic;
+    int nhosts;
+    int nworkers;
+    int pid;
+    double started;
+    int next; /* next entry to be claimed by a worker */
+    fleet_entry_t entries[1];
+} fleet_board_t;
+
+/* one inventory line */
+typedef struct fleet_host_s {
+    char *name;
+    char **args;
+    int nargs;
+} fleet_host_t;
+
+/* one host being driven by a worker */
+typedef struct fleet_task_s {
+    lua_State *co;  /* NULL while waiting to be retried */
+    int ref;        /* keeps co from being collected */
+    int entry;      /* index on the board, -1 for a free slot */
+    int attempt;
+    double started;
+    double wake;    /* resume at this time, -1 for no limit */
+    int fd;         /* wait for this descriptor, -1 for none */
+    int mode;       /* FLEET_WAITR or FLEET_WAITW */
+} fleet_task_t;
+
+/* runner control structure */
+typedef struct fleet_s {
+    int workers;
+    int sessions;
+    int retries;
+    double backoff;
+    const char *path;
+    const char *output;
+    fleet_host_t *hosts;
+    int nhosts;
+    fleet_board_t *board;
+    size_t size;
+    int out;
+    int worker;
+    int fn;
+    fleet_task_t *current;
+    pid_t *pids;
+} fleet_t;
+
+/* one runner per process, fleet.note() finds the running task here */
+static fleet_t fleet;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int fleet_usage(void);
+static int fleet_run(int argc, char **argv);
+static int fleet_status(int argc, char **argv);
+static int fleet_inventory(const char *path);
+static fleet_board_t *fleet_map(const char *path, int nhosts, size_t *size);
+static void fleet_worker(lua_State *L);
+static void fleet_start(lua_State *L, fleet_task_t *t);
+static void fleet_resume(lua_State *L, fleet_task_t *t, int nargs);
+static void fleet_finish(lua_State *L, fleet_task_t *t, int ok);
+static void fleet_poll(lua_State *L, fleet_task_t *tasks, int slots);
+static void fleet_report(int entry, int ok, int attempts, double elapsed,
+                         int worker, lua_State *L, int idx, const char *err);
+static void fleet_update(int entry, int state, int attempts, const char *msg);
+static void fleet_read(fleet_entry_t *e, fleet_entry_t *copy);
+static void fleet_json(buffer_t *b, lua_State *L, int idx, int depth);
+static void fleet_jsonstr(buffer_t *b, const char *s, size_t len);
+static void fleet_signal(int sig);
+
+static int fleet_lnote(lua_State *L);
+static int fleet_lwait(lua_State *L);
+static int fleet_lsleep(lua_State *L);
+
+static luaL_Reg fleet_funcs[] = {{"note", fleet_lnote},
+                                 {"wait", fleet_lwait},
+                                 {"sleep", fleet_lsleep},
+                                 {NULL, NULL}};
+
+/*=========================================================================*\
+* Exported functions
+\*=========================================================================*/
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "run") == 0)
+        return fleet_run(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "status") == 0)
+        return fleet_status(argc - 1, argv + 1);
+
+    return fleet_usage();
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static int fleet_usage(void) {
+    fprintf(stderr,
+            "usage: expect-fleet run [-w workers] [-c sessions] [-r retries]\n"
+            "                        [-b backoff] [-s board] [-o output]\n"
+            "                        script inventory\n"
+            "       expect-fleet status [-a] [board]\n");
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* run: loads the script, forks the workers and waits for them
+\*-------------------------------------------------------------------------*/
+static int fleet_run(int argc, char **argv) {
+    lua_State *L;
+    fleet_entry_t e;
+    int status;
+    int opt;
+    int i;
+    int j;
+    pid_t pid;
+
+    fleet.workers = 4;
+    fleet.sessions = 0;
+    fleet.retries = 0;
+    fleet.backoff = 1.0;
+    fleet.path = FLEET_BOARD;
+    fleet.output = "-";
+
+    while ((opt = getopt(argc, argv, "w:c:r:b:s:o:")) != -1) {
+        switch (opt) {
+        case 'w':
+            fleet.workers = atoi(optarg);
+            break;
+        case 'c':
+            fleet.sessions = atoi(optarg);
+            break;
+        case 'r':
+            fleet.retries = atoi(optarg);
+            break;
+        case 'b':
+            fleet.backoff = atof(optarg);
+            break;
+        case 's':
+            fleet.path = optarg;
+            break;
+        case 'o':
+            fleet.output = optarg;
+            break;
+        default:
+            return fleet_usage();
+        }
+    }
+    if (argc - optind != 2 || fleet.workers < 1 || fleet.retries < 0)
+        return fleet_usage();
+    if (fleet.sessions < fleet.workers)
+        fleet.sessions = fleet.workers;
+
+    if (fleet_inventory(argv[optind + 1]) < 0)
+        return 1;
+    if (fleet.workers > fleet.nhosts)
+        fleet.workers = fleet.nhosts > 0 ? fleet.nhosts : 1;
+
+    if (strcmp(fleet.output, "-") == 0) {
+        fleet.out = STDOUT_FILENO;
+    } else {
+        fleet.out = open(fleet.output,
+                         O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fleet.out < 0) {
+            fprintf(stderr, "expect-fleet: %s: %s\n", fleet.output,
+                    strerror(errno));
+            return 1;
+        }
+    }
+
+    fleet.board = fleet_map(fleet.path, fleet.nhosts, &fleet.size);
+    if (fleet.board == NULL)
+        return 1;
+    fleet.board->nworkers = fleet.workers;
+
+    /* the script is compiled and run once, the workers inherit it */
+    L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_register(L, "fleet", fleet_funcs);
+    lua_pop(L, 1);
+    if (luaL_loadfile(L, argv[optind]) != 0 || lua_pcall(L, 0, 1, 0) != 0) {
+        fprintf(stderr, "expect-fleet: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    if (!lua_isfunction(L, -1)) {
+        fprintf(stderr, "expect-fleet: %s must return a function\n",
+                argv[optind]);
+        return 1;
+    }
+    fleet.fn = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    signal(SIGPIPE, SIG_IGN);
+    fflush(NULL);
+
+    fleet.pids = (pid_t *)calloc(fleet.workers, sizeof(pid_t));
+    if (fleet.pids == NULL)
+        return 1;
+    for (i = 0; i < fleet.workers; i++) {
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "expect-fleet: fork: %s\n", strerror(errno));
+            break;
+        }
+        if (pid == 0) {
+            fleet.worker = i;
+            lua_getglobal(L, "fleet");
+            lua_pushinteger(L, i + 1);
+            lua_setfield(L, -2, "worker");
+            lua_pop(L, 1);
+            fleet_worker(L);
+            _exit(0);
+        }
+        fleet.pids[i] = pid;
+    }
+
+    signal(SIGINT, fleet_signal);
+    signal(SIGTERM, fleet_signal);
+
+    /* hosts left running by a worker that died have failed */
+    while ((pid = wait(&status)) > 0 || (pid < 0 && errno == EINTR)) {
+        if (pid < 0)
+            continue;
+        for (i = 0; i < fleet.workers && fleet.pids[i] != pid; i++)
+            ;
+        if (i == fleet.workers ||
+            (WIFEXITED(status) && WEXITSTATUS(status) == 0))
+            continue;
+        fleet.pids[i] = 0;
+        for (j = 0; j < fleet.nhosts; j++) {
+            fleet_read(&fleet.board->entries[j], &e);
+            if (e.worker != i ||
+                (e.state != FLEET_RUNNING && e.state != FLEET_RETRY))
+                continue;
+            fleet.worker = i;
+            fleet_update(j, FLEET_FAILED, e.attempts, "worker died");
+            fleet_report(j, 0, e.attempts, timeout_gettime() - e.started, i,
+                         NULL, 0, "worker died");
+        }
+    }
+
+    lua_close(L);
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Forwards SIGINT and SIGTERM to the workers
+\*-------------------------------------------------------------------------*/
+static void fleet_signal(int sig) {
+    int i;
+
+    for (i = 0; i < fleet.workers; i++) {
+        if (fleet.pids[i] > 0)
+            kill(fleet.pids[i], SIGTERM);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads "host [args...]" lines, skipping blank lines and # comments
+* Returns
+*   0 on success, -1 on failure
+\*-------------------------------------------------------------------------*/
+static int fleet_inventory(const char *path) {
+    FILE *fp;
+    char line[4096];
+    char *word;
+    char *save;
+    fleet_host_t *host;
+    fleet_host_t *hosts;
+    int cap;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "expect-fleet: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    cap = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        word = strtok_r(line, " \t\r\n", &save);
+        if (word == NULL || *word == '#')
+            continue;
+        if (fleet.nhosts == cap) {
+            cap = cap ? cap * 2 : 64;
+            hosts = (fleet_host_t *)realloc(fleet.hosts,
+                                            cap * sizeof(fleet_host_t));
+            if (hosts == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            fleet.hosts = hosts;
+        }
+        host = &fleet.hosts[fleet.nhosts++];
+        host->name = strdup(word);
+        host->args = NULL;
+        host->nargs = 0;
+        while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            host->args = (char **)realloc(host->args, (host->nargs + 1) *
+                                                          sizeof(char *));
+            if (host->args == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            host->args[host->nargs++] = strdup(word);
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Creates the status board file and maps it shared
+\*-------------------------------------------------------------------------*/
+static fleet_board_t *fleet_map(const char *path, int nhosts, size_t *size) {
+    fleet_board_t *board;
+    int fd;
+    int i;
+
+    *size = sizeof(fleet_board_t) +
+            (nhosts > 0 ? nhosts - 1 : 0) * sizeof(fleet_entry_t);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)*size) < 0) {
+        fprintf(stderr, "expect-fleet: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    board = (fleet_board_t *)mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+    close(fd);
+    if (board == MAP_FAILED) {
+        fprintf(stderr, "expect-fleet: mmap: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    board->nhosts = nhosts;
+    board->pid = (int)getpid();
+    board->started = timeout_gettime();
+    board->next = 0;
+    for (i = 0; i < nhosts; i++) {
+        strncpy(board->entries[i].host, fleet.hosts[i].name,
+                FLEET_HOSTLEN - 1);
+        board->entries[i].worker = -1;
+    }
+    __sync_synchronize();
+    board->magic = FLEET_MAGIC;
+
+    return board;
+}
+
+/*-------------------------------------------------------------------------*\
+* Worker loop: claims hosts off the board and drives up to its share of
+* the sessions at a time
+\*-------------------------------------------------------------------------*/
+static void fleet_worker(lua_State *L) {
+    fleet_task_t tasks[FLEET_MAXSLOTS];
+    int slots;
+    int active;
+    int more;
+    int i;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    slots = (fleet.sessions + fleet.workers - 1) / fleet.workers;
+    if (slots > FLEET_MAXSLOTS)
+        slots = FLEET_MAXSLOTS;
+    for (i = 0; i < slots; i++)
+        tasks[i].entry = -1;
+
+    more = 1;
+    for (;;) {
+        active = 0;
+        for (i = 0; i < slots; i++) {
+            while (more && tasks[i].entry < 0) {
+                tasks[i].entry = __sync_fetch_and_add(&fleet.board->next, 1);
+                if (tasks[i].entry >= fleet.nhosts) {
+                    tasks[i].entry = -1;
+                    more = 0;
+                    break;
+                }
+                tasks[i].attempt = 0;
+                tasks[i].started = timeout_gettime();
+                fleet_start(L, &tasks[i]);
+            }
+            if (tasks[i].entry >= 0)
+                active++;
+        }
+        if (active == 0)
+            break;
+        fleet_poll(L, tasks, slots);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Starts an attempt on a host in a fresh coroutine
+\*-------------------------------------------------------------------------*/
+static void fleet_start(lua_State *L, fleet_task_t *t) {
+    fleet_host_t *host;
+    int i;
+
+    host = &fleet.hosts[t->entry];
+    t->attempt++;
+    t->co = lua_newthread(L);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    t->fd = -1;
+    t->wake = -1;
+
+    fleet_update(t->entry, FLEET_RUNNING, t->attempt, "");
+
+    lua_rawgeti(t->co, LUA_REGISTRYINDEX, fleet.fn);
+    lua_pushstring(t->co, host->name);
+    for (i = 0; i < host->nargs; i++)
+        lua_pushstring(t->co, host->args[i]);
+
+    fleet_resume(L, t, 1 + host->nargs);
+}
+
+/*-------------------------------------------------------------------------*\
+* Runs a task until it waits or ends
+\*-------------------------------------------------------------------------*/
+static void fleet_resume(lua_State *L, fleet_task_t *t, int nargs) {
+    lua_State *co;
+    int rc;
+
+    co = t->co;
+    fleet.current = t;
+    rc = lua_resume(co, nargs);
+    fleet.current = NULL;
+
+    if (rc == LUA_YIELD) {
+        /* fleet.wait and fleet.sleep yield fd, mode and timeout; a plain
+         * coroutine.yield() just lets the others run */
+        t->fd = lua_isnumber(co, 1) ? (int)lua_tointeger(co, 1) : -1;
+        t->mode = (int)lua_tointeger(co, 2);
+        t->wake = lua_isnumber(co, 3) && lua_tonumber(co, 3) >= 0
+                      ? timeout_gettime() + lua_tonumber(co, 3)
+                      : -1;
+        if (t->fd < 0 && t->wake < 0)
+            t->wake = timeout_gettime();
+        lua_settop(co, 0);
+        return;
+    }
+
+    fleet_finish(L, t, rc == 0 && lua_toboolean(co, 1));
+}
+
+/*-------------------------------------------------------------------------*\
+* Reports the end of an attempt, and schedules a retry after a failure if
+* any are left
+\*-------------------------------------------------------------------------*/
+static void fleet_finish(lua_State *L, fleet_task_t *t, int ok) {
+    lua_State *co;
+    const char *err;
+    char msg[FLEET_MSGLEN];
+    double delay;
+
+    co = t->co;
+    err = NULL;
+    if (!ok) {
+        /* nil, err from the function, or the error message */
+        err = lua_gettop(co) > 0 && lua_isstring(co, -1)
+                  ? lua_tostring(co, -1)
+                  : "failed";
+    }
+
+    if (!ok && t->attempt <= fleet.retries) {
+        delay = fleet.backoff * pow(2.0, t->attempt - 1);
+        snprintf(msg, sizeof(msg), "retry in %.1fs: %s", delay, err);
+        fleet_update(t->entry, FLEET_RETRY, t->attempt, msg);
+        luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+        t->co = NULL;
+        t->fd = -1;
+        t->wake = timeout_gettime() + delay;
+        return;
+    }
+
+    fleet_update(t->entry, ok ? FLEET_OK : FLEET_FAILED, t->attempt,
+                 ok ? "" : err);
+    fleet_report(t->entry, ok, t->attempt, timeout_gettime() - t->started,
+                 fleet.worker, ok ? co : NULL, 1, err);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+    t->co = NULL;
+    t->entry = -1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Waits until some task can go on and resumes those that can
+\*-------------------------------------------------------------------------*/
+static void fleet_poll(lua_State *L, fleet_task_t *tasks, int slots) {
+    fleet_task_t *t;
+    fd_set rset;
+    fd_set wset;
+    struct timeval tv;
+    double wait;
+    double now;
+    int maxfd;
+    int rc;
+    int i;
+
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    maxfd = -1;
+    wait = -1;
+    now = timeout_gettime();
+    for (i = 0; i < slots; i++) {
+        t = &tasks[i];
+        if (t->entry < 0)
+            continue;
+        if (t->fd >= 0 && t->fd < FD_SETSIZE) {
+            FD_SET(t->fd, t->mode & FLEET_WAITW ? &wset : &rset);
+            if (t->fd > maxfd)
+                maxfd = t->fd;
+        }
+        if (t->wake >= 0 && (wait < 0 || t->wake - now < wait))
+            wait = t->wake - now > 0 ? t->wake - now : 0;
+    }
+
+    tv.tv_sec = (long)wait;
+    tv.tv_usec = (long)((wait - tv.tv_sec) * 1.0e6);
+    rc = select(maxfd + 1, &rset, &wset, NULL, wait >= 0 ? &tv : NULL);
+    if (rc < 0) {
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+    }
+
+    now = timeout_gettime();
+    for (i = 0; i < slots; i++) {
+        t = &tasks[i];
+        if (t->entry < 0)
+            continue;
+        if (t->fd >= 0 && t->fd < FD_SETSIZE &&
+            FD_ISSET(t->fd, t->mode & FLEET_WAITW ? &wset : &rset)) {
+            lua_pushboolean(t->co, 1);
+            fleet_resume(L, t, 1);
+        } else if (t->wake >= 0 && now >= t->wake) {
+            if (t->co == NULL) {
+                fleet_start(L, t);
+            } else if (t->fd >= 0) {
+                lua_pushnil(t->co);
+                lua_pushliteral(t->co, "timeout");
+                fleet_resume(L, t, 2);
+            } else {
+                lua_pushboolean(t->co, 1);
+                fleet_resume(L, t, 1);
+            }
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Writes the JSON line of a host: the first result of the function on
+* success, the error otherwise
+\*-------------------------------------------------------------------------*/
+static void fleet_report(int entry, int ok, int attempts, double elapsed,
+                         int worker, lua_State *L, int idx, const char *err) {
+    buffer_t b;
+    char num[64];
+    const char *host;
+
+    host = fleet.hosts[entry].name;
+    buffer_init(&b);
+    buffer_append(&b, "{\"host\":", 8);
+    fleet_jsonstr(&b, host, strlen(host));
+    snprintf(num, sizeof(num),
+             ",\"ok\":%s,\"attempts\":%d,\"elapsed\":%.3f,\"worker\":%d",
+             ok ? "true" : "false", attempts, elapsed, worker + 1);
+    buffer_append(&b, num, strlen(num));
+    if (L != NULL) {
+        buffer_append(&b, ",\"result\":", 10);
+        fleet_json(&b, L, idx, 0);
+    }
+    if (err != NULL) {
+        buffer_append(&b, ",\"error\":", 9);
+        fleet_jsonstr(&b, err, strlen(err));
+    }
+    buffer_append(&b, "}\n", 2);
+
+    /* one write per line, so lines from the workers do not mix */
+    if (buffer_len(&b) > 0 &&
+        write(fleet.out, buffer_ptr(&b), buffer_len(&b)) < 0)
+        perror("expect-fleet: write");
+    buffer_free(&b);
+}
+
+/*-------------------------------------------------------------------------*\
+* Board entries: one writer each, readers retry until they see the same
+* even sequence count before and after copying
+\*-------------------------------------------------------------------------*/
+static void fleet_update(int entry, int state, int attempts, const char *msg) {
+    fleet_entry_t *e;
+    double now;
+
+    e = &fleet.board->entries[entry];
+    now = timeout_gettime();
+
+    __sync_fetch_and_add(&e->seq, 1);
+    if (state == FLEET_RUNNING && attempts == 1)
+        e->started = now;
+    if (state == FLEET_OK || state == FLEET_FAILED)
+        e->finished = now;
+    e->state = state;
+    e->attempts = attempts;
+    e->worker = fleet.worker;
+    strncpy(e->msg, msg, FLEET_MSGLEN - 1);
+    e->msg[FLEET_MSGLEN - 1] = '\0';
+    __sync_fetch_and_add(&e->seq, 1);
+}
+
+static void fleet_read(fleet_entry_t *e, fleet_entry_t *copy) {
+    unsigned seq;
+
+    for (;;) {
+        seq = *(volatile unsigned *)&e->seq;
+        __sync_synchronize();
+        memcpy(copy, e, sizeof(fleet_entry_t));
+        __sync_synchronize();
+        if (!(seq & 1) && seq == *(volatile unsigned *)&e->seq)
+            break;
+    }
+    copy->host[FLEET_HOSTLEN - 1] = '\0';
+    copy->msg[FLEET_MSGLEN - 1] = '\0';
+}
+
+/*-------------------------------------------------------------------------*\
+* status: prints the board of a run, in progress or finished
+\*-------------------------------------------------------------------------*/
+static int fleet_status(int argc, char **argv) {
+    fleet_board_t *board;
+    fleet_entry_t e;
+    struct stat st;
+    const char *path;
+    int counts[FLEET_NSTATES];
+    int all;
+    int opt;
+    int fd;
+    int i;
+    double now;
+
+    all = 0;
+    while ((opt = getopt(argc, argv, "a")) != -1) {
+        if (opt != 'a')
+            return fleet_usage();
+        all = 1;
+    }
+    path = optind < argc ? argv[optind] : FLEET_BOARD;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "expect-fleet: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    board = (fleet_board_t *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                                  fd, 0);
+    close(fd);
+    if (board == MAP_FAILED || (size_t)st.st_size < sizeof(fleet_board_t) ||
+        board->magic != FLEET_MAGIC || board->nhosts < 0 ||
+        (size_t)st.st_size <
+            sizeof(fleet_board_t) +
+                (board->nhosts > 0 ? board->nhosts - 1 : 0) *
+                    sizeof(fleet_entry_t)) {
+        fprintf(stderr, "expect-fleet: %s: not a status board\n", path);
+        return 1;
+    }
+
+    now = timeout_gettime();
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < board->nhosts; i++) {
+        fleet_read(&board->entries[i], &e);
+        if (e.state >= 0 && e.state < FLEET_NSTATES)
+            counts[e.state]++;
+        if (!all && e.state != FLEET_RUNNING && e.state != FLEET_RETRY &&
+            e.state != FLEET_FAILED)
+            continue;
+        printf("%-8s %-32s try %-2d %7.1fs %s\n",
+               fleet_states[e.state % FLEET_NSTATES], e.host, e.attempts,
+               e.state == FLEET_PENDING
+                   ? 0.0
+                   : (e.finished > 0 ? e.finished : now) - e.started,
+               e.msg);
+    }
+    printf("hosts %d workers %d pending %d running %d retry %d ok %d "
+           "failed %d elapsed %.0fs\n",
+           board->nhosts, board->nworkers, counts[FLEET_PENDING],
+           counts[FLEET_RUNNING], counts[FLEET_RETRY], counts[FLEET_OK],
+           counts[FLEET_FAILED], now - board->started);
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Encodes a Lua value as JSON. Tables with keys 1..n are arrays, others
+* objects; values JSON has no room for become null.
+\*-------------------------------------------------------------------------*/
+static void fleet_json(buffer_t *b, lua_State *L, int idx, int depth) {
+    char num[64];
+    size_t len;
+    size_t n;
+    size_t i;
+    const char *s;
+    double d;
+    int first;
+
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, idx))
+            buffer_append(b, "true", 4);
+        else
+            buffer_append(b, "false", 5);
+        break;
+    case LUA_TNUMBER:
+        d = lua_tonumber(L, idx);
+        if (d != d || d == HUGE_VAL || d == -HUGE_VAL) {
+            buffer_append(b, "null", 4);
+        } else {
+            snprintf(num, sizeof(num), "%.14g", d);
+            buffer_append(b, num, strlen(num));
+        }
+        break;
+    case LUA_TSTRING:
+        s = lua_tolstring(L, idx, &len);
+        fleet_jsonstr(b, s, len);
+        break;
+    case LUA_TTABLE:
+        if (depth >= FLEET_JSONDEPTH) {
+            buffer_append(b, "null", 4);
+            break;
+        }
+        n = lua_objlen(L, idx);
+        i = 0;
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            i++;
+            lua_pop(L, 1);
+        }
+        if (n > 0 && n == i) {
+            buffer_append(b, "[", 1);
+            for (i = 1; i <= n; i++) {
+                if (i > 1)
+                    buffer_append(b, ",", 1);
+                lua_rawgeti(L, idx, (int)i);
+                fleet_json(b, L, -1, depth + 1);
+                lua_pop(L, 1);
+            }
+            buffer_append(b, "]", 1);
+            break;
+        }
+        buffer_append(b, "{", 1);
+        first = 1;
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING ||
+                lua_type(L, -2) == LUA_TNUMBER) {
+                if (!first)
+                    buffer_append(b, ",", 1);
+                first = 0;
+                /* a copy, tostring on the key itself confuses lua_next */
+                lua_pushvalue(L, -2);
+                s = lua_tolstring(L, -1, &len);
+                fleet_jsonstr(b, s, len);
+                lua_pop(L, 1);
+                buffer_append(b, ":", 1);
+                fleet_json(b, L, -1, depth + 1);
+            }
+            lua_pop(L, 1);
+        }
+        buffer_append(b, "}", 1);
+        break;
+    default:
+        buffer_append(b, "null", 4);
+        break;
+    }
+}
+
+static void fleet_jsonstr(buffer_t *b, const char *s, size_t len) {
+    char esc[8];
+    size_t i;
+    unsigned char c;
+
+    buffer_append(b, "\"", 1);
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char)c;
+            buffer_append(b, esc, 2);
+        } else if (c == '\n') {
+            buffer_append(b, "\\n", 2);
+        } else if (c == '\r') {
+            buffer_append(b, "\\r", 2);
+        } else if (c == '\t') {
+            buffer_append(b, "\\t", 2);
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            buffer_append(b, esc, 6);
+        } else {
+            buffer_append(b, (const char *)&s[i], 1);
+        }
+    }
+    buffer_append(b, "\"", 1);
+}
+
+/*=========================================================================*\
+* Lua functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* fleet.note(msg) shows msg next to the running host on the board
+\*-------------------------------------------------------------------------*/
+static int fleet_lnote(lua_State *L) {
+    const char *msg;
+
+    msg = luaL_checkstring(L, 1);
+    if (fleet.current != NULL)
+        fleet_update(fleet.current->entry, FLEET_RUNNING,
+                     fleet.current->attempt, msg);
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* fleet.wait(fd, mode, timeout) gives the worker to other hosts until fd
+* is readable ("r") or writable ("w"); returns true, or nil, "timeout".
+* fd may be anything with a getfd method.
+\*-------------------------------------------------------------------------*/
+static int fleet_lwait(lua_State *L) {
+    const char *mode;
+    int fd;
+
+    if (lua_isnumber(L, 1)) {
+        fd = (int)lua_tointeger(L, 1);
+    } else {
+        lua_getfield(L, 1, "getfd");
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        fd = (int)lua_tointeger(L, -1);
+    }
+    mode = luaL_optstring(L, 2, "r");
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return luaL_error(L, "wait(fd: int, mode: string, timeout: int)");
+    }
+
+    lua_settop(L, 3);
+    lua_pushinteger(L, fd);
+    lua_pushinteger(L, strchr(mode, 'w') ? FLEET_WAITW : FLEET_WAITR);
+    lua_pushnumber(L, luaL_optnumber(L, 3, -1));
+
+    return lua_yield(L, 3);
+}
+
+/*-------------------------------------------------------------------------*\
+* fleet.sleep(seconds) gives the worker to other hosts for a while
+\*-------------------------------------------------------------------------*/
+static int fleet_lsleep(lua_State *L) {
+    double t;
+
+    t = luaL_checknumber(L, 1);
+    lua_pushinteger(L, -1);
+    lua_pushinteger(L, 0);
+    lua_pushnumber(L, t > 0 ? t : 0);
+
+    return lua_yield(L, 3);
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
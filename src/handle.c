@@ -0,0 +1,117 @@
+/*=========================================================================*\
+* Native session handle
+\*=========================================================================*/
+#include <string.h>
+
+#include "handle.h"
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+void handle_init(handle_t *h, int fd) {
+    memset(h, 0, sizeof(handle_t));
+    h->fd = fd;
+    h->wfd = fd;
+    buffer_init(&h->in);
+    h->sink.window = HANDLE_SINKWINDOW;
+}
+
+void handle_free(handle_t *h) {
+    buffer_free(&h->in);
+    fanout_free(h->fan);
+    h->fan = NULL;
+    if (h->out != NULL) {
+        buffer_free(&h->out->data);
+        free(h->out);
+        h->out = NULL;
+    }
+    free(h->sink.tail);
+    h->sink.tail = NULL;
+    h->sink.tailsize = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Turns sink mode on or off
+* Input
+*   window: bytes kept back for matches that straddle reads
+*   tailsize: how many of the last dropped bytes to keep for diagnostics
+* Returns
+*   0 on success, -1 if out of memory
+\*-------------------------------------------------------------------------*/
+int handle_setsink(handle_t *h, int on, size_t window, size_t tailsize) {
+    sink_t *sink;
+    char *tail;
+
+    sink = &h->sink;
+    if (tailsize != sink->tailsize) {
+        tail = NULL;
+        if (tailsize > 0 && (tail = (char *)malloc(tailsize)) == NULL)
+            return -1;
+        free(sink->tail);
+        sink->tail = tail;
+        sink->tailsize = tailsize;
+        sink->tailpos = 0;
+        sink->taillen = 0;
+    }
+    sink->on = on;
+    sink->window = window;
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Drops n bytes from the head of the input buffer, accounting for them
+* in the sink counters and tail
+\*-------------------------------------------------------------------------*/
+void handle_discard(handle_t *h, size_t n) {
+    sink_t *sink;
+    const char *p;
+    const char *end;
+    size_t chunk;
+
+    sink = &h->sink;
+    if (n > buffer_len(&h->in))
+        n = buffer_len(&h->in);
+
+    p = buffer_ptr(&h->in);
+    end = p + n;
+    sink->bytes += n;
+    while ((p = (const char *)memchr(p, '\n', end - p)) != NULL) {
+        sink->lines++;
+        p++;
+    }
+
+    if (sink->tailsize > 0) {
+        p = end - (n < sink->tailsize ? n : sink->tailsize);
+        while (p < end) {
+            chunk = sink->tailsize - sink->tailpos;
+            if (chunk > (size_t)(end - p))
+                chunk = end - p;
+            memcpy(sink->tail + sink->tailpos, p, chunk);
+            sink->tailpos = (sink->tailpos + chunk) % sink->tailsize;
+            p += chunk;
+        }
+        sink->taillen += n;
+        if (sink->taillen > sink->tailsize)
+            sink->taillen = sink->tailsize;
+    }
+
+    buffer_consume(&h->in, n);
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the fan-out of the handle's input, creating it on first use
+* Returns
+*   the fan-out, or NULL if out of memory
+\*-------------------------------------------------------------------------*/
+fanout_t *handle_fanout(handle_t *h) {
+    if (h->fan == NULL) {
+        if ((h->fan = fanout_new(0)) == NULL)
+            return NULL;
+        buffer_settap(&h->in, fanout_tap, h->fan);
+    }
+
+    return h->fan;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
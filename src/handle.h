@@ -0,0 +1,65 @@
+#ifndef HANDLE_H
+#define HANDLE_H
+/*=========================================================================*\
+* Native session handle
+*
+* lpty.open returns userdata starting with this structure. lio recognizes
+* it by metatable and reads the fields directly, so select needs no calls
+* back into Lua for these objects.
+\*=========================================================================*/
+
+#include "buffer.h"
+#include "fanout.h"
+
+/* metatable name of handle userdata */
+#define HANDLE_META "lpty.pty"
+
+/* bytes kept by default for matches that straddle reads in sink mode */
+#define HANDLE_SINKWINDOW 4096
+
+/* sink mode: input is matched in place and dropped, only counted */
+typedef struct sink_s {
+    int on;          /* sink mode enabled */
+    size_t window;   /* bytes kept for matches across reads */
+    double bytes;    /* bytes dropped so far */
+    double lines;    /* line breaks among them */
+    char *tail;      /* ring with the last dropped bytes */
+    size_t tailsize; /* size of the ring, 0 for none */
+    size_t tailpos;  /* next write position in the ring */
+    size_t taillen;  /* bytes stored in the ring */
+} sink_t;
+
+/* paced output, written a chunk at a time as the session is waited on */
+typedef struct sendq_s {
+    buffer_t data;   /* bytes not written yet */
+    size_t chunk;    /* bytes written per tick */
+    double interval; /* seconds between chunks */
+    double jitter;   /* up to this many seconds added to each interval */
+    double due;      /* when the next chunk may go */
+    double sent;     /* bytes written over the handle's life */
+    double queued;   /* bytes queued over the handle's life */
+} sendq_t;
+
+/* handle control structure */
+typedef struct handle_s {
+    int fd;        /* descriptor to wait on */
+    int wfd;       /* descriptor to write to, fd but for pipes */
+    int dirty;     /* set from Lua by buffering layers of its own */
+    buffer_t in;   /* input read ahead of the caller */
+    sink_t sink;   /* sink mode state */
+    fanout_t *fan; /* subscribers to the input, NULL until the first */
+    sendq_t *out;  /* paced output, NULL until the first */
+} handle_t;
+
+/* select must not wait on a handle that has input pending */
+#define handle_dirty(h) ((h)->dirty || buffer_len(&(h)->in) > 0)
+
+void handle_init(handle_t *h, int fd);
+void handle_free(handle_t *h);
+int handle_setsink(handle_t *h, int on, size_t window, size_t tailsize);
+void handle_discard(handle_t *h, size_t n);
+fanout_t *handle_fanout(handle_t *h);
+
+#endif /* HANDLE_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
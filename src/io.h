@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 
+#include "buffer.h"
 #include "timeout.h"
 
 #ifdef _WIN32
@@ -16,11 +17,16 @@ enum {
     IO_DONE = 0,     /* operation completed successfully */
     IO_TIMEOUT = -1, /* operation timed out */
     IO_CLOSED = -2,  /* the connection has been closed */
-    IO_UNKNOWN = -3
+    IO_UNKNOWN = -3,
+    IO_CANCELLED = -4, /* the cancellation token was signalled */
+    IO_WAIT = -5       /* would block, with the wait hook set */
 };
 
 #define IO_FD_INVALID (-1)
 
+/* largest single read issued by io_drain */
+#define IO_DRAINSIZE 65536
+
 int io_waitfd(int *fd, int sw, timeout_t *tm);
 int io_open(void);
 int io_close(void);
@@ -29,9 +35,26 @@ int io_select(int n, fd_set *rfds, fd_set *wfds, fd_set *efds, timeout_t *tm);
 int io_write(int *fd, const char *data, size_t count, size_t *sent,
              timeout_t *tm);
 int io_read(int *fd, char *data, size_t count, size_t *got, timeout_t *tm);
+int io_drain(int *fd, buffer_t *buf, size_t limit, size_t *got, timeout_t *tm);
+int io_listen(int *fd, const char *path, int backlog);
+int io_connect(int *fd, const char *path);
+int io_accept(int *fd, int *client, timeout_t *tm);
+int io_sendfd(int *fd, const char *data, size_t count, int sendfd,
+              timeout_t *tm);
+int io_recvfd(int *fd, char *data, size_t count, size_t *got, int *recvfd,
+              timeout_t *tm);
 int io_setblocking(int *fd);
 int io_setnonblocking(int *fd);
 void io_sleep(double n);
+void io_setcancel(int fd);
+int io_getcancel(void);
+void io_sethook(int on);
+int io_gethook(void);
+int io_getwait(int *fd, int *sw, double *deadline);
+int io_token_open(int *rfd, int *wfd);
+int io_token_cancel(int wfd);
+void io_token_rearm(int rfd);
+void io_token_close(int *rfd, int *wfd);
 const char *io_strerror(int err);
 
 #endif /* IO_H */
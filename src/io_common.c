@@ -11,6 +11,10 @@ const char *io_strerror(int err) {
         return "closed";
     case IO_TIMEOUT:
         return "timeout";
+    case IO_CANCELLED:
+        return "cancelled";
+    case IO_WAIT:
+        return "wait";
     default:
         perror("unknown");
         return "unknown error";
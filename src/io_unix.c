@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 /*=========================================================================*\
 * IO compatibilization module for Unix
 *
@@ -15,11 +16,26 @@
 #define WAITFD_W 2
 #define WAITFD_C (WAITFD_R | WAITFD_W)
 
+/* read end of the cancellation token every wait includes, if any */
+static int io_cancelfd = IO_FD_INVALID;
+
+/* wait hook: waits that would block fail with IO_WAIT instead, leaving
+ * what they would have waited for here */
+static struct {
+    int on;
+    int fd;          /* descriptor of the last IO_WAIT */
+    int sw;          /* WAITFD_R, WAITFD_W or both */
+    double deadline; /* absolute, timeout_gettime clock, -1 for none */
+} io_hook = {0, IO_FD_INVALID, 0, -1};
+
+static int io_waithook(int *fd, int sw, timeout_t *tm);
+
 int io_waitfd(int *fd, int sw, timeout_t *tm) {
     struct timeval tv;
     struct timeval *tp;
     double t;
     int rc;
+    int n;
 
     fd_set rfds;
     fd_set wfds;
@@ -30,11 +46,14 @@ int io_waitfd(int *fd, int sw, timeout_t *tm) {
         return EINVAL;
     if (timeout_iszero(tm))
         return IO_TIMEOUT; /* optimize timeout == 0 case */
+    if (io_hook.on)
+        return io_waithook(fd, sw, tm);
     do {
         /* must set bits within loop, because select may have modifed them */
         rp = wp = NULL;
+        n = *fd;
+        FD_ZERO(&rfds);
         if (sw & WAITFD_R) {
-            FD_ZERO(&rfds);
             FD_SET(*fd, &rfds);
             rp = &rfds;
         }
@@ -43,6 +62,12 @@ int io_waitfd(int *fd, int sw, timeout_t *tm) {
             FD_SET(*fd, &wfds);
             wp = &wfds;
         }
+        if (io_cancelfd != IO_FD_INVALID) {
+            FD_SET(io_cancelfd, &rfds);
+            rp = &rfds;
+            if (io_cancelfd > n)
+                n = io_cancelfd;
+        }
         t = timeout_getretry(tm);
         tp = NULL;
         if (t >= 0.0) {
@@ -50,12 +75,14 @@ int io_waitfd(int *fd, int sw, timeout_t *tm) {
             tv.tv_usec = (int)((t - tv.tv_sec) * 1.0e6);
             tp = &tv;
         }
-        rc = select(*fd + 1, rp, wp, NULL, tp);
+        rc = select(n + 1, rp, wp, NULL, tp);
     } while (rc == -1 && errno == EINTR);
     if (rc == -1)
         return errno;
     if (rc == 0)
         return IO_TIMEOUT;
+    if (io_cancelfd != IO_FD_INVALID && FD_ISSET(io_cancelfd, &rfds))
+        return IO_CANCELLED;
     if (sw == WAITFD_C && FD_ISSET(*fd, &rfds))
         return IO_CLOSED;
 
@@ -93,10 +120,18 @@ void io_destroy(int *fd) {
 \*-------------------------------------------------------------------------*/
 int io_select(int n, fd_set *rfds, fd_set *wfds, fd_set *efds, timeout_t *tm) {
     int rc;
+    int cancel;
     double t;
     struct timeval tv;
 
+    /* the token is waited for along with the caller's read set */
+    cancel = rfds != NULL ? io_cancelfd : IO_FD_INVALID;
+    if (cancel != IO_FD_INVALID && cancel >= n)
+        n = cancel + 1;
+
     do {
+        if (cancel != IO_FD_INVALID)
+            FD_SET(cancel, rfds);
         t = timeout_getretry(tm);
         tv.tv_sec = (int)t;
         tv.tv_usec = (int)((t - tv.tv_sec) * 1.0e6);
@@ -104,6 +139,9 @@ int io_select(int n, fd_set *rfds, fd_set *wfds, fd_set *efds, timeout_t *tm) {
         rc = select(n, rfds, wfds, efds, t >= 0.0 ? &tv : NULL);
     } while (rc < 0 && errno == EINTR);
 
+    if (rc > 0 && cancel != IO_FD_INVALID && FD_ISSET(cancel, rfds))
+        return IO_CANCELLED;
+
     return rc;
 }
 
@@ -181,6 +219,269 @@ int io_read(int *fd, char *data, size_t count, size_t *got, timeout_t *tm) {
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Read everything that is available into a buffer
+*
+* Waits (with timeout) until the fd is readable, then keeps reading until
+* the kernel reports EAGAIN or limit bytes were taken, so a burst of output
+* costs a single call. On a blocking fd only one read is issued, since a
+* second one could block forever.
+\*-------------------------------------------------------------------------*/
+int io_drain(int *fd, buffer_t *buf, size_t limit, size_t *got,
+             timeout_t *tm) {
+    int err;
+    int flags;
+    long taken;
+    size_t count;
+    char *tail;
+
+    *got = 0;
+    if (*fd == IO_FD_INVALID)
+        return IO_CLOSED;
+    if ((err = io_waitfd(fd, WAITFD_R, tm)) != IO_DONE)
+        return err;
+    flags = fcntl(*fd, F_GETFL, 0);
+    while (*got < limit) {
+        count = limit - *got;
+        if (count > IO_DRAINSIZE)
+            count = IO_DRAINSIZE;
+        if ((tail = buffer_reserve(buf, count)) == NULL)
+            return ENOMEM;
+
+        taken = (long)read(*fd, tail, count);
+        if (taken > 0) {
+            buffer_commit(buf, taken);
+            *got += taken;
+            if (flags == -1 || !(flags & O_NONBLOCK))
+                return IO_DONE;
+            continue;
+        }
+        if (taken == 0)
+            return IO_CLOSED;
+        err = errno;
+        if (err == EIO) // Got Input/output error after child process exit
+            return IO_CLOSED;
+        if (err == EINTR)
+            continue;
+        if (err == EAGAIN)
+            return IO_DONE;
+        return err;
+    }
+
+    return IO_DONE;
+}
+
+/*-------------------------------------------------------------------------*\
+* Unix domain sockets
+*
+* Sockets are created close-on-exec and non-blocking; waits go through
+* io_waitfd like everything else.
+\*-------------------------------------------------------------------------*/
+static int io_unixsocket(int *fd, const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return ENAMETOOLONG;
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+#ifdef SOCK_CLOEXEC
+    /* no window in which a concurrent spawn could inherit it */
+    *fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+    *fd = socket(AF_UNIX, SOCK_STREAM, 0);
+#endif
+    if (*fd == -1)
+        return errno;
+    fcntl(*fd, F_SETFD, FD_CLOEXEC);
+
+    return IO_DONE;
+}
+
+int io_listen(int *fd, const char *path, int backlog) {
+    struct sockaddr_un addr;
+    int err;
+
+    if ((err = io_unixsocket(fd, path, &addr)) != IO_DONE)
+        return err;
+    if (bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(*fd, backlog) == -1 || io_setnonblocking(fd) == -1) {
+        err = errno;
+        io_destroy(fd);
+        return err;
+    }
+
+    return IO_DONE;
+}
+
+int io_connect(int *fd, const char *path) {
+    struct sockaddr_un addr;
+    int err;
+
+    if ((err = io_unixsocket(fd, path, &addr)) != IO_DONE)
+        return err;
+    /* local connects do not block for long, do it before going async */
+    while (connect(*fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (errno == EINTR)
+            continue;
+        err = errno;
+        io_destroy(fd);
+        return err;
+    }
+    if (io_setnonblocking(fd) == -1) {
+        err = errno;
+        io_destroy(fd);
+        return err;
+    }
+
+    return IO_DONE;
+}
+
+int io_accept(int *fd, int *client, timeout_t *tm) {
+    int err;
+
+    *client = IO_FD_INVALID;
+    if (*fd == IO_FD_INVALID)
+        return IO_CLOSED;
+    for (;;) {
+        if ((err = io_waitfd(fd, WAITFD_R, tm)) != IO_DONE)
+            return err;
+
+#ifdef SOCK_CLOEXEC
+        *client = accept4(*fd, NULL, NULL, SOCK_CLOEXEC);
+#else
+        *client = accept(*fd, NULL, NULL);
+#endif
+        if (*client != -1) {
+            fcntl(*client, F_SETFD, FD_CLOEXEC);
+            io_setnonblocking(client);
+            return IO_DONE;
+        }
+        err = errno;
+        if (err == EINTR || err == EAGAIN || err == ECONNABORTED)
+            continue;
+        return err;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Send a short message, passing sendfd along with it unless it is
+* IO_FD_INVALID. The receiver gets its own duplicate of the descriptor.
+\*-------------------------------------------------------------------------*/
+int io_sendfd(int *fd, const char *data, size_t count, int sendfd,
+              timeout_t *tm) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    int flags;
+    int err;
+
+    if (*fd == IO_FD_INVALID)
+        return IO_CLOSED;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)data;
+    iov.iov_len = count;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (sendfd != IO_FD_INVALID) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &sendfd, sizeof(int));
+    }
+
+    flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+    for (;;) {
+        if ((err = io_waitfd(fd, WAITFD_W, tm)) != IO_DONE)
+            return err;
+
+        if (sendmsg(*fd, &msg, flags) >= 0)
+            return IO_DONE;
+        err = errno;
+        if (err == EPIPE || err == ECONNRESET)
+            return IO_CLOSED;
+        if (err == EINTR || err == EAGAIN)
+            continue;
+        return err;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Receive a message, and the descriptor passed along with it if any;
+* *recvfd is IO_FD_INVALID otherwise
+\*-------------------------------------------------------------------------*/
+int io_recvfd(int *fd, char *data, size_t count, size_t *got, int *recvfd,
+              timeout_t *tm) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    int flags;
+    int err;
+    long taken;
+
+    *got = 0;
+    *recvfd = IO_FD_INVALID;
+    if (*fd == IO_FD_INVALID)
+        return IO_CLOSED;
+
+    flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+    for (;;) {
+        if ((err = io_waitfd(fd, WAITFD_R, tm)) != IO_DONE)
+            return err;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = data;
+        iov.iov_len = count;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        taken = (long)recvmsg(*fd, &msg, flags);
+        if (taken > 0) {
+            *got = taken;
+            for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS) {
+                    memcpy(recvfd, CMSG_DATA(cmsg), sizeof(int));
+                    fcntl(*recvfd, F_SETFD, FD_CLOEXEC);
+                }
+            }
+            return IO_DONE;
+        }
+        if (taken == 0)
+            return IO_CLOSED;
+        err = errno;
+        if (err == ECONNRESET)
+            return IO_CLOSED;
+        if (err == EINTR || err == EAGAIN)
+            continue;
+        return err;
+    }
+}
+
 /*-------------------------------------------------------------------------*\
 * Put fd into blocking mode
 \*-------------------------------------------------------------------------*/
@@ -234,4 +535,135 @@ void io_sleep(double n) {
     return;
 }
 
+/*-------------------------------------------------------------------------*\
+* Cancellation tokens
+*
+* A token is an eventfd, or a pipe where there is none; once signalled
+* its read end stays readable until rearmed. The token set with
+* io_setcancel is added to every wait, which then fails with
+* IO_CANCELLED. Signalling is a single write, safe from other threads
+* and from signal handlers.
+\*-------------------------------------------------------------------------*/
+void io_setcancel(int fd) {
+    io_cancelfd = fd;
+}
+
+int io_getcancel(void) {
+    return io_cancelfd;
+}
+
+/*-------------------------------------------------------------------------*\
+* Wait hook
+*
+* For hosts with an event loop of their own: with the hook set no wait
+* blocks. A wait that is not satisfied right away fails with IO_WAIT,
+* and io_getwait tells the host which descriptor to watch, for what and
+* until when; the caller retries once the loop sees it ready.
+\*-------------------------------------------------------------------------*/
+void io_sethook(int on) {
+    io_hook.on = on;
+}
+
+int io_gethook(void) {
+    return io_hook.on;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reports the wait behind the last IO_WAIT
+* Returns
+*   0, or -1 if there was none
+\*-------------------------------------------------------------------------*/
+int io_getwait(int *fd, int *sw, double *deadline) {
+    if (io_hook.fd == IO_FD_INVALID)
+        return -1;
+    *fd = io_hook.fd;
+    *sw = io_hook.sw;
+    *deadline = io_hook.deadline;
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* io_waitfd with the hook set: polls once, then hands the wait over
+\*-------------------------------------------------------------------------*/
+static int io_waithook(int *fd, int sw, timeout_t *tm) {
+    timeout_t now;
+    double left;
+    int rc;
+
+    /* a total of 0 polls without blocking */
+    timeout_init(&now, -1, 0);
+    timeout_markstart(&now);
+    io_hook.on = 0;
+    rc = io_waitfd(fd, sw, &now);
+    io_hook.on = 1;
+    if (rc != IO_TIMEOUT)
+        return rc;
+
+    left = timeout_getretry(tm);
+    if (left == 0)
+        return IO_TIMEOUT;
+    io_hook.fd = *fd;
+    io_hook.sw = sw;
+    io_hook.deadline = left < 0 ? -1 : timeout_gettime() + left;
+
+    return IO_WAIT;
+}
+
+int io_token_open(int *rfd, int *wfd) {
+#ifdef __linux__
+    *rfd = *wfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (*rfd == -1)
+        return errno;
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1)
+        return errno;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+    *rfd = fds[0];
+    *wfd = fds[1];
+#endif
+    if (*rfd >= FD_SETSIZE) {
+        io_token_close(rfd, wfd);
+        return EMFILE;
+    }
+
+    return IO_DONE;
+}
+
+int io_token_cancel(int wfd) {
+#ifdef __linux__
+    uint64_t one = 1;
+
+    if (write(wfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        return errno;
+#else
+    char one = 1;
+
+    /* a full pipe is signalled already */
+    if (write(wfd, &one, 1) == -1 && errno != EAGAIN)
+        return errno;
+#endif
+
+    return IO_DONE;
+}
+
+void io_token_rearm(int rfd) {
+    char buf[64];
+
+    while (read(rfd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+void io_token_close(int *rfd, int *wfd) {
+    if (*wfd != *rfd)
+        io_destroy(wfd);
+    io_destroy(rfd);
+    *wfd = IO_FD_INVALID;
+}
+
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -18,6 +18,14 @@
 #include <sys/time.h>
 /* sigpipe handling */
 #include <signal.h>
+/* unix domain sockets and descriptor passing */
+#include <sys/socket.h>
+#include <sys/un.h>
+/* cancellation tokens */
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
 
 #endif /* IO_UNIX_H */
 
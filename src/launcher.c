@@ -0,0 +1,143 @@
+/*=========================================================================*\
+* expect-run: static launcher
+*
+* A single executable with LuaJIT, the native modules and precompiled
+* bytecode of expect.lua and lio.ffi linked in, so that running a script
+* costs one exec and no library loading or source parsing:
+*
+*   expect-run script.lua [args...]
+*
+* The script sees its arguments in arg, as with the luajit command. Lua
+* modules other than the embedded ones are found through package.path as
+* usual.
+\*=========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#include "expect_native.h"
+
+/* bytecode generated at build time by luajit -b */
+#include "expect_bc.h"
+#include "lio_ffi_bc.h"
+
+typedef struct launcher_chunk_s {
+    const char *name;
+    const unsigned char *code;
+    size_t size;
+} launcher_chunk_t;
+
+static const launcher_chunk_t launcher_chunks[] = {
+    {"expect", luaJIT_BC_expect, luaJIT_BC_expect_SIZE},
+    {"lio.ffi", luaJIT_BC_lio_ffi, luaJIT_BC_lio_ffi_SIZE},
+    {NULL, NULL, 0}};
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int launcher_load(lua_State *L);
+static int launcher_init(lua_State *L);
+static int launcher_traceback(lua_State *L);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+int main(int argc, char **argv) {
+    lua_State *L;
+    int rc;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s script [args...]\n", argv[0]);
+        return 2;
+    }
+
+    if ((L = luaL_newstate()) == NULL) {
+        fprintf(stderr, "%s: cannot create Lua state\n", argv[0]);
+        return 1;
+    }
+
+    lua_pushcfunction(L, launcher_traceback);
+    lua_pushcfunction(L, launcher_init);
+    lua_pushlightuserdata(L, argv);
+    rc = lua_pcall(L, 1, 0, 1);
+    if (rc == 0) {
+        rc = luaL_loadfile(L, argv[1]);
+        if (rc == 0)
+            rc = lua_pcall(L, 0, 0, 1);
+    }
+    if (rc != 0)
+        fprintf(stderr, "%s: %s\n", argv[0], lua_tostring(L, -1));
+
+    lua_close(L);
+
+    return rc == 0 ? 0 : 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Opens the libraries and fills arg and package.preload, in protected mode
+\*-------------------------------------------------------------------------*/
+static int launcher_init(lua_State *L) {
+    const launcher_chunk_t *chunk;
+    char **argv;
+    int i;
+
+    argv = (char **)lua_touserdata(L, 1);
+    luaL_openlibs(L);
+
+    /* script at arg[0], its arguments from arg[1] on */
+    lua_newtable(L);
+    lua_pushstring(L, argv[0]);
+    lua_rawseti(L, -2, -1);
+    for (i = 1; argv[i] != NULL; i++) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i - 1);
+    }
+    lua_setglobal(L, "arg");
+
+    /* the native modules, preloaded and marked as linked in */
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    luaopen_expect_native(L);
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "static");
+    lua_setfield(L, -2, "expect_native");
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "preload");
+    for (chunk = launcher_chunks; chunk->name != NULL; chunk++) {
+        lua_pushlightuserdata(L, (void *)chunk);
+        lua_pushcclosure(L, launcher_load, 1);
+        lua_setfield(L, -2, chunk->name);
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* package.preload loader of an embedded chunk, its upvalue
+\*-------------------------------------------------------------------------*/
+static int launcher_load(lua_State *L) {
+    const launcher_chunk_t *chunk;
+
+    chunk = (const launcher_chunk_t *)lua_touserdata(L, lua_upvalueindex(1));
+    if (luaL_loadbuffer(L, (const char *)chunk->code, chunk->size,
+                        chunk->name) != 0)
+        return lua_error(L);
+    lua_pushstring(L, chunk->name);
+    lua_call(L, 1, 1);
+
+    return 1;
+}
+
+static int launcher_traceback(lua_State *L) {
+    luaL_traceback(L, L, lua_tostring(L, 1), 1);
+    return 1;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -1,13 +1,39 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memmem */
+#endif
+
 #include "lio.h"
 
-static int getfd(lua_State *L);
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <stdio.h>
+#endif
+
+static int getfd(lua_State *L, int w);
 static int dirty(lua_State *L);
-static void collect_fd(lua_State *L, int tab, int itab, fd_set *set,
-                       int *max_fd);
-static int check_dirty(lua_State *L, int tab, int dtab, fd_set *set);
-static void return_fd(lua_State *L, fd_set *set, int max_fd, int itab, int tab,
+static void *toudata(lua_State *L, int idx, const char *meta);
+static handle_t *tohandle(lua_State *L, int idx);
+static int isfd(lua_State *L, int idx);
+static int tofd(lua_State *L, int idx);
+static int towfd(lua_State *L, int idx);
+static buffer_t *tobuffer(lua_State *L, int idx);
+static int read_until(lua_State *L, handle_t *h, const char *delim,
+                      size_t dlen, size_t max, int chomp, timeout_t *tm);
+static pattern_t *topattern(lua_State *L, int idx);
+static void dialog_compile(lua_State *L, dialog_t *d, int spec, int names);
+static int dialog_target(lua_State *L, int names, int idx, int state);
+static char *dialog_strdup(lua_State *L, int idx, size_t *len);
+static int collect_fd(lua_State *L, int tab, int dtab, int w, fd_set *set,
+                      int *max_fd);
+static void return_fd(lua_State *L, int tab, int w, fd_set *set, int rtab,
                       int start);
-static void make_assoc(lua_State *L, int tab);
+static void add_result(lua_State *L, int rtab, int i);
+static int result_table(lua_State *L, int idx);
+static double pump_fd(lua_State *L, int tab);
 
 static int lio_read(lua_State *L);
 static int lio_write(lua_State *L);
@@ -16,6 +42,61 @@ static int lio_destroy(lua_State *L);
 static int lio_setblocking(lua_State *L);
 static int lio_setnonblocking(lua_State *L);
 static int lio_sleep(lua_State *L);
+static int lio_drain(lua_State *L);
+static int lio_waitfd(lua_State *L);
+static int lio_buffer(lua_State *L);
+static int lio_pattern(lua_State *L);
+static int lio_find(lua_State *L);
+static int lio_readline(lua_State *L);
+static int lio_read_until(lua_State *L);
+static int lio_expect(lua_State *L);
+static int lio_sink(lua_State *L);
+static int lio_sinkstats(lua_State *L);
+static int lio_settle(lua_State *L);
+static int lio_consumed(lua_State *L);
+static int lio_spill(lua_State *L);
+static int lio_subscribe(lua_State *L);
+static int lio_token(lua_State *L);
+static int lio_settoken(lua_State *L);
+static int lio_cancel(lua_State *L);
+static int lio_rearm(lua_State *L);
+static int lio_dialog(lua_State *L);
+static int lio_run(lua_State *L);
+static int lio_batch(lua_State *L);
+static int lio_queue(lua_State *L);
+static int lio_queued(lua_State *L);
+static int lio_source(lua_State *L);
+static int lio_upload(lua_State *L);
+static int lio_base64(lua_State *L);
+static int lio_sethook(lua_State *L);
+static int lio_waiting(lua_State *L);
+static int writeall(int *fd, const char *data, size_t n, timeout_t *tm);
+static int lio_listen(lua_State *L);
+static int lio_connect(lua_State *L);
+static int lio_accept(lua_State *L);
+static int lio_sendfd(lua_State *L);
+static int lio_recvfd(lua_State *L);
+
+static int lio_buffer_len(lua_State *L);
+static int lio_buffer_get(lua_State *L);
+static int lio_buffer_consume(lua_State *L);
+static int lio_buffer_clear(lua_State *L);
+static int lio_buffer_gc(lua_State *L);
+static int lio_pattern_gc(lua_State *L);
+static int lio_dialog_gc(lua_State *L);
+
+static int lio_cursor_read(lua_State *L);
+static int lio_cursor_pending(lua_State *L);
+static int lio_cursor_writeto(lua_State *L);
+static int lio_cursor_dropped(lua_State *L);
+static int lio_cursor_close(lua_State *L);
+
+static int lio_source_len(lua_State *L);
+static int lio_source_cksum(lua_State *L);
+static int lio_source_close(lua_State *L);
+
+static int lio_token_getfd(lua_State *L);
+static int lio_token_gc(lua_State *L);
 
 static luaL_Reg lio_funcs[] = {{"read", lio_read},
                                {"write", lio_write},
@@ -24,8 +105,68 @@ static luaL_Reg lio_funcs[] = {{"read", lio_read},
                                {"setblocking", lio_setblocking},
                                {"setnonblocking", lio_setnonblocking},
                                {"sleep", lio_sleep},
+                               {"drain", lio_drain},
+                               {"waitfd", lio_waitfd},
+                               {"buffer", lio_buffer},
+                               {"pattern", lio_pattern},
+                               {"find", lio_find},
+                               {"readline", lio_readline},
+                               {"read_until", lio_read_until},
+                               {"expect", lio_expect},
+                               {"sink", lio_sink},
+                               {"sinkstats", lio_sinkstats},
+                               {"settle", lio_settle},
+                               {"consumed", lio_consumed},
+                               {"spill", lio_spill},
+                               {"subscribe", lio_subscribe},
+                               {"token", lio_token},
+                               {"settoken", lio_settoken},
+                               {"cancel", lio_cancel},
+                               {"rearm", lio_rearm},
+                               {"dialog", lio_dialog},
+                               {"run", lio_run},
+                               {"batch", lio_batch},
+                               {"queue", lio_queue},
+                               {"queued", lio_queued},
+                               {"source", lio_source},
+                               {"upload", lio_upload},
+                               {"base64", lio_base64},
+                               {"sethook", lio_sethook},
+                               {"waiting", lio_waiting},
+                               {"listen", lio_listen},
+                               {"connect", lio_connect},
+                               {"accept", lio_accept},
+                               {"sendfd", lio_sendfd},
+                               {"recvfd", lio_recvfd},
+                               {"buffered", lio_buffer_len},
+                               {"peek", lio_buffer_get},
+                               {"consume", lio_buffer_consume},
+                               {"clear", lio_buffer_clear},
                                {NULL, NULL}};
 
+static luaL_Reg lio_buffer_meths[] = {{"len", lio_buffer_len},
+                                      {"get", lio_buffer_get},
+                                      {"consume", lio_buffer_consume},
+                                      {"clear", lio_buffer_clear},
+                                      {NULL, NULL}};
+
+static luaL_Reg lio_cursor_meths[] = {{"read", lio_cursor_read},
+                                      {"pending", lio_cursor_pending},
+                                      {"writeto", lio_cursor_writeto},
+                                      {"dropped", lio_cursor_dropped},
+                                      {"close", lio_cursor_close},
+                                      {NULL, NULL}};
+
+static luaL_Reg lio_source_meths[] = {{"len", lio_source_len},
+                                      {"cksum", lio_source_cksum},
+                                      {"close", lio_source_close},
+                                      {NULL, NULL}};
+
+static luaL_Reg lio_token_meths[] = {{"getfd", lio_token_getfd},
+                                     {"cancel", lio_cancel},
+                                     {"rearm", lio_rearm},
+                                     {NULL, NULL}};
+
 /*=========================================================================*\
 * Exported functions
 \*=========================================================================*/
@@ -33,6 +174,52 @@ static luaL_Reg lio_funcs[] = {{"read", lio_read},
 * Initializes module
 \*-------------------------------------------------------------------------*/
 LUALIB_API int luaopen_lio(lua_State *L) {
+    luaL_newmetatable(L, LIO_BUFFER);
+    lua_newtable(L);
+    luaL_register(L, NULL, lio_buffer_meths);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lio_buffer_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lio_buffer_get);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, lio_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LIO_PATTERN);
+    lua_pushcfunction(L, lio_pattern_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LIO_DIALOG);
+    lua_pushcfunction(L, lio_dialog_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LIO_CURSOR);
+    lua_newtable(L);
+    luaL_register(L, NULL, lio_cursor_meths);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lio_cursor_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LIO_SOURCE);
+    lua_newtable(L);
+    luaL_register(L, NULL, lio_source_meths);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lio_source_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LIO_TOKEN);
+    lua_newtable(L);
+    luaL_register(L, NULL, lio_token_meths);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lio_token_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     luaL_register(L, "lio", lio_funcs);
     return 0;
 }
@@ -47,6 +234,10 @@ LUALIB_API int luaopen_lio(lua_State *L) {
 * method getfd() which returns the descriptor to be passed to the
 * underlying select function. Another method, dirty(), should return
 * true if there is data ready for reading (required for buffered input).
+* Handles returned by lpty.open are read natively, without method calls.
+*
+* select(rset, wset, timeout, rout, wout) fills rout and wout in place of
+* fresh result tables, so they can be reused from call to call.
 \*-------------------------------------------------------------------------*/
 
 static int lio_read(lua_State *L) {
@@ -56,15 +247,16 @@ static int lio_read(lua_State *L) {
     size_t got;
     int fd;
     int rc;
+    handle_t *h;
 
     top = lua_gettop(L);
 
-    if (top != 3 || !lua_isnumber(L, 1) || !lua_isnumber(L, 2) ||
+    if (top != 3 || !isfd(L, 1) || !lua_isnumber(L, 2) ||
         !lua_isnumber(L, 3)) {
         return luaL_error(L, "read(fd: int, size: int, timeout: int)");
     }
 
-    fd = lua_tointeger(L, 1);
+    fd = tofd(L, 1);
     if (fd == IO_FD_INVALID) {
         return luaL_error(L, "invalid fd");
     }
@@ -74,12 +266,31 @@ static int lio_read(lua_State *L) {
         return luaL_error(L, "invalid size");
     }
 
-    buf = (char *)calloc(size, sizeof(char));
-
     timeout_t tm;
     timeout_init(&tm, -1, lua_tonumber(L, 3));
     timeout_markstart(&tm);
 
+    /* a handle reads through its buffer, so subscribers see the input
+     * too; input already buffered comes first */
+    if ((h = tohandle(L, 1)) != NULL) {
+        if (buffer_len(&h->in) == 0) {
+            rc = sendq_drain(h, &h->in, (size_t)size, &got, &tm);
+            if (buffer_len(&h->in) == 0) {
+                lua_pushnil(L);
+                lua_pushstring(L, io_strerror(rc == IO_DONE ? IO_TIMEOUT
+                                                            : rc));
+                return 2;
+            }
+        }
+        got = buffer_len(&h->in) < (size_t)size ? buffer_len(&h->in)
+                                                 : (size_t)size;
+        lua_pushlstring(L, buffer_ptr(&h->in), got);
+        buffer_consume(&h->in, got);
+        return 1;
+    }
+
+    buf = (char *)calloc(size, sizeof(char));
+
     rc = io_read(&fd, buf, size, &got, &tm);
     if (rc != IO_DONE) {
         lua_pushnil(L);
@@ -104,12 +315,12 @@ static int lio_write(lua_State *L) {
     int rc;
 
     top = lua_gettop(L);
-    if (top != 3 || !lua_isnumber(L, 1) || !lua_isstring(L, 2) ||
+    if (top != 3 || !isfd(L, 1) || !lua_isstring(L, 2) ||
         !lua_isnumber(L, 3)) {
         return luaL_error(L, "write(fd: int, data: string, timeout: int)");
     }
 
-    fd = lua_tointeger(L, 1);
+    fd = towfd(L, 1);
     if (fd == IO_FD_INVALID) {
         return luaL_error(L, "invalid fd");
     }
@@ -140,15 +351,25 @@ static int lio_write(lua_State *L) {
 static int lio_destroy(lua_State *L) {
     int top;
     int fd;
+    handle_t *h;
 
     top = lua_gettop(L);
 
-    if (top != 1 || !lua_isnumber(L, 1)) {
+    if (top != 1 || !isfd(L, 1)) {
         return luaL_error(L, "destroy(fd: int)");
     }
 
-    fd = lua_tointeger(L, 1);
-    io_destroy(&fd);
+    if ((h = tohandle(L, 1)) != NULL) {
+        if (h->wfd != h->fd)
+            io_destroy(&h->wfd);
+        io_destroy(&h->fd);
+        h->wfd = h->fd;
+        buffer_clear(&h->in);
+        fd = h->fd;
+    } else {
+        fd = lua_tointeger(L, 1);
+        io_destroy(&fd);
+    }
 
     lua_pushnumber(L, fd);
 
@@ -158,16 +379,20 @@ static int lio_destroy(lua_State *L) {
 static int lio_select(lua_State *L) {
     int rtab;
     int wtab;
-    int itab;
 
     fd_set rset;
     fd_set wset;
+    fd_set rcopy;
+    fd_set wcopy;
 
     int rc;
     int ndirty;
     int max_fd;
     double t;
+    double wait;
+    double left;
     timeout_t tm;
+    timeout_t slice;
 
     max_fd = IO_FD_INVALID;
     t = luaL_optnumber(L, 3, -1);
@@ -175,36 +400,49 @@ static int lio_select(lua_State *L) {
     FD_ZERO(&rset);
     FD_ZERO(&wset);
 
-    lua_settop(L, 3);
-
-    lua_newtable(L);
-    itab = lua_gettop(L);
-
-    lua_newtable(L);
-    rtab = lua_gettop(L);
-
-    lua_newtable(L);
-    wtab = lua_gettop(L);
+    lua_settop(L, 5);
 
-    collect_fd(L, 1, itab, &rset, &max_fd);
-    collect_fd(L, 2, itab, &wset, &max_fd);
+    rtab = result_table(L, 4);
+    wtab = result_table(L, 5);
 
-    ndirty = check_dirty(L, 1, rtab, &rset);
+    ndirty = collect_fd(L, 1, rtab, 0, &rset, &max_fd);
+    collect_fd(L, 2, 0, 1, &wset, &max_fd);
     t = ndirty > 0 ? 0.0 : t;
 
     timeout_init(&tm, t, -1);
     timeout_markstart(&tm);
 
-    rc = io_select(max_fd + 1, &rset, &wset, NULL, &tm);
+    /* paced output of the handles waited on goes out meanwhile */
+    for (;;) {
+        wait = pump_fd(L, 1);
+        left = timeout_getretry(&tm);
+        if (wait < 0 || (left >= 0 && left <= wait)) {
+            rc = io_select(max_fd + 1, &rset, &wset, NULL, &tm);
+            break;
+        }
+        timeout_init(&slice, wait, -1);
+        timeout_markstart(&slice);
+        memcpy(&rcopy, &rset, sizeof(fd_set));
+        memcpy(&wcopy, &wset, sizeof(fd_set));
+        rc = io_select(max_fd + 1, &rcopy, &wcopy, NULL, &slice);
+        if (rc != 0) {
+            memcpy(&rset, &rcopy, sizeof(fd_set));
+            memcpy(&wset, &wcopy, sizeof(fd_set));
+            break;
+        }
+    }
     if (rc > 0 || ndirty > 0) {
-        return_fd(L, &rset, max_fd + 1, itab, rtab, ndirty);
-        return_fd(L, &wset, max_fd + 1, itab, wtab, 0);
-        make_assoc(L, rtab);
-        make_assoc(L, wtab);
+        if (rc > 0) {
+            return_fd(L, 1, 0, &rset, rtab, ndirty);
+            return_fd(L, 2, 1, &wset, wtab, 0);
+        }
         return 2;
     } else if (rc == 0) {
         lua_pushstring(L, "timeout");
         return 3;
+    } else if (rc == IO_CANCELLED) {
+        lua_pushstring(L, io_strerror(rc));
+        return 3;
     } else {
         lua_pushstring(L, "select failed");
         return 3;
@@ -217,11 +455,11 @@ static int lio_setblocking(lua_State *L) {
     int rc;
 
     top = lua_gettop(L);
-    if (top != 1 || !lua_isnumber(L, 1)) {
+    if (top != 1 || !isfd(L, 1)) {
         return luaL_error(L, "setblocking(fd: int)");
     }
 
-    fd = lua_tointeger(L, 1);
+    fd = tofd(L, 1);
     rc = io_setblocking(&fd);
 
     if (rc == -1) {
@@ -241,11 +479,11 @@ static int lio_setnonblocking(lua_State *L) {
     int rc;
 
     top = lua_gettop(L);
-    if (top != 1 || !lua_isnumber(L, 1)) {
+    if (top != 1 || !isfd(L, 1)) {
         return luaL_error(L, "setnonblocking(fd: int)");
     }
 
-    fd = lua_tointeger(L, 1);
+    fd = tofd(L, 1);
     rc = io_setnonblocking(&fd);
 
     if (rc == -1) {
@@ -273,163 +511,2029 @@ static int lio_sleep(lua_State *L) {
     return 0;
 }
 
-/*=========================================================================*\
-* Internal functions
-\*=========================================================================*/
-static int getfd(lua_State *L) {
-    double numfd;
+/*-------------------------------------------------------------------------*\
+* Reads whatever the fd has available into a buffer in a single call.
+* With a handle and no buffer, reads into the handle's own buffer.
+*
+* Waits up to timeout seconds for the first byte, then reads until the
+* kernel runs dry or limit bytes were taken. Returns the number of bytes
+* appended and whether the fd reached end of file.
+\*-------------------------------------------------------------------------*/
+static int lio_drain(lua_State *L) {
+    int top;
     int fd;
+    int rc;
+    double limit;
+    size_t got;
+    buffer_t *buf;
+    handle_t *h;
+    timeout_t tm;
 
-    fd = IO_FD_INVALID;
+    top = lua_gettop(L);
+    if (top < 1 || top > 4 || !isfd(L, 1)) {
+        return luaL_error(
+            L, "drain(fd: int, buffer: buffer, limit: int, timeout: int)");
+    }
 
-    lua_pushstring(L, "getfd");
-    lua_gettable(L, -2);
-    if (!lua_isnil(L, -1)) {
-        lua_pushvalue(L, -2);
-        lua_call(L, 1, 1);
-        if (lua_isnumber(L, -1)) {
-            numfd = lua_tonumber(L, -1);
-            fd = (numfd >= 0.0) ? (int)numfd : IO_FD_INVALID;
-        }
+    fd = tofd(L, 1);
+    if (fd == IO_FD_INVALID) {
+        return luaL_error(L, "invalid fd");
     }
-    lua_pop(L, 1);
-    return fd;
+
+    buf = tobuffer(L, lua_isnoneornil(L, 2) ? 1 : 2);
+
+    limit = luaL_optnumber(L, 3, LIO_DRAINLIMIT);
+    if (limit <= 0) {
+        return luaL_error(L, "invalid limit");
+    }
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 4, -1));
+    timeout_markstart(&tm);
+
+    if ((h = tohandle(L, 1)) != NULL)
+        rc = sendq_drain(h, buf, (size_t)limit, &got, &tm);
+    else
+        rc = io_drain(&fd, buf, (size_t)limit, &got, &tm);
+    if (rc != IO_DONE && rc != IO_CLOSED) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushnumber(L, got);
+    lua_pushboolean(L, rc == IO_CLOSED);
+
+    return 2;
 }
 
-static int dirty(lua_State *L) {
-    int is;
+/*-------------------------------------------------------------------------*\
+* Waits until the fd is readable ("r"), writable ("w") or either ("rw")
+\*-------------------------------------------------------------------------*/
+static int lio_waitfd(lua_State *L) {
+    int fd;
+    int sw;
+    int rc;
+    const char *mode;
+    timeout_t tm;
 
-    is = 0;
+    if (lua_gettop(L) < 2 || !isfd(L, 1) || !lua_isstring(L, 2)) {
+        return luaL_error(L, "waitfd(fd: int, mode: string, timeout: int)");
+    }
 
-    lua_pushstring(L, "dirty");
-    lua_gettable(L, -2);
-    if (!lua_isnil(L, -1)) {
-        lua_pushvalue(L, -2);
-        lua_call(L, 1, 1);
-        is = lua_toboolean(L, -1);
+    fd = tofd(L, 1);
+    if (fd == IO_FD_INVALID) {
+        return luaL_error(L, "invalid fd");
     }
-    lua_pop(L, 1);
 
-    return is;
+    mode = lua_tostring(L, 2);
+    sw = 0;
+    if (strchr(mode, 'r'))
+        sw |= LIO_ABI_WAITR;
+    if (strchr(mode, 'w'))
+        sw |= LIO_ABI_WAITW;
+    if (sw == 0) {
+        return luaL_error(L, "invalid mode");
+    }
+    /* handles on pipes are written through a descriptor of their own */
+    if (sw == LIO_ABI_WAITW)
+        fd = towfd(L, 1);
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 3, -1));
+    timeout_markstart(&tm);
+
+    rc = io_waitfd(&fd, sw, &tm);
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
 }
 
-static void collect_fd(lua_State *L, int tab, int itab, fd_set *set,
-                       int *max_fd) {
-    int i;
-    int n;
+/*-------------------------------------------------------------------------*\
+* Creates an empty input buffer, to be filled by drain()
+\*-------------------------------------------------------------------------*/
+static int lio_buffer(lua_State *L) {
+    buffer_t *buf;
 
-    i = 1;
-    n = 0;
+    buf = (buffer_t *)lua_newuserdata(L, sizeof(buffer_t));
+    buffer_init(buf);
+    luaL_getmetatable(L, LIO_BUFFER);
+    lua_setmetatable(L, -2);
 
-    /* nil is the same as an empty table */
-    if (lua_isnil(L, tab))
-        return;
-    /* otherwise we need it to be a table */
-    luaL_checktype(L, tab, LUA_TTABLE);
-    for (;;) {
-        int fd;
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);
-        if (lua_isnil(L, -1)) {
-            lua_pop(L, 1);
-            break;
-        }
-        /* getfd figures out if this is a fd */
-        fd = getfd(L);
-        if (fd != IO_FD_INVALID) {
-/* make sure we don't overflow the fd_set */
-#ifdef _WIN32
-            if (n >= FD_SETSIZE)
-                luaL_argerror(L, tab, "too many file descriptors");
-#else
-            if (fd >= FD_SETSIZE)
-                luaL_argerror(L, tab, "descriptor too large for set size");
-#endif
-            FD_SET(fd, set);
-            n++;
-            /* keep track of the largest descriptor so far */
-            if (*max_fd == IO_FD_INVALID || *max_fd < fd)
-                *max_fd = fd;
-            /* make sure we can map back from descriptor to the object */
-            lua_pushnumber(L, (lua_Number)fd);
-            lua_pushvalue(L, -2);
-            lua_settable(L, itab);
-        }
-        lua_pop(L, 1);
-        i = i + 1;
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Compiles a Lua pattern for find(). The literal every match must contain
+* is extracted once here and used to skip to candidate positions.
+\*-------------------------------------------------------------------------*/
+static int lio_pattern(lua_State *L) {
+    const char *src;
+    size_t len;
+    pattern_t *pat;
+
+    src = luaL_checklstring(L, 1, &len);
+
+    pat = (pattern_t *)lua_newuserdata(L, sizeof(pattern_t));
+    pat->src = NULL;
+    pat->lit = NULL;
+    luaL_getmetatable(L, LIO_PATTERN);
+    lua_setmetatable(L, -2);
+
+    if (pattern_compile(pat, src, len) == -1) {
+        return luaL_error(L, "out of memory");
     }
+
+    return 1;
 }
 
-static int check_dirty(lua_State *L, int tab, int dtab, fd_set *set) {
-    int ndirty;
-    int i;
+/*-------------------------------------------------------------------------*\
+* find(subject, pattern, init) works like string.find, without a plain
+* flag. The subject may be a string or a buffer, which is searched in
+* place; the pattern may be a string or the result of pattern().
+\*-------------------------------------------------------------------------*/
+static int lio_find(lua_State *L) {
+    const char *s;
+    const char *start;
+    const char *end;
+    size_t len;
+    long init;
+    buffer_t *buf;
+    pattern_t *pat;
+    match_state_t ms;
+
+    if (lua_type(L, 1) == LUA_TUSERDATA) {
+        buf = tobuffer(L, 1);
+        s = buffer_ptr(buf);
+        len = buffer_len(buf);
+    } else {
+        s = luaL_checklstring(L, 1, &len);
+    }
 
-    if (lua_isnil(L, tab))
-        return 0;
+    pat = topattern(L, 2);
 
-    ndirty = 0;
-    i = 1;
+    init = luaL_optlong(L, 3, 1);
+    if (init < 0)
+        init += (long)len + 1;
+    if (init < 1)
+        init = 1;
+    if ((size_t)init > len + 1)
+        init = (long)len + 1;
 
-    for (;;) {
-        int fd;
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);
-        if (lua_isnil(L, -1)) {
-            lua_pop(L, 1);
-            break;
-        }
-        fd = getfd(L);
-        if (fd != IO_FD_INVALID && dirty(L)) {
-            lua_pushnumber(L, ++ndirty);
-            lua_pushvalue(L, -2);
-            lua_settable(L, dtab);
-            FD_CLR(fd, set);
-        }
-        lua_pop(L, 1);
-        i = i + 1;
+    start = pattern_find(pat, &ms, L, s, len, init - 1, &end);
+    if (start == NULL) {
+        lua_pushnil(L);
+        return 1;
     }
 
-    return ndirty;
+    lua_pushinteger(L, start - s + 1);
+    lua_pushinteger(L, end - s);
+
+    return match_pushcaptures(&ms, NULL, NULL) + 2;
 }
 
-static void return_fd(lua_State *L, fd_set *set, int max_fd, int itab, int tab,
-                      int start) {
-    int fd;
+/*-------------------------------------------------------------------------*\
+* Returns the next line of input from a handle, without the line break.
+*
+* Lines are cut from the handle's buffer, which is refilled with drain()
+* as needed; a trailing carriage return is dropped too, since that is how
+* a tty ends lines. At end of file, whatever is left comes back as the
+* last line.
+\*-------------------------------------------------------------------------*/
+static int lio_readline(lua_State *L) {
+    handle_t *h;
+    timeout_t tm;
 
-    for (fd = 0; fd < max_fd; fd++) {
-        if (FD_ISSET(fd, set)) {
-            lua_pushnumber(L, ++start);
-            lua_pushnumber(L, (lua_Number)fd);
-            lua_gettable(L, itab);
-            lua_settable(L, tab);
-        }
+    h = tohandle(L, 1);
+    if (h == NULL) {
+        return luaL_error(L, "readline(handle: pty, timeout: int)");
     }
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 2, -1));
+    timeout_markstart(&tm);
+
+    return read_until(L, h, "\n", 1, 0, 1, &tm);
 }
 
-static void make_assoc(lua_State *L, int tab) {
-    int i;
-    int atab;
+/*-------------------------------------------------------------------------*\
+* Returns input from a handle up to, not including, the delimiter. Fails
+* with "limit" if max bytes are buffered without a delimiter; 0 or nil
+* means no limit.
+\*-------------------------------------------------------------------------*/
+static int lio_read_until(lua_State *L) {
+    handle_t *h;
+    const char *delim;
+    size_t dlen;
+    double max;
+    timeout_t tm;
 
-    i = 1;
+    h = tohandle(L, 1);
+    if (h == NULL || !lua_isstring(L, 2)) {
+        return luaL_error(L, "read_until(handle: pty, delim: string, "
+                             "max: int, timeout: int)");
+    }
 
-    lua_newtable(L);
-    atab = lua_gettop(L);
+    delim = lua_tolstring(L, 2, &dlen);
+    if (dlen == 0) {
+        return luaL_error(L, "empty delimiter");
+    }
+
+    max = luaL_optnumber(L, 3, 0);
+    if (max < 0) {
+        return luaL_error(L, "invalid max");
+    }
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 4, -1));
+    timeout_markstart(&tm);
+
+    return read_until(L, h, delim, dlen, (size_t)max, 0, &tm);
+}
+
+/*-------------------------------------------------------------------------*\
+* Waits until the input of a handle matches a pattern.
+*
+* Returns start, end and captures like find(), relative to the buffered
+* input, and consumes the input through the end of the match unless keep
+* is true; consumed() then gives the text up to and including the match
+* without it having been copied before. In sink mode, input that cannot
+* be part of a match any more is dropped as it arrives, keeping only the
+* last window bytes; no Lua string is ever made of it.
+\*-------------------------------------------------------------------------*/
+static int lio_expect(lua_State *L) {
+    handle_t *h;
+    pattern_t *pat;
+    match_state_t ms;
+    timeout_t tm;
+    const char *p;
+    const char *start;
+    const char *end;
+    size_t len;
+    size_t got;
+    int keep;
+    int eof;
+    int rc;
+    int n;
+
+    h = tohandle(L, 1);
+    if (h == NULL) {
+        return luaL_error(L, "expect(handle: pty, pattern: string, "
+                             "timeout: int, keep: boolean)");
+    }
+
+    pat = topattern(L, 2);
+    keep = lua_toboolean(L, 4) && !h->sink.on;
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 3, -1));
+    timeout_markstart(&tm);
+
+    eof = 0;
     for (;;) {
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);
-        if (lua_isnil(L, -1)) {
-            lua_pop(L, 1);
-            break;
+        p = buffer_ptr(&h->in);
+        len = buffer_len(&h->in);
+        start = pattern_find(pat, &ms, L, p, len, 0, &end);
+        if (start != NULL) {
+            lua_pushinteger(L, start - p + 1);
+            lua_pushinteger(L, end - p);
+            n = match_pushcaptures(&ms, NULL, NULL) + 2;
+            if (h->sink.on)
+                handle_discard(h, end - p);
+            else if (!keep)
+                buffer_consume(&h->in, end - p);
+            return n;
         }
 
-        lua_pushnumber(L, i);
-        lua_pushvalue(L, -2);
-        lua_settable(L, atab);
-        lua_pushnumber(L, i);
-        lua_settable(L, atab);
+        if (h->sink.on && len > h->sink.window)
+            handle_discard(h, len - h->sink.window);
 
-        i = i + 1;
+        if (eof) {
+            lua_pushnil(L);
+            lua_pushstring(L, io_strerror(IO_CLOSED));
+            return 2;
+        }
+
+        rc = sendq_drain(h, &h->in, LIO_DRAINLIMIT, &got, &tm);
+        if (rc == IO_CLOSED) {
+            eof = 1;
+        } else if (rc != IO_DONE) {
+            lua_pushnil(L);
+            lua_pushstring(L, io_strerror(rc));
+            return 2;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* sink(handle, on, window, tail) turns sink mode on or off. window is how
+* many bytes are kept for matches that straddle reads, tail how many of
+* the last dropped bytes are kept for sinkstats().
+\*-------------------------------------------------------------------------*/
+static int lio_sink(lua_State *L) {
+    handle_t *h;
+    double window;
+    double tail;
+
+    h = tohandle(L, 1);
+    if (h == NULL) {
+        return luaL_error(L, "sink(handle: pty, on: boolean, window: int, "
+                             "tail: int)");
+    }
+
+    window = luaL_optnumber(L, 3, HANDLE_SINKWINDOW);
+    tail = luaL_optnumber(L, 4, 0);
+    if (window < 0 || tail < 0) {
+        return luaL_error(L, "invalid size");
+    }
+
+    if (handle_setsink(h, lua_toboolean(L, 2), (size_t)window,
+                       (size_t)tail) == -1) {
+        return luaL_error(L, "out of memory");
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the bytes and lines dropped in sink mode, and the kept tail
+\*-------------------------------------------------------------------------*/
+static int lio_sinkstats(lua_State *L) {
+    handle_t *h;
+    sink_t *sink;
+
+    h = tohandle(L, 1);
+    if (h == NULL) {
+        return luaL_error(L, "sinkstats(handle: pty)");
+    }
+
+    sink = &h->sink;
+    lua_pushnumber(L, sink->bytes);
+    lua_pushnumber(L, sink->lines);
+    if (sink->taillen < sink->tailsize) {
+        lua_pushlstring(L, sink->tail, sink->taillen);
+    } else if (sink->tailsize > 0) {
+        /* the ring is full, its oldest byte is at tailpos */
+        lua_pushlstring(L, sink->tail + sink->tailpos,
+                        sink->tailsize - sink->tailpos);
+        lua_pushlstring(L, sink->tail, sink->tailpos);
+        lua_concat(L, 2);
+    } else {
+        lua_pushliteral(L, "");
     }
+
+    return 3;
+}
+
+/*-------------------------------------------------------------------------*\
+* settle(fd, idle, timeout, buffer) reads until no input has arrived for
+* idle seconds and returns the bytes read and whether the peer hung up.
+* The idle deadline is re-armed after every chunk; nil, "timeout" means
+* output was still flowing when timeout ran out. A handle keeps what it
+* reads unless it is in sink mode, where everything is dropped.
+\*-------------------------------------------------------------------------*/
+static int lio_settle(lua_State *L) {
+    int fd;
+    int rc;
+    double idle;
+    double left;
+    double total;
+    size_t got;
+    handle_t *h;
+    buffer_t *buf;
+    timeout_t tm;
+    timeout_t slice;
+
+    if (lua_gettop(L) < 2 || !isfd(L, 1) || !lua_isnumber(L, 2)) {
+        return luaL_error(
+            L, "settle(fd: int, idle: number, timeout: int, buffer: buffer)");
+    }
+
+    fd = tofd(L, 1);
+    if (fd == IO_FD_INVALID) {
+        return luaL_error(L, "invalid fd");
+    }
+
+    idle = lua_tonumber(L, 2);
+    if (idle <= 0) {
+        return luaL_error(L, "invalid idle time");
+    }
+
+    h = tohandle(L, 1);
+    buf = tobuffer(L, lua_isnoneornil(L, 4) ? 1 : 4);
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 3, -1));
+    timeout_markstart(&tm);
+
+    total = 0;
+    for (;;) {
+        left = timeout_getretry(&tm);
+        if (left == 0) {
+            rc = IO_TIMEOUT;
+            break;
+        } else if (left > 0 && left < idle) {
+            timeout_init(&slice, -1, left);
+        } else {
+            timeout_init(&slice, -1, idle);
+            left = -1;
+        }
+        timeout_markstart(&slice);
+
+        if (h != NULL)
+            rc = sendq_drain(h, buf, LIO_DRAINLIMIT, &got, &slice);
+        else
+            rc = io_drain(&fd, buf, LIO_DRAINLIMIT, &got, &slice);
+        total += got;
+        if (h != NULL && h->sink.on && buf == &h->in)
+            handle_discard(h, buffer_len(buf));
+
+        if (rc == IO_DONE)
+            continue;
+        if (rc == IO_TIMEOUT && left < 0)
+            rc = IO_DONE;
+        break;
+    }
+
+    if (rc != IO_DONE && rc != IO_CLOSED) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushnumber(L, total);
+    lua_pushboolean(L, rc == IO_CLOSED);
+
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* consumed(handle|buffer, i, j) returns the bytes taken by the last
+* consume, after expect() the input through the end of the match. i and
+* j select a part of it as in string.sub. The bytes are only valid until
+* more input is read into the buffer; nil means they are gone.
+\*-------------------------------------------------------------------------*/
+static int lio_consumed(lua_State *L) {
+    buffer_t *buf;
+    size_t len;
+    long i;
+    long j;
+
+    buf = tobuffer(L, 1);
+    len = buffer_consumedlen(buf);
+    if (len == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    i = luaL_optlong(L, 2, 1);
+    j = luaL_optlong(L, 3, -1);
+    if (i < 0)
+        i += (long)len + 1;
+    if (j < 0)
+        j += (long)len + 1;
+    if (i < 1)
+        i = 1;
+    if (j > (long)len)
+        j = (long)len;
+
+    if (i > j)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, buffer_consumedptr(buf) + i - 1, j - i + 1);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* spill(handle|buffer, size) moves the storage of a buffer into a mapped
+* temporary file once it grows beyond size bytes; 0 turns this off
+\*-------------------------------------------------------------------------*/
+static int lio_spill(lua_State *L) {
+    buffer_t *buf;
+    double size;
+
+    buf = tobuffer(L, 1);
+    size = luaL_checknumber(L, 2);
+    if (size < 0) {
+        return luaL_error(L, "invalid size");
+    }
+
+    if (buffer_setspill(buf, (size_t)size) < 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "not supported");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* subscribe(handle, maxlag, policy) returns a cursor that sees all input
+* of the handle from now on, whoever reads it. Input is kept once for all
+* cursors. A cursor more than maxlag bytes behind is skipped ahead with
+* policy "drop" or detached with "detach"; "block" (the default) keeps
+* the input for it however long it takes.
+\*-------------------------------------------------------------------------*/
+static int lio_subscribe(lua_State *L) {
+    static const char *const policies[] = {"block", "drop", "detach", NULL};
+    handle_t *h;
+    fanout_t *fan;
+    cursor_t *cur;
+    double maxlag;
+    int policy;
+
+    h = tohandle(L, 1);
+    if (h == NULL) {
+        return luaL_error(L, "subscribe(handle: pty, maxlag: int, "
+                             "policy: string)");
+    }
+
+    maxlag = luaL_optnumber(L, 2, 0);
+    policy = luaL_checkoption(L, 3, "block", policies);
+    if (maxlag < 0) {
+        return luaL_error(L, "invalid maxlag");
+    }
+
+    if ((fan = handle_fanout(h)) == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+
+    cur = (cursor_t *)lua_newuserdata(L, sizeof(cursor_t));
+    cursor_attach(cur, fan, maxlag, policy);
+    luaL_getmetatable(L, LIO_CURSOR);
+    lua_setmetatable(L, -2);
+
+    /* the handle owns the chunks, keep it alive as long as the cursor */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Cancellation tokens
+*
+* token() makes a token, settoken(token) has every wait from then on
+* include it (nil for none), and cancel(token) makes those waits, blocked
+* or future, fail with "cancelled" until rearm(token). Other threads and
+* signal handlers cancel through lio_abi_cancel with token:getfd("w");
+* the descriptor may also be handed to another process with sendfd().
+\*-------------------------------------------------------------------------*/
+static int lio_token(lua_State *L) {
+    lio_token_t *tok;
+    int rc;
+
+    tok = (lio_token_t *)lua_newuserdata(L, sizeof(lio_token_t));
+    tok->rfd = tok->wfd = IO_FD_INVALID;
+    luaL_getmetatable(L, LIO_TOKEN);
+    lua_setmetatable(L, -2);
+
+    rc = io_token_open(&tok->rfd, &tok->wfd);
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(rc));
+        return 2;
+    }
+
+    return 1;
+}
+
+static int lio_settoken(lua_State *L) {
+    lio_token_t *tok;
+
+    if (lua_isnoneornil(L, 1)) {
+        io_setcancel(IO_FD_INVALID);
+        lua_pushnil(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, LIO_TOKEN_CURRENT);
+        return 0;
+    }
+
+    tok = (lio_token_t *)luaL_checkudata(L, 1, LIO_TOKEN);
+    io_setcancel(tok->rfd);
+    /* the token in use must not be collected */
+    lua_pushvalue(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LIO_TOKEN_CURRENT);
+
+    return 0;
+}
+
+static int lio_cancel(lua_State *L) {
+    lio_token_t *tok;
+    int rc;
+
+    tok = (lio_token_t *)luaL_checkudata(L, 1, LIO_TOKEN);
+    rc = io_token_cancel(tok->wfd);
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(rc));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+static int lio_rearm(lua_State *L) {
+    io_token_rearm(((lio_token_t *)luaL_checkudata(L, 1, LIO_TOKEN))->rfd);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* dialog(spec) compiles a dialog table into a state machine for run().
+*
+* spec is a list of states. A state is a list of alternatives, or a single
+* alternative itself, with optional fields name, timeout (seconds) and
+* ontimeout (state to go to instead of failing). An alternative is a table
+* with match (pattern), send (reply), and what to do next: next (state
+* name or index), done = true, fail = message, or call = true to return
+* to the caller. Without any of these it goes on to the following state,
+* and the last state is done.
+\*-------------------------------------------------------------------------*/
+static int lio_dialog(lua_State *L) {
+    dialog_t *d;
+    int n;
+    int i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+
+    d = (dialog_t *)lua_newuserdata(L, sizeof(dialog_t));
+    d->states = NULL;
+    d->nstates = 0;
+    luaL_getmetatable(L, LIO_DIALOG);
+    lua_setmetatable(L, -2);
+
+    n = (int)lua_objlen(L, 1);
+    if (n == 0) {
+        return luaL_error(L, "dialog: no states");
+    }
+
+    /* labels first, so that states can refer to later ones */
+    lua_newtable(L);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        luaL_checktype(L, -1, LUA_TTABLE);
+        lua_getfield(L, -1, "name");
+        if (lua_isstring(L, -1)) {
+            lua_pushinteger(L, i - 1);
+            lua_rawset(L, 3);
+            lua_pop(L, 1);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+
+    d->states = (dialog_state_t *)calloc(n, sizeof(dialog_state_t));
+    if (d->states == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    d->nstates = n;
+    dialog_compile(L, d, 1, 3);
+
+    lua_settop(L, 2);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* run(handle, dialog, timeout, state) runs a dialog from state (an index,
+* the first state by default). Returns "done", "fail" or "call" with the
+* state and alternative it ended in and the captures of the last match;
+* "fail" adds its message before the captures, "call" the state to resume
+* at, false if the dialog ends there. A dialog that keeps going round
+* returns "loop". Errors come back as nil, err, state.
+\*-------------------------------------------------------------------------*/
+static int lio_run(lua_State *L) {
+    static const char *const actions[] = {"goto", "done", "fail", "call",
+                                          "loop"};
+    handle_t *h;
+    dialog_t *d;
+    match_state_t ms;
+    int state;
+    int alt;
+    int action;
+    int next;
+    int rc;
+    int n;
+
+    h = tohandle(L, 1);
+    d = (dialog_t *)toudata(L, 2, LIO_DIALOG);
+    if (h == NULL || d == NULL) {
+        return luaL_error(L, "run(handle: pty, dialog: dialog, timeout: int, "
+                             "state: int)");
+    }
+
+    state = luaL_optint(L, 4, 1) - 1;
+    if (state < 0 || state >= d->nstates) {
+        return luaL_error(L, "invalid state");
+    }
+
+    action = DIALOG_LOOP;
+    rc = dialog_run(d, h, L, luaL_optnumber(L, 3, -1), &state, &alt,
+                    &action, &ms);
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        lua_pushinteger(L, state + 1);
+        return 3;
+    }
+
+    lua_pushstring(L, actions[action]);
+    lua_pushinteger(L, state + 1);
+    if (action == DIALOG_LOOP) {
+        return 2;
+    }
+    lua_pushinteger(L, alt + 1);
+    n = 3;
+    if (action == DIALOG_FAIL) {
+        lua_pushstring(L, d->states[state].alts[alt].msg);
+        n++;
+    } else if (action == DIALOG_CALL) {
+        next = d->states[state].alts[alt].next;
+        if (next < d->nstates)
+            lua_pushinteger(L, next + 1);
+        else
+            lua_pushboolean(L, 0);
+        n++;
+    }
+
+    return n + match_pushcaptures(&ms, NULL, NULL);
+}
+
+/*-------------------------------------------------------------------------*\
+* batch(handle, tag, n, timeout) splits the output of n commands framed by
+* tag markers (see batch.h) off the handle's input. Returns an array of
+* { output = string, status = int }, one per command, the output without
+* its last line break; the input is consumed through the last marker.
+* Until then it stays buffered, so a call that failed may be repeated.
+\*-------------------------------------------------------------------------*/
+static int lio_batch(lua_State *L) {
+    handle_t *h;
+    batch_t b;
+    batch_cmd_t *cmds;
+    const char *tag;
+    const char *p;
+    size_t taglen;
+    timeout_t tm;
+    int n;
+    int i;
+    int rc;
+
+    h = tohandle(L, 1);
+    if (h == NULL || !lua_isstring(L, 2) || !lua_isnumber(L, 3)) {
+        return luaL_error(L, "batch(handle: pty, tag: string, n: int, "
+                             "timeout: int)");
+    }
+
+    tag = lua_tolstring(L, 2, &taglen);
+    n = lua_tointeger(L, 3);
+    if (taglen == 0 || n <= 0) {
+        return luaL_error(L, "invalid batch");
+    }
+    if (h->sink.on) {
+        lua_pushnil(L);
+        lua_pushstring(L, "sink mode");
+        return 2;
+    }
+
+    cmds = (batch_cmd_t *)lua_newuserdata(L, n * sizeof(batch_cmd_t));
+    batch_init(&b, tag, taglen, cmds, n);
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 4, -1));
+    timeout_markstart(&tm);
+
+    if ((rc = batch_run(&b, h, &tm)) != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    p = buffer_ptr(&h->in);
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        lua_createtable(L, 0, 2);
+        lua_pushlstring(L, p + cmds[i].off, cmds[i].len);
+        lua_setfield(L, -2, "output");
+        lua_pushinteger(L, cmds[i].status);
+        lua_setfield(L, -2, "status");
+        lua_rawseti(L, -2, i + 1);
+    }
+    buffer_consume(&h->in, b.end);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* queue(handle, data, chunk, interval, jitter) queues data to be written
+* chunk bytes at a time, interval seconds apart plus up to jitter more.
+* The queue goes out while the handle is waited on, by expect, read or
+* select among others, so the caller never blocks on the pacing. Returns
+* the count of bytes written, over the handle's life, at which this data
+* is through; compare it with queued().
+\*-------------------------------------------------------------------------*/
+static int lio_queue(lua_State *L) {
+    handle_t *h;
+    const char *data;
+    size_t len;
+    double chunk;
+    double wait;
+    int rc;
+
+    h = tohandle(L, 1);
+    if (h == NULL || !lua_isstring(L, 2)) {
+        return luaL_error(L, "queue(handle: pty, data: string, chunk: int, "
+                             "interval: int, jitter: int)");
+    }
+
+    data = lua_tolstring(L, 2, &len);
+    chunk = luaL_optnumber(L, 3, 0);
+    if (chunk < 0) {
+        return luaL_error(L, "invalid chunk");
+    }
+
+    if (sendq_push(h, data, len, (size_t)chunk, luaL_optnumber(L, 4, 0),
+                   luaL_optnumber(L, 5, 0)) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+
+    /* the first chunk need not wait for the next wait */
+    if ((rc = sendq_pump(h, &wait)) != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushnumber(L, h->out->queued);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* queued(handle) returns the bytes written from the queue so far and the
+* bytes still waiting
+\*-------------------------------------------------------------------------*/
+static int lio_queued(lua_State *L) {
+    handle_t *h;
+
+    h = tohandle(L, 1);
+    if (h == NULL) {
+        return luaL_error(L, "queued(handle: pty)");
+    }
+
+    lua_pushnumber(L, h->out != NULL ? h->out->sent : 0);
+    lua_pushnumber(L, h->out != NULL ? buffer_len(&h->out->data) : 0);
+
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* source(path) maps a file for upload(); source(data, true) wraps a string
+* instead. Sources have len(), cksum() for the value cksum(1) prints, and
+* close().
+\*-------------------------------------------------------------------------*/
+static int lio_source(lua_State *L) {
+    lio_source_t *src;
+    const char *path;
+    size_t len;
+
+    path = luaL_checklstring(L, 1, &len);
+
+    src = (lio_source_t *)lua_newuserdata(L, sizeof(lio_source_t));
+    src->data = NULL;
+    src->len = 0;
+    src->mapped = 0;
+    luaL_getmetatable(L, LIO_SOURCE);
+    lua_setmetatable(L, -2);
+
+    if (lua_toboolean(L, 2)) {
+        /* the string stays referenced from the environment */
+        src->data = path;
+        src->len = len;
+        lua_newtable(L);
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, 1);
+        lua_setfenv(L, -2);
+        return 1;
+    }
+
+#ifndef _WIN32
+    {
+        struct stat st;
+        void *map;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ||
+            fstat(fd, &st) == -1) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: %s", path, strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return 2;
+        }
+        if (st.st_size > 0) {
+            map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                       0);
+            if (map == MAP_FAILED) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "%s: %s", path, strerror(errno));
+                close(fd);
+                return 2;
+            }
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            src->data = (const char *)map;
+            src->len = (size_t)st.st_size;
+            src->mapped = 1;
+        }
+        close(fd);
+    }
+#else
+    {
+        FILE *fp;
+        char *data;
+        long size;
+
+        if ((fp = fopen(path, "rb")) == NULL) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: %s", path, strerror(errno));
+            return 2;
+        }
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        data = size > 0 ? (char *)malloc(size) : NULL;
+        if (size > 0 &&
+            (data == NULL || fread(data, 1, size, fp) != (size_t)size)) {
+            free(data);
+            fclose(fp);
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: read failed", path);
+            return 2;
+        }
+        fclose(fp);
+        src->data = data;
+        src->len = size > 0 ? (size_t)size : 0;
+        src->mapped = data != NULL;
+    }
+#endif
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* upload(handle, source, offset, n, timeout, raw) writes n bytes of source
+* from offset on, base64 encoded in lines of 76 characters unless raw.
+* The source is encoded a bounded chunk at a time and every chunk is
+* written out in full, however many writes that takes. Encoded uploads
+* must be split at multiples of 3 bytes so their text concatenates.
+* Returns the number of source bytes sent.
+\*-------------------------------------------------------------------------*/
+static int lio_upload(lua_State *L) {
+    handle_t *h;
+    lio_source_t *src;
+    timeout_t tm;
+    double offset;
+    double n;
+    size_t off;
+    size_t end;
+    size_t step;
+    size_t len;
+    char *text;
+    int raw;
+    int hook;
+    int rc;
+
+    h = tohandle(L, 1);
+    src = (lio_source_t *)toudata(L, 2, LIO_SOURCE);
+    if (h == NULL || src == NULL) {
+        return luaL_error(L, "upload(handle: pty, source: source, "
+                             "offset: int, n: int, timeout: int, raw: boolean)");
+    }
+
+    offset = luaL_optnumber(L, 3, 0);
+    n = luaL_optnumber(L, 4, (double)src->len - offset);
+    raw = lua_toboolean(L, 6);
+    if (offset < 0 || n < 0 || offset + n > (double)src->len ||
+        (!raw && (size_t)offset % 3 != 0)) {
+        return luaL_error(L, "invalid range");
+    }
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 5, -1));
+    timeout_markstart(&tm);
+
+    off = (size_t)offset;
+    end = off + (size_t)n;
+    text = NULL;
+    if (!raw && end > off &&
+        (text = (char *)malloc(codec_b64size(LIO_UPLOADCHUNK))) == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+
+    /* a chunk cut short could not be resumed, so uploads block */
+    hook = io_gethook();
+    io_sethook(0);
+    rc = IO_DONE;
+    while (off < end) {
+        step = end - off < LIO_UPLOADCHUNK ? end - off : LIO_UPLOADCHUNK;
+        if (raw) {
+            rc = writeall(&h->wfd, src->data + off, step, &tm);
+        } else {
+            len = codec_b64encode((const unsigned char *)src->data + off,
+                                  step, text);
+            rc = writeall(&h->wfd, text, len, &tm);
+        }
+        if (rc != IO_DONE)
+            break;
+        off += step;
+    }
+    io_sethook(hook);
+    free(text);
+
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        lua_pushnumber(L, (double)(off - (size_t)offset));
+        return 3;
+    }
+
+    lua_pushnumber(L, n);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* base64(data) returns data base64 encoded, in lines as base64(1) writes
+\*-------------------------------------------------------------------------*/
+static int lio_base64(lua_State *L) {
+    const char *data;
+    size_t n;
+    char *text;
+
+    data = luaL_checklstring(L, 1, &n);
+    if ((text = (char *)malloc(codec_b64size(n))) == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    n = codec_b64encode((const unsigned char *)data, n, text);
+    lua_pushlstring(L, text, n);
+    free(text);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* sethook(on) sets the wait hook for hosts that run their own event loop:
+* reads, writes, expect and the like then never block but fail with
+* "wait", and waiting() returns the descriptor, "r", "w" or "rw", and the
+* deadline (on the ltimeout.gettime clock, nil for none) to wait for
+* before retrying. Returns whether the hook was set before; without an
+* argument it is left as it is.
+\*-------------------------------------------------------------------------*/
+static int lio_sethook(lua_State *L) {
+    lua_pushboolean(L, io_gethook());
+    if (!lua_isnone(L, 1))
+        io_sethook(lua_toboolean(L, 1));
+    return 1;
+}
+
+static int lio_waiting(lua_State *L) {
+    static const char *const modes[] = {"", "r", "w", "rw"};
+    double deadline;
+    int fd;
+    int sw;
+
+    if (io_getwait(&fd, &sw, &deadline) < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, fd);
+    lua_pushstring(L, modes[sw & 3]);
+    if (deadline < 0)
+        lua_pushnil(L);
+    else
+        lua_pushnumber(L, deadline);
+
+    return 3;
+}
+
+/*-------------------------------------------------------------------------*\
+* Unix domain sockets, for handing descriptors to other processes
+\*-------------------------------------------------------------------------*/
+static int lio_listen(lua_State *L) {
+    int fd;
+    int rc;
+
+    if (!lua_isstring(L, 1)) {
+        return luaL_error(L, "listen(path: string, backlog: int)");
+    }
+
+    rc = io_listen(&fd, lua_tostring(L, 1), luaL_optint(L, 2, 32));
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(rc));
+        return 2;
+    }
+
+    lua_pushinteger(L, fd);
+
+    return 1;
+}
+
+static int lio_connect(lua_State *L) {
+    int fd;
+    int rc;
+
+    if (!lua_isstring(L, 1)) {
+        return luaL_error(L, "connect(path: string)");
+    }
+
+    rc = io_connect(&fd, lua_tostring(L, 1));
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(rc));
+        return 2;
+    }
+
+    lua_pushinteger(L, fd);
+
+    return 1;
+}
+
+static int lio_accept(lua_State *L) {
+    int fd;
+    int client;
+    int rc;
+    timeout_t tm;
+
+    if (!lua_isnumber(L, 1)) {
+        return luaL_error(L, "accept(fd: int, timeout: int)");
+    }
+
+    fd = lua_tointeger(L, 1);
+    timeout_init(&tm, -1, luaL_optnumber(L, 2, -1));
+    timeout_markstart(&tm);
+
+    rc = io_accept(&fd, &client, &tm);
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushinteger(L, client);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* sendfd(sock, data, fd, timeout) sends a short message over a unix
+* socket, with a duplicate of fd attached unless fd is nil
+\*-------------------------------------------------------------------------*/
+static int lio_sendfd(lua_State *L) {
+    int sock;
+    int fd;
+    int rc;
+    size_t size;
+    const char *data;
+    timeout_t tm;
+
+    if (!lua_isnumber(L, 1) || !lua_isstring(L, 2)) {
+        return luaL_error(
+            L, "sendfd(sock: int, data: string, fd: int, timeout: int)");
+    }
+
+    sock = lua_tointeger(L, 1);
+    data = lua_tolstring(L, 2, &size);
+    if (size == 0) {
+        return luaL_error(L, "zero size");
+    }
+
+    fd = lua_isnoneornil(L, 3) ? IO_FD_INVALID : tofd(L, 3);
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 4, -1));
+    timeout_markstart(&tm);
+
+    rc = io_sendfd(&sock, data, size, fd, &tm);
+    if (rc != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* recvfd(sock, size, timeout) returns a message of at most size bytes and
+* the descriptor that came with it, or nil if none did
+\*-------------------------------------------------------------------------*/
+static int lio_recvfd(lua_State *L) {
+    int sock;
+    int fd;
+    int rc;
+    int size;
+    size_t got;
+    char *buf;
+    timeout_t tm;
+
+    if (!lua_isnumber(L, 1) || !lua_isnumber(L, 2)) {
+        return luaL_error(L, "recvfd(sock: int, size: int, timeout: int)");
+    }
+
+    sock = lua_tointeger(L, 1);
+    size = lua_tointeger(L, 2);
+    if (size <= 0) {
+        return luaL_error(L, "invalid size");
+    }
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 3, -1));
+    timeout_markstart(&tm);
+
+    buf = (char *)malloc(size);
+    if (buf == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+
+    rc = io_recvfd(&sock, buf, size, &got, &fd, &tm);
+    if (rc != IO_DONE) {
+        free(buf);
+        lua_pushnil(L);
+        lua_pushstring(L, io_strerror(rc));
+        return 2;
+    }
+
+    lua_pushlstring(L, buf, got);
+    free(buf);
+    if (fd == IO_FD_INVALID)
+        lua_pushnil(L);
+    else
+        lua_pushinteger(L, fd);
+
+    return 2;
+}
+
+/*=========================================================================*\
+* Buffer methods
+*
+* These also serve as lio.buffered/peek/consume/clear, which accept a
+* handle as well and work on its input buffer.
+\*=========================================================================*/
+static int lio_buffer_len(lua_State *L) {
+    buffer_t *buf;
+
+    buf = tobuffer(L, 1);
+    lua_pushnumber(L, buffer_len(buf));
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the buffered bytes from i to j, with the same index rules as
+* string.sub. Nothing is consumed.
+\*-------------------------------------------------------------------------*/
+static int lio_buffer_get(lua_State *L) {
+    buffer_t *buf;
+    long len;
+    long i;
+    long j;
+
+    buf = tobuffer(L, 1);
+    len = (long)buffer_len(buf);
+    i = luaL_optlong(L, 2, 1);
+    j = luaL_optlong(L, 3, -1);
+
+    if (i < 0)
+        i += len + 1;
+    if (i < 1)
+        i = 1;
+    if (j < 0)
+        j += len + 1;
+    if (j > len)
+        j = len;
+
+    if (i > j)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, buffer_ptr(buf) + i - 1, j - i + 1);
+
+    return 1;
+}
+
+static int lio_buffer_consume(lua_State *L) {
+    buffer_t *buf;
+    double n;
+
+    buf = tobuffer(L, 1);
+    n = luaL_checknumber(L, 2);
+    if (n > 0)
+        buffer_consume(buf, (size_t)n);
+
+    return 0;
+}
+
+static int lio_buffer_clear(lua_State *L) {
+    buffer_clear(tobuffer(L, 1));
+    return 0;
+}
+
+static int lio_buffer_gc(lua_State *L) {
+    buffer_free((buffer_t *)luaL_checkudata(L, 1, LIO_BUFFER));
+    return 0;
+}
+
+/*=========================================================================*\
+* Cursor methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* read(max) returns up to max bytes of pending input, "" if there is none,
+* or nil, "detached"
+\*-------------------------------------------------------------------------*/
+static int lio_cursor_read(lua_State *L) {
+    luaL_Buffer b;
+    cursor_t *cur;
+    const char *data;
+    double max;
+    size_t n;
+
+    cur = (cursor_t *)luaL_checkudata(L, 1, LIO_CURSOR);
+    max = luaL_optnumber(L, 2, LIO_DRAINLIMIT);
+    if (cur->fan == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "detached");
+        return 2;
+    }
+
+    luaL_buffinit(L, &b);
+    while (max > 0 && (n = cursor_peek(cur, &data)) > 0) {
+        if (n > max)
+            n = (size_t)max;
+        luaL_addlstring(&b, data, n);
+        cursor_advance(cur, n);
+        max -= n;
+    }
+    luaL_pushresult(&b);
+
+    return 1;
+}
+
+static int lio_cursor_pending(lua_State *L) {
+    cursor_t *cur;
+
+    cur = (cursor_t *)luaL_checkudata(L, 1, LIO_CURSOR);
+    lua_pushnumber(L, cursor_pending(cur));
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* writeto(fd, timeout) writes the pending input to fd straight from the
+* chunks and returns the number of bytes written
+\*-------------------------------------------------------------------------*/
+static int lio_cursor_writeto(lua_State *L) {
+    cursor_t *cur;
+    const char *data;
+    double total;
+    size_t sent;
+    size_t n;
+    int fd;
+    int rc;
+    timeout_t tm;
+
+    cur = (cursor_t *)luaL_checkudata(L, 1, LIO_CURSOR);
+    if (!isfd(L, 2)) {
+        return luaL_error(L, "writeto(fd: int, timeout: int)");
+    }
+    fd = tofd(L, 2);
+    if (fd == IO_FD_INVALID) {
+        return luaL_error(L, "invalid fd");
+    }
+    if (cur->fan == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "detached");
+        return 2;
+    }
+
+    timeout_init(&tm, -1, luaL_optnumber(L, 3, -1));
+    timeout_markstart(&tm);
+
+    total = 0;
+    while ((n = cursor_peek(cur, &data)) > 0) {
+        rc = io_write(&fd, data, n, &sent, &tm);
+        cursor_advance(cur, sent);
+        total += sent;
+        if (rc != IO_DONE) {
+            lua_pushnil(L);
+            lua_pushstring(L, io_strerror(rc));
+            lua_pushnumber(L, total);
+            return 3;
+        }
+    }
+
+    lua_pushnumber(L, total);
+
+    return 1;
+}
+
+static int lio_cursor_dropped(lua_State *L) {
+    cursor_t *cur;
+
+    cur = (cursor_t *)luaL_checkudata(L, 1, LIO_CURSOR);
+    lua_pushnumber(L, cur->dropped);
+    lua_pushboolean(L, cur->fan == NULL);
+
+    return 2;
+}
+
+static int lio_cursor_close(lua_State *L) {
+    cursor_detach((cursor_t *)luaL_checkudata(L, 1, LIO_CURSOR));
+    return 0;
+}
+
+/*=========================================================================*\
+* Token methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* getfd(mode) returns the descriptor waited for, or with "w" the one
+* written to cancel; the former lets a token go into select()
+\*-------------------------------------------------------------------------*/
+static int lio_token_getfd(lua_State *L) {
+    lio_token_t *tok;
+    const char *mode;
+
+    tok = (lio_token_t *)luaL_checkudata(L, 1, LIO_TOKEN);
+    mode = luaL_optstring(L, 2, "r");
+    lua_pushinteger(L, strchr(mode, 'w') ? tok->wfd : tok->rfd);
+
+    return 1;
+}
+
+static int lio_source_len(lua_State *L) {
+    lua_pushnumber(L,
+                   ((lio_source_t *)luaL_checkudata(L, 1, LIO_SOURCE))->len);
+    return 1;
+}
+
+static int lio_source_cksum(lua_State *L) {
+    lio_source_t *src;
+    unsigned long crc;
+
+    src = (lio_source_t *)luaL_checkudata(L, 1, LIO_SOURCE);
+    crc = codec_crc(0, (const unsigned char *)src->data, src->len);
+    lua_pushnumber(L, (double)codec_cksum(crc, (double)src->len));
+    lua_pushnumber(L, (double)src->len);
+
+    return 2;
+}
+
+static int lio_source_close(lua_State *L) {
+    lio_source_t *src;
+
+    src = (lio_source_t *)luaL_checkudata(L, 1, LIO_SOURCE);
+    if (src->mapped) {
+#ifndef _WIN32
+        munmap((void *)src->data, src->len);
+#else
+        free((void *)src->data);
+#endif
+    }
+    src->data = NULL;
+    src->len = 0;
+    src->mapped = 0;
+
+    return 0;
+}
+
+static int lio_token_gc(lua_State *L) {
+    lio_token_t *tok;
+
+    tok = (lio_token_t *)luaL_checkudata(L, 1, LIO_TOKEN);
+    if (tok->rfd != IO_FD_INVALID && io_getcancel() == tok->rfd)
+        io_setcancel(IO_FD_INVALID);
+    io_token_close(&tok->rfd, &tok->wfd);
+
+    return 0;
+}
+
+static int lio_dialog_gc(lua_State *L) {
+    dialog_free((dialog_t *)luaL_checkudata(L, 1, LIO_DIALOG));
+    return 0;
+}
+
+static int lio_pattern_gc(lua_State *L) {
+    pattern_free((pattern_t *)luaL_checkudata(L, 1, LIO_PATTERN));
+    return 0;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Returns the userdata at idx if its metatable is meta, NULL otherwise
+\*-------------------------------------------------------------------------*/
+static void *toudata(lua_State *L, int idx, const char *meta) {
+    void *p;
+
+    p = NULL;
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    if (lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx)) {
+        luaL_getmetatable(L, meta);
+        if (lua_rawequal(L, -1, -2))
+            p = lua_touserdata(L, idx);
+        lua_pop(L, 2);
+    }
+
+    return p;
+}
+
+static handle_t *tohandle(lua_State *L, int idx) {
+    return (handle_t *)toudata(L, idx, HANDLE_META);
+}
+
+static int isfd(lua_State *L, int idx) {
+    return lua_isnumber(L, idx) || tohandle(L, idx) != NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the descriptor of a number or handle argument
+\*-------------------------------------------------------------------------*/
+static int tofd(lua_State *L, int idx) {
+    handle_t *h;
+
+    if ((h = tohandle(L, idx)) != NULL)
+        return h->fd;
+    if (lua_isnumber(L, idx))
+        return lua_tointeger(L, idx);
+
+    return IO_FD_INVALID;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the descriptor to write to of a number or handle argument
+\*-------------------------------------------------------------------------*/
+static int towfd(lua_State *L, int idx) {
+    handle_t *h;
+
+    if ((h = tohandle(L, idx)) != NULL)
+        return h->wfd;
+
+    return tofd(L, idx);
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns a buffer argument, or the input buffer of a handle argument
+\*-------------------------------------------------------------------------*/
+static buffer_t *tobuffer(lua_State *L, int idx) {
+    handle_t *h;
+
+    if ((h = tohandle(L, idx)) != NULL)
+        return &h->in;
+
+    return (buffer_t *)luaL_checkudata(L, idx, LIO_BUFFER);
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes the buffered input up to the delimiter and consumes it along
+* with the delimiter, reading more input until the delimiter shows up.
+* Only bytes not searched yet are scanned after each refill.
+\*-------------------------------------------------------------------------*/
+static int read_until(lua_State *L, handle_t *h, const char *delim,
+                      size_t dlen, size_t max, int chomp, timeout_t *tm) {
+    buffer_t *buf;
+    const char *p;
+    const char *hit;
+    size_t scanned;
+    size_t len;
+    size_t got;
+    int eof;
+    int rc;
+
+    buf = &h->in;
+    scanned = 0;
+    eof = 0;
+
+    for (;;) {
+        p = buffer_ptr(buf);
+        len = buffer_len(buf);
+        if (len - scanned >= dlen) {
+            if (dlen == 1)
+                hit = (const char *)memchr(p + scanned, *delim, len - scanned);
+            else
+                hit = (const char *)memmem(p + scanned, len - scanned, delim,
+                                           dlen);
+            if (hit != NULL) {
+                len = hit - p;
+                if (chomp && len > 0 && p[len - 1] == '\r')
+                    len--;
+                lua_pushlstring(L, p, len);
+                buffer_consume(buf, hit - p + dlen);
+                return 1;
+            }
+            /* the delimiter may straddle the end of what we have */
+            scanned = len - dlen + 1;
+        }
+
+        if (max > 0 && len >= max) {
+            lua_pushnil(L);
+            lua_pushstring(L, "limit");
+            return 2;
+        }
+
+        if (eof) {
+            if (len == 0) {
+                lua_pushnil(L);
+                lua_pushstring(L, io_strerror(IO_CLOSED));
+                return 2;
+            }
+            lua_pushlstring(L, p, len);
+            buffer_clear(buf);
+            return 1;
+        }
+
+        rc = sendq_drain(h, buf, LIO_DRAINLIMIT, &got, tm);
+        if (rc == IO_CLOSED) {
+            eof = 1;
+        } else if (rc != IO_DONE) {
+            lua_pushnil(L);
+            lua_pushstring(L, io_strerror(rc));
+            return 2;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Accepts a compiled pattern or a string; a string is compiled into a
+* temporary pattern, left on the stack in its place so it gets collected.
+\*-------------------------------------------------------------------------*/
+static pattern_t *topattern(lua_State *L, int idx) {
+    pattern_t *pat;
+
+    if ((pat = (pattern_t *)toudata(L, idx, LIO_PATTERN)) != NULL)
+        return pat;
+
+    luaL_checkstring(L, idx);
+    lua_pushcfunction(L, lio_pattern);
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    lua_replace(L, idx);
+
+    return (pattern_t *)lua_touserdata(L, idx);
+}
+
+/*-------------------------------------------------------------------------*\
+* Fills the states of a dialog from its spec table; names maps labels to
+* state indexes. Errors leave a partly filled dialog for its __gc.
+\*-------------------------------------------------------------------------*/
+static void dialog_compile(lua_State *L, dialog_t *d, int spec, int names) {
+    dialog_state_t *st;
+    dialog_alt_t *a;
+    const char *src;
+    size_t len;
+    int single;
+    int top;
+    int i;
+    int j;
+
+    top = lua_gettop(L);
+    for (i = 0; i < d->nstates; i++) {
+        st = &d->states[i];
+        lua_rawgeti(L, spec, i + 1);
+
+        lua_getfield(L, -1, "name");
+        st->name = lua_isstring(L, -1) ? dialog_strdup(L, -1, NULL) : NULL;
+        lua_getfield(L, -2, "timeout");
+        st->timeout = luaL_optnumber(L, -1, -1);
+        lua_getfield(L, -3, "ontimeout");
+        st->ontimeout =
+            lua_isnil(L, -1) ? -1 : dialog_target(L, names, -1, i);
+        lua_pop(L, 3);
+
+        /* a state with a match field is its own single alternative */
+        lua_getfield(L, -1, "match");
+        single = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        st->nalts = single ? 1 : (int)lua_objlen(L, -1);
+        if (st->nalts == 0) {
+            luaL_error(L, "dialog: state %d has no alternatives", i + 1);
+        }
+        st->alts = (dialog_alt_t *)calloc(st->nalts, sizeof(dialog_alt_t));
+        if (st->alts == NULL) {
+            st->nalts = 0;
+            luaL_error(L, "out of memory");
+        }
+
+        for (j = 0; j < st->nalts; j++) {
+            a = &st->alts[j];
+            if (single)
+                lua_pushvalue(L, -1);
+            else
+                lua_rawgeti(L, -1, j + 1);
+            luaL_checktype(L, -1, LUA_TTABLE);
+
+            lua_getfield(L, -1, "match");
+            if (!lua_isstring(L, -1))
+                luaL_error(L, "dialog: state %d: match must be a string",
+                           i + 1);
+            src = lua_tolstring(L, -1, &len);
+            if (pattern_compile(&a->pat, src, len) < 0) {
+                memset(&a->pat, 0, sizeof(pattern_t));
+                luaL_error(L, "out of memory");
+            }
+            lua_pop(L, 1);
+
+            lua_getfield(L, -1, "send");
+            if (!lua_isnil(L, -1))
+                a->send = dialog_strdup(L, -1, &a->sendlen);
+            lua_pop(L, 1);
+
+            /* what comes after the reply */
+            a->action = DIALOG_GOTO;
+            a->next = i + 1;
+            lua_getfield(L, -1, "next");
+            lua_getfield(L, -2, "done");
+            lua_getfield(L, -3, "fail");
+            lua_getfield(L, -4, "call");
+            if (lua_toboolean(L, -1)) {
+                a->action = DIALOG_CALL;
+            } else if (!lua_isnil(L, -2)) {
+                a->action = DIALOG_FAIL;
+                a->msg = dialog_strdup(L, -2, NULL);
+            } else if (lua_toboolean(L, -3)) {
+                a->action = DIALOG_DONE;
+            }
+            if (!lua_isnil(L, -4))
+                a->next = dialog_target(L, names, -4, i);
+            else if (a->action == DIALOG_GOTO && a->next == d->nstates)
+                a->action = DIALOG_DONE;
+            lua_pop(L, 5);
+        }
+        lua_pop(L, 1);
+    }
+    lua_settop(L, top);
+}
+
+/*-------------------------------------------------------------------------*\
+* Resolves a state reference, a label or a 1 based index
+\*-------------------------------------------------------------------------*/
+static int dialog_target(lua_State *L, int names, int idx, int state) {
+    int n;
+
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        n = (int)lua_tointeger(L, idx) - 1;
+    } else {
+        lua_pushvalue(L, idx);
+        lua_rawget(L, names);
+        n = lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : -1;
+        lua_pop(L, 1);
+    }
+    if (n < 0 || n >= (int)lua_objlen(L, 1)) {
+        return luaL_error(L, "dialog: state %d: no state %s", state + 1,
+                          lua_tostring(L, idx));
+    }
+
+    return n;
+}
+
+/*-------------------------------------------------------------------------*\
+* Copies a Lua string to the heap, raising an error if out of memory
+\*-------------------------------------------------------------------------*/
+static char *dialog_strdup(lua_State *L, int idx, size_t *len) {
+    const char *s;
+    size_t n;
+    char *copy;
+
+    s = luaL_checklstring(L, idx, &n);
+    if ((copy = (char *)malloc(n + 1)) == NULL) {
+        luaL_error(L, "out of memory");
+        return NULL;
+    }
+    memcpy(copy, s, n + 1);
+    if (len != NULL)
+        *len = n;
+
+    return copy;
+}
+
+/*-------------------------------------------------------------------------*\
+* Writes all n bytes, going on after partial writes until the timeout
+\*-------------------------------------------------------------------------*/
+static int writeall(int *fd, const char *data, size_t n, timeout_t *tm) {
+    size_t sent;
+    int rc;
+
+    while (n > 0) {
+        if ((rc = io_write(fd, data, n, &sent, tm)) != IO_DONE)
+            return rc;
+        data += sent;
+        n -= sent;
+    }
+
+    return IO_DONE;
+}
+
+static int getfd(lua_State *L, int w) {
+    double numfd;
+    int fd;
+    handle_t *h;
+
+    /* native handles carry their fds, no need to ask Lua */
+    if ((h = tohandle(L, -1)) != NULL)
+        return w ? h->wfd : h->fd;
+
+    fd = IO_FD_INVALID;
+
+    lua_pushstring(L, "getfd");
+    lua_gettable(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);
+        if (lua_isnumber(L, -1)) {
+            numfd = lua_tonumber(L, -1);
+            fd = (numfd >= 0.0) ? (int)numfd : IO_FD_INVALID;
+        }
+    }
+    lua_pop(L, 1);
+    return fd;
+}
+
+static int dirty(lua_State *L) {
+    int is;
+    handle_t *h;
+
+    if ((h = tohandle(L, -1)) != NULL)
+        return handle_dirty(h);
+
+    is = 0;
+
+    lua_pushstring(L, "dirty");
+    lua_gettable(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);
+        is = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    return is;
+}
+
+/*-------------------------------------------------------------------------*\
+* Adds the fds of the objects in tab to set. If dtab is not zero, objects
+* that are dirty go straight to dtab instead; returns how many did.
+\*-------------------------------------------------------------------------*/
+static int collect_fd(lua_State *L, int tab, int dtab, int w, fd_set *set,
+                      int *max_fd) {
+    int i;
+    int n;
+    int ndirty;
+
+    i = 1;
+    n = 0;
+    ndirty = 0;
+
+    /* nil is the same as an empty table */
+    if (lua_isnil(L, tab))
+        return 0;
+    /* otherwise we need it to be a table */
+    luaL_checktype(L, tab, LUA_TTABLE);
+    for (;;) {
+        int fd;
+        lua_rawgeti(L, tab, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        /* getfd figures out if this is a fd */
+        fd = getfd(L, w);
+        if (fd != IO_FD_INVALID) {
+            if (dtab && dirty(L)) {
+                /* already has data, no need to wait for it */
+                add_result(L, dtab, ++ndirty);
+            } else {
+/* make sure we don't overflow the fd_set */
+#ifdef _WIN32
+                if (n >= FD_SETSIZE)
+                    luaL_argerror(L, tab, "too many file descriptors");
+#else
+                if (fd >= FD_SETSIZE)
+                    luaL_argerror(L, tab, "descriptor too large for set size");
+#endif
+                FD_SET(fd, set);
+                n++;
+                /* keep track of the largest descriptor so far */
+                if (*max_fd == IO_FD_INVALID || *max_fd < fd)
+                    *max_fd = fd;
+            }
+        }
+        lua_pop(L, 1);
+        i = i + 1;
+    }
+
+    return ndirty;
+}
+
+/*-------------------------------------------------------------------------*\
+* Pumps the paced output of the handles in tab
+* Returns
+*   seconds until the next chunk of any of them is due, -1 for none
+\*-------------------------------------------------------------------------*/
+static double pump_fd(lua_State *L, int tab) {
+    handle_t *h;
+    double wait;
+    double next;
+    int i;
+
+    next = -1;
+    if (!lua_istable(L, tab))
+        return next;
+    for (i = 1;; i++) {
+        lua_rawgeti(L, tab, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        /* write errors show up on the next read of the handle */
+        h = tohandle(L, -1);
+        if (h != NULL && h->out != NULL &&
+            sendq_pump(h, &wait) == IO_DONE && wait >= 0 &&
+            (next < 0 || wait < next))
+            next = wait;
+        lua_pop(L, 1);
+    }
+
+    return next;
+}
+
+/*-------------------------------------------------------------------------*\
+* Appends the objects of tab whose fd is in set to the result table
+\*-------------------------------------------------------------------------*/
+static void return_fd(lua_State *L, int tab, int w, fd_set *set, int rtab,
+                      int start) {
+    int i;
+    int fd;
+
+    if (lua_isnil(L, tab))
+        return;
+
+    for (i = 1;; i++) {
+        lua_rawgeti(L, tab, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        fd = getfd(L, w);
+        if (fd != IO_FD_INVALID && FD_ISSET(fd, set)) {
+            /* report each descriptor once */
+            FD_CLR(fd, set);
+            add_result(L, rtab, ++start);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Stores the object on top of the stack both as rtab[i] and rtab[obj] = i
+\*-------------------------------------------------------------------------*/
+static void add_result(lua_State *L, int rtab, int i) {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, rtab, i);
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, i);
+    lua_rawset(L, rtab);
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the index of an empty result table. A table passed by the
+* caller is cleared and reused, so a select loop makes no garbage.
+\*-------------------------------------------------------------------------*/
+static int result_table(lua_State *L, int idx) {
+    if (lua_isnil(L, idx)) {
+        lua_newtable(L);
+        lua_replace(L, idx);
+        return idx;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, idx);
+    }
+
+    return idx;
 }
 
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
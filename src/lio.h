@@ -7,9 +7,58 @@
 #include "lua.h"
 #include "lua_compat.h"
 
+#include "batch.h"
+#include "buffer.h"
+#include "codec.h"
+#include "dialog.h"
+#include "fanout.h"
+#include "handle.h"
 #include "io.h"
+#include "lio_abi.h"
+#include "match.h"
+#include "sendq.h"
 #include "timeout.h"
 
+/* metatable name of buffer userdata */
+#define LIO_BUFFER "lio.buffer"
+
+/* metatable name of compiled pattern userdata */
+#define LIO_PATTERN "lio.pattern"
+
+/* metatable name of fan-out cursor userdata */
+#define LIO_CURSOR "lio.cursor"
+
+/* metatable name of compiled dialog userdata */
+#define LIO_DIALOG "lio.dialog"
+
+/* metatable name of cancellation token userdata */
+#define LIO_TOKEN "lio.token"
+
+/* registry key of the token settoken() made current */
+#define LIO_TOKEN_CURRENT "lio.token.current"
+
+/* metatable name of upload source userdata */
+#define LIO_SOURCE "lio.source"
+
+/* bytes to upload, a mapped file or a Lua string */
+typedef struct lio_source_s {
+    const char *data;
+    size_t len;
+    int mapped; /* data is a mapping to unmap, or malloc'ed on Windows */
+} lio_source_t;
+
+/* source bytes encoded per write of an upload */
+#define LIO_UPLOADCHUNK (CODEC_LINEBYTES * 1024)
+
+/* cancellation token, see io_token_open */
+typedef struct lio_token_s {
+    int rfd; /* waited for */
+    int wfd; /* written to cancel */
+} lio_token_t;
+
+/* default byte limit of a single drain() */
+#define LIO_DRAINLIMIT (1024 * 1024)
+
 LUALIB_API int luaopen_lio(lua_State *L);
 
 #endif /* LIO_H */
@@ -0,0 +1,96 @@
+/*=========================================================================*\
+* Plain C entry points of the lio library
+*
+* Timeouts follow the Lua API: seconds as a double, negative for none.
+\*=========================================================================*/
+#include "lio_abi.h"
+
+#include "buffer.h"
+#include "handle.h"
+#include "io.h"
+#include "timeout.h"
+
+int lio_abi_version(void) {
+    return LIO_ABI_VERSION;
+}
+
+const char *lio_abi_strerror(int err) {
+    return io_strerror(err);
+}
+
+int lio_abi_waitfd(int fd, int sw, double timeout) {
+    timeout_t tm;
+
+    timeout_init(&tm, -1, timeout);
+    timeout_markstart(&tm);
+
+    return io_waitfd(&fd, sw, &tm);
+}
+
+int lio_abi_read(int fd, char *data, size_t count, size_t *got,
+                 double timeout) {
+    timeout_t tm;
+
+    timeout_init(&tm, -1, timeout);
+    timeout_markstart(&tm);
+
+    return io_read(&fd, data, count, got, &tm);
+}
+
+int lio_abi_write(int fd, const char *data, size_t count, size_t *sent,
+                  double timeout) {
+    timeout_t tm;
+
+    timeout_init(&tm, -1, timeout);
+    timeout_markstart(&tm);
+
+    return io_write(&fd, data, count, sent, &tm);
+}
+
+int lio_abi_drain(int fd, void *buf, size_t limit, size_t *got,
+                  double timeout) {
+    timeout_t tm;
+
+    timeout_init(&tm, -1, timeout);
+    timeout_markstart(&tm);
+
+    return io_drain(&fd, (buffer_t *)buf, limit, got, &tm);
+}
+
+size_t lio_abi_buffer_len(void *buf) {
+    return buffer_len((buffer_t *)buf);
+}
+
+const char *lio_abi_buffer_ptr(void *buf) {
+    return buffer_ptr((buffer_t *)buf);
+}
+
+void lio_abi_buffer_consume(void *buf, size_t n) {
+    buffer_consume((buffer_t *)buf, n);
+}
+
+void lio_abi_buffer_clear(void *buf) {
+    buffer_clear((buffer_t *)buf);
+}
+
+int lio_abi_handle_fd(void *h) {
+    return ((handle_t *)h)->fd;
+}
+
+int lio_abi_handle_wfd(void *h) {
+    return ((handle_t *)h)->wfd;
+}
+
+void *lio_abi_handle_buffer(void *h) {
+    return &((handle_t *)h)->in;
+}
+
+/*-------------------------------------------------------------------------*\
+* Signals a cancellation token given its write descriptor; safe to call
+* from any thread or from a signal handler
+\*-------------------------------------------------------------------------*/
+int lio_abi_cancel(int fd) {
+    return io_token_cancel(fd);
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
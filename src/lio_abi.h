@@ -0,0 +1,46 @@
+#ifndef LIO_ABI_H
+#define LIO_ABI_H
+/*=========================================================================*\
+* Plain C entry points of the lio library
+*
+* These take only scalars and pointers, no lua_State, and keep their
+* signatures across releases, so they can be bound with the LuaJIT FFI
+* (see lio/ffi.lua). Buffers and handles are passed as the address of
+* their userdata and are otherwise opaque.
+\*=========================================================================*/
+
+#include <stddef.h>
+
+#include "lua.h"
+
+#ifndef LIO_API
+#define LIO_API LUALIB_API
+#endif
+
+#define LIO_ABI_VERSION 2
+
+/* wait conditions for lio_abi_waitfd */
+#define LIO_ABI_WAITR 1
+#define LIO_ABI_WAITW 2
+
+LIO_API int lio_abi_version(void);
+LIO_API const char *lio_abi_strerror(int err);
+LIO_API int lio_abi_waitfd(int fd, int sw, double timeout);
+LIO_API int lio_abi_read(int fd, char *data, size_t count, size_t *got,
+                         double timeout);
+LIO_API int lio_abi_write(int fd, const char *data, size_t count,
+                          size_t *sent, double timeout);
+LIO_API int lio_abi_drain(int fd, void *buf, size_t limit, size_t *got,
+                          double timeout);
+LIO_API size_t lio_abi_buffer_len(void *buf);
+LIO_API const char *lio_abi_buffer_ptr(void *buf);
+LIO_API void lio_abi_buffer_consume(void *buf, size_t n);
+LIO_API void lio_abi_buffer_clear(void *buf);
+LIO_API int lio_abi_handle_fd(void *h);
+LIO_API int lio_abi_handle_wfd(void *h);
+LIO_API void *lio_abi_handle_buffer(void *h);
+LIO_API int lio_abi_cancel(int fd);
+
+#endif /* LIO_ABI_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
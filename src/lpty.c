@@ -1,15 +1,47 @@
+#define _GNU_SOURCE
 #include "lpty.h"
 
+#include <stdio.h>
+
 #define LPTY_VERSION "0.0.1"
 
 static int lpty_execvpe(const char *file, char **argv, char **envp);
 static int lpty_login_tty(int slave_fd);
+static void lpty_closefrom(int lowfd);
 
 static int lpty_fork(int master, int slave, int *amaster, char *name,
                      struct termios *termp, struct winsize *winp);
 static int lpty_spawn(lua_State *L);
+static void lpty_exec(char **argv, char **env, const char *cwd,
+                      lpty_spawnopts_t *opts);
+static char **lpty_argv(lua_State *L, int fileidx, int argsidx);
+static char **lpty_env(lua_State *L, int idx);
+static void lpty_freestrings(char **v);
+static int lpty_pipe(lua_State *L);
+static int lpty_pipe2(int fds[2]);
+static int lpty_spawn_pipe(lua_State *L);
+static int lpty_closeinput(lua_State *L);
+static void lpty_spawnopts(lua_State *L, int idx, lpty_spawnopts_t *opts);
+static int lpty_applyspawnopts(lpty_spawnopts_t *opts);
+static int lpty_joincgroup(const char *path);
 static int lpty_open(lua_State *L);
 static int lpty_turn_echoing_off(lua_State *L);
+static int lpty_tcsetattr(lua_State *L);
+static int lpty_attach(lua_State *L);
+static int lpty_fds(lua_State *L);
+static int lpty_watch(lua_State *L);
+static int lpty_unwatch(lua_State *L);
+static int lpty_expired(lua_State *L);
+static int lpty_watchfd(lua_State *L);
+static int lpty_checkprofile(lua_State *L, int idx);
+static void lpty_profile(lua_State *L, int idx, struct termios *tp);
+static int lpty_applyprofile(lua_State *L, int idx, int fd);
+
+static int lpty_index(lua_State *L);
+static int lpty_getfd(lua_State *L);
+static int lpty_dirty(lua_State *L);
+static int lpty_setdirty(lua_State *L);
+static int lpty_gc(lua_State *L);
 
 LUALIB_API int luaopen_lpty(lua_State *L);
 
@@ -62,9 +94,38 @@ static int lpty_login_tty(int slave_fd) {
     if (slave_fd >= 3)
         close(slave_fd);
 
+    /* the slave is close-on-exec, which dup2 clears but an fd below 3
+       kept in place would still have */
+    for (i = 0; i < 3; i++)
+        fcntl(i, F_SETFD, 0);
+
     return 0;
 }
 
+/*-------------------------------------------------------------------------*\
+* Closes every descriptor from lowfd up, in the child before exec, so
+* that it holds no other session's master or slave whatever flags they
+* were created with
+\*-------------------------------------------------------------------------*/
+static void lpty_closefrom(int lowfd) {
+    long max;
+    int fd;
+
+#if defined(__linux__) && defined(SYS_close_range)
+    if (syscall(SYS_close_range, (unsigned int)lowfd, ~0U, 0) == 0)
+        return;
+#elif defined(__FreeBSD__)
+    closefrom(lowfd);
+    return;
+#endif
+
+    max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > LPTY_MAXCLOSE)
+        max = LPTY_MAXCLOSE;
+    for (fd = lowfd; fd < max; fd++)
+        close(fd);
+}
+
 static int lpty_fork(int master, int slave, int *amaster, char *name,
                      struct termios *termp, struct winsize *winp) {
     int pid;
@@ -82,6 +143,7 @@ static int lpty_fork(int master, int slave, int *amaster, char *name,
             perror("login_tty failed");
             _exit(1);
         }
+        lpty_closefrom(3);
         return 0;
     default:
         /* Parent. */
@@ -91,14 +153,16 @@ static int lpty_fork(int master, int slave, int *amaster, char *name,
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* spawn(master, slave, file, args, env, cwd, cols, rows, opts) runs file
+* on the slave side of the pty. opts is an optional table of settings for
+* the child, see lpty_spawnopts.
+\*-------------------------------------------------------------------------*/
 static int lpty_spawn(lua_State *L) {
+    lpty_spawnopts_t opts;
     int top;
-    int i;
-    int argc;
-    int envc;
     char **argv;
     char **env;
-    const char *file;
     char *cwd;
     struct winsize winp;
     int master;
@@ -107,36 +171,19 @@ static int lpty_spawn(lua_State *L) {
     char name[64];
 
     top = lua_gettop(L);
-    if (top != 8 || !lua_isnumber(L, 1) || !lua_isnumber(L, 2) ||
+    if (top < 8 || top > 9 || !lua_isnumber(L, 1) || !lua_isnumber(L, 2) ||
         !lua_isstring(L, 3) || !lua_istable(L, 4) || !lua_istable(L, 5) ||
-        !lua_isstring(L, 6) || !lua_isnumber(L, 7) || !lua_isnumber(L, 8)) {
+        !lua_isstring(L, 6) || !lua_isnumber(L, 7) || !lua_isnumber(L, 8) ||
+        !(lua_isnoneornil(L, 9) || lua_istable(L, 9))) {
         return luaL_error(
-            L, "spawn(master, slave, file, args, env, cwd, cols, rows)");
-    }
-
-    argc = luaL_getn(L, 4);
-    argv = calloc(argc + 2, sizeof(char *));
-    file = lua_tostring(L, 3);
-
-    i = 0;
-    argv[i++] = strdup(file);
-    argv[argc + 1] = NULL;
-    for (; i < argc + 1; i++) {
-        lua_rawgeti(L, 4, i);
-        argv[i] = strdup(lua_tostring(L, -1));
-        lua_pop(L, 1);
+            L, "spawn(master, slave, file, args, env, cwd, cols, rows, opts)");
     }
 
-    i = 0;
-    envc = luaL_getn(L, 5);
-    env = calloc(envc + 1, sizeof(char *));
-    env[envc] = NULL;
-    for (; i < envc; i++) {
-        lua_rawgeti(L, 5, i + 1);
-        env[i] = strdup(lua_tostring(L, -1));
-        lua_pop(L, 1);
-    }
+    /* raises errors, so before anything is allocated */
+    lpty_spawnopts(L, 9, &opts);
 
+    argv = lpty_argv(L, 3, 4);
+    env = lpty_env(L, 5);
     cwd = strdup(lua_tostring(L, 6));
 
     winp.ws_xpixel = 0;
@@ -149,13 +196,10 @@ static int lpty_spawn(lua_State *L) {
     pid = lpty_fork(master, slave, &master, name, NULL, &winp);
 
     if (pid) {
-        for (i = 0; i < argc + 2; i++)
-            free(argv[i]);
-        free(argv);
-        for (i = 0; i < envc; i++)
-            free(env[i]);
-        free(env);
+        lpty_freestrings(argv);
+        lpty_freestrings(env);
         free(cwd);
+        free(opts.cgroup);
     }
 
     switch (pid) {
@@ -164,29 +208,453 @@ static int lpty_spawn(lua_State *L) {
         lua_pushstring(L, "forkpty failed");
         return 2;
     case 0:
-        if (strlen(cwd))
-            chdir(cwd);
+        lpty_exec(argv, env, cwd, &opts);
+    }
 
-        if (setgid(getgid()) == -1) {
-            perror("setgid failed");
-            _exit(1);
-        }
-        if (setuid(getuid()) == -1) {
-            perror("setuid failed");
+    lua_pushinteger(L, pid);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* What a spawned child does once its descriptors are in place; does not
+* return
+\*-------------------------------------------------------------------------*/
+static void lpty_exec(char **argv, char **env, const char *cwd,
+                      lpty_spawnopts_t *opts) {
+    if (strlen(cwd))
+        chdir(cwd);
+
+    if (lpty_applyspawnopts(opts) == -1)
+        _exit(1);
+
+    if (setgid(getgid()) == -1) {
+        perror("setgid failed");
+        _exit(1);
+    }
+    if (setuid(getuid()) == -1) {
+        perror("setuid failed");
+        _exit(1);
+    }
+
+    lpty_execvpe(argv[0], argv, env);
+
+    perror("execvp failed");
+    _exit(1);
+}
+
+/*-------------------------------------------------------------------------*\
+* Argument vector of file and the strings in the table at argsidx, and
+* environment from the one at idx; both end with NULL
+\*-------------------------------------------------------------------------*/
+static char **lpty_argv(lua_State *L, int fileidx, int argsidx) {
+    char **argv;
+    int argc;
+    int i;
+
+    argc = luaL_getn(L, argsidx);
+    argv = calloc(argc + 2, sizeof(char *));
+    argv[0] = strdup(lua_tostring(L, fileidx));
+    for (i = 1; i < argc + 1; i++) {
+        lua_rawgeti(L, argsidx, i);
+        argv[i] = strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    argv[argc + 1] = NULL;
+
+    return argv;
+}
+
+static char **lpty_env(lua_State *L, int idx) {
+    char **env;
+    int envc;
+    int i;
+
+    envc = luaL_getn(L, idx);
+    env = calloc(envc + 1, sizeof(char *));
+    for (i = 0; i < envc; i++) {
+        lua_rawgeti(L, idx, i + 1);
+        env[i] = strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    env[envc] = NULL;
+
+    return env;
+}
+
+static void lpty_freestrings(char **v) {
+    char **p;
+
+    for (p = v; *p != NULL; p++)
+        free(*p);
+    free(v);
+}
+
+/*-------------------------------------------------------------------------*\
+* pipe(size) opens a session on pipes instead of a pty, for children that
+* need no terminal: no line discipline, echo or CRLF translation, and on
+* Linux pipes of size bytes (LPTY_PIPESIZE by default, as far as
+* pipe-max-size allows) instead of the few kilobytes a pty holds. The
+* handle reads the child's stdout and writes its stdin, both without
+* blocking; spawn_pipe starts the child.
+\*-------------------------------------------------------------------------*/
+static int lpty_pipe(lua_State *L) {
+    lpty_t *pty;
+    int in[2];
+    int out[2];
+    int size;
+    int n;
+
+    size = luaL_optint(L, 1, LPTY_PIPESIZE);
+
+    if (lpty_pipe2(in) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    if (lpty_pipe2(out) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        return 2;
+    }
+
+#if defined(F_SETPIPE_SZ)
+    /* unprivileged processes are capped, settle for what is allowed */
+    for (n = size; n > 4096 && fcntl(out[0], F_SETPIPE_SZ, n) == -1; n /= 2)
+        ;
+    for (n = size; n > 4096 && fcntl(in[1], F_SETPIPE_SZ, n) == -1; n /= 2)
+        ;
+#else
+    (void)n;
+#endif
+
+    /* our ends only, the child gets blocking ones */
+    fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL, 0) | O_NONBLOCK);
+
+    pty = (lpty_t *)lua_newuserdata(L, sizeof(lpty_t));
+    handle_init(&pty->io, out[0]);
+    pty->io.wfd = in[1];
+    pty->slave = out[1];
+    pty->input = in[0];
+    strcpy(pty->name, "pipe");
+
+    luaL_getmetatable(L, HANDLE_META);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int lpty_pipe2(int fds[2]) {
+#if defined(__linux__) || defined(__FreeBSD__)
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) == -1)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    return 0;
+#endif
+}
+
+/*-------------------------------------------------------------------------*\
+* spawn_pipe(pipe, file, args, env, cwd, opts) runs file on a handle from
+* lpty.pipe, leading a session of its own as with spawn. opts.stderr says
+* where its stderr goes: "merge" (the default) into stdout, as on a tty,
+* "inherit" to ours, or "pipe" to a pipe of its own, whose read end is
+* returned after the pid. The other opts are those of spawn.
+\*-------------------------------------------------------------------------*/
+static const char *const lpty_stderrs[] = {"merge", "inherit", "pipe", NULL};
+
+static int lpty_spawn_pipe(lua_State *L) {
+    lpty_spawnopts_t opts;
+    lpty_t *pty;
+    char **argv;
+    char **env;
+    char *cwd;
+    int err[2];
+    int mode;
+    int top;
+    pid_t pid;
+
+    top = lua_gettop(L);
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    if (top < 5 || top > 6 || !lua_isstring(L, 2) || !lua_istable(L, 3) ||
+        !lua_istable(L, 4) || !lua_isstring(L, 5) ||
+        !(lua_isnoneornil(L, 6) || lua_istable(L, 6))) {
+        return luaL_error(L, "spawn_pipe(pipe, file, args, env, cwd, opts)");
+    }
+
+    if (pty->input < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "no pipe");
+        return 2;
+    }
+
+    /* both raise errors, so before anything is allocated */
+    mode = 0;
+    if (!lua_isnoneornil(L, 6)) {
+        lua_getfield(L, 6, "stderr");
+        if (!lua_isnil(L, -1))
+            mode = luaL_checkoption(L, -1, NULL, lpty_stderrs);
+        lua_pop(L, 1);
+    }
+    lpty_spawnopts(L, 6, &opts);
+
+    err[0] = err[1] = -1;
+    if (mode == 2 && lpty_pipe2(err) == -1) {
+        free(opts.cgroup);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    argv = lpty_argv(L, 2, 3);
+    env = lpty_env(L, 4);
+    cwd = strdup(lua_tostring(L, 5));
+
+    if ((pid = fork()) == 0) {
+        /* dup2 leaves the copies open across exec */
+        setsid();
+        if (dup2(pty->input, 0) == -1 || dup2(pty->slave, 1) == -1 ||
+            (mode == 0 && dup2(pty->slave, 2) == -1) ||
+            (mode == 2 && dup2(err[1], 2) == -1)) {
+            perror("dup2 failed");
             _exit(1);
         }
+        lpty_closefrom(3);
+        lpty_exec(argv, env, cwd, &opts);
+    }
 
-        lpty_execvpe(argv[0], argv, env);
+    lpty_freestrings(argv);
+    lpty_freestrings(env);
+    free(cwd);
+    free(opts.cgroup);
+    if (err[1] >= 0)
+        close(err[1]);
 
-        perror("execvp failed");
-        _exit(1);
+    if (pid == -1) {
+        if (err[0] >= 0)
+            close(err[0]);
+        lua_pushnil(L);
+        lua_pushstring(L, "fork failed");
+        return 2;
     }
 
+    /* the child's ends are the child's alone now */
+    close(pty->input);
+    close(pty->slave);
+    pty->input = pty->slave = -1;
+
+    lua_pushinteger(L, pid);
+    if (mode != 2)
+        return 1;
+    lua_pushinteger(L, err[0]);
+
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* closeinput(pipe) closes the child's stdin, which then reads end of file;
+* on a pty send it ^D instead
+\*-------------------------------------------------------------------------*/
+static int lpty_closeinput(lua_State *L) {
+    lpty_t *pty;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    if (pty->io.wfd == pty->io.fd) {
+        lua_pushnil(L);
+        lua_pushstring(L, "not a pipe");
+        return 2;
+    }
+
+    if (pty->io.wfd >= 0) {
+        close(pty->io.wfd);
+        pty->io.wfd = -1;
+    }
     lua_pushboolean(L, 1);
 
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Spawn options
+*
+* A table with any of
+*   cpus = {0, 1}       CPUs the child may run on (Linux)
+*   sched = "idle"      scheduling policy, "idle", "batch" or "other"
+*   nice = 10           nice value
+*   rlimits = {cpu = 60, as = 1e9, nofile = 256}
+*                       limits in seconds, bytes and descriptors; a number
+*                       sets both soft and hard limit, {soft, hard} each
+*   cgroup = "/sys/fs/cgroup/expect"
+*                       cgroup the child joins, created beforehand
+* applied in the child before exec, cgroup first, so that a driver can
+* keep its own cores and bound what a runaway child may take.
+\*-------------------------------------------------------------------------*/
+static const char *const lpty_rlimits[] = {"cpu", "as", "nofile", NULL};
+static const int lpty_resources[] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE};
+
+static const char *const lpty_scheds[] = {"other", "batch", "idle", NULL};
+
+static void lpty_spawnopts(lua_State *L, int idx, lpty_spawnopts_t *opts) {
+    int i;
+    int n;
+
+    memset(opts, 0, sizeof(lpty_spawnopts_t));
+    opts->sched = -1;
+    if (lua_isnoneornil(L, idx))
+        return;
+
+    lua_getfield(L, idx, "cpus");
+    if (!lua_isnil(L, -1)) {
+#if defined(__linux__)
+        luaL_checktype(L, -1, LUA_TTABLE);
+        CPU_ZERO(&opts->cpus);
+        for (i = 1; i <= (int)lua_objlen(L, -1); i++) {
+            lua_rawgeti(L, -1, i);
+            n = lua_tointeger(L, -1);
+            if (!lua_isnumber(L, -1) || n < 0 || n >= CPU_SETSIZE)
+                luaL_error(L, "spawn: invalid cpu");
+            CPU_SET(n, &opts->cpus);
+            lua_pop(L, 1);
+        }
+        opts->hascpus = 1;
+#else
+        luaL_error(L, "spawn: cpus not supported");
+#endif
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "sched");
+    if (!lua_isnil(L, -1)) {
+        switch (luaL_checkoption(L, -1, NULL, lpty_scheds)) {
+        case 0:
+            opts->sched = SCHED_OTHER;
+            break;
+#if defined(SCHED_BATCH) && defined(SCHED_IDLE)
+        case 1:
+            opts->sched = SCHED_BATCH;
+            break;
+        case 2:
+            opts->sched = SCHED_IDLE;
+            break;
+#endif
+        default:
+            luaL_error(L, "spawn: sched not supported");
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "nice");
+    if (!lua_isnil(L, -1)) {
+        opts->nice = luaL_checkint(L, -1);
+        opts->hasnice = 1;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "rlimits");
+    if (!lua_isnil(L, -1)) {
+        luaL_checktype(L, -1, LUA_TTABLE);
+        for (i = 0; lpty_rlimits[i] != NULL; i++) {
+            lua_getfield(L, -1, lpty_rlimits[i]);
+            if (lua_istable(L, -1)) {
+                lua_rawgeti(L, -1, 1);
+                lua_rawgeti(L, -2, 2);
+                opts->rlim[i].rlim_cur = (rlim_t)luaL_checknumber(L, -2);
+                opts->rlim[i].rlim_max = (rlim_t)luaL_checknumber(L, -1);
+                opts->hasrlim[i] = 1;
+                lua_pop(L, 2);
+            } else if (!lua_isnil(L, -1)) {
+                opts->rlim[i].rlim_cur = (rlim_t)luaL_checknumber(L, -1);
+                opts->rlim[i].rlim_max = opts->rlim[i].rlim_cur;
+                opts->hasrlim[i] = 1;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "cgroup");
+    if (!lua_isnil(L, -1))
+        opts->cgroup = strdup(luaL_checkstring(L, -1));
+    lua_pop(L, 1);
+}
+
+/*-------------------------------------------------------------------------*\
+* Applies spawn options in the child
+* Returns
+*   0, or -1 after reporting what failed on stderr
+\*-------------------------------------------------------------------------*/
+static int lpty_applyspawnopts(lpty_spawnopts_t *opts) {
+    int i;
+
+    if (opts->cgroup != NULL && lpty_joincgroup(opts->cgroup) == -1) {
+        perror("cgroup failed");
+        return -1;
+    }
+
+#if defined(__linux__)
+    if (opts->hascpus &&
+        sched_setaffinity(0, sizeof(cpu_set_t), &opts->cpus) == -1) {
+        perror("sched_setaffinity failed");
+        return -1;
+    }
+#endif
+
+    if (opts->sched >= 0) {
+        struct sched_param param;
+
+        param.sched_priority = 0;
+        if (sched_setscheduler(0, opts->sched, &param) == -1) {
+            perror("sched_setscheduler failed");
+            return -1;
+        }
+    }
+
+    if (opts->hasnice && setpriority(PRIO_PROCESS, 0, opts->nice) == -1) {
+        perror("setpriority failed");
+        return -1;
+    }
+
+    for (i = 0; i < LPTY_NRLIMITS; i++) {
+        if (opts->hasrlim[i] &&
+            setrlimit(lpty_resources[i], &opts->rlim[i]) == -1) {
+            perror("setrlimit failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Moves the calling process into the cgroup at path
+\*-------------------------------------------------------------------------*/
+static int lpty_joincgroup(const char *path) {
+    char procs[4096];
+    int fd;
+    int rc;
+
+    if (snprintf(procs, sizeof(procs), "%s/cgroup.procs", path) >=
+        (int)sizeof(procs)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fd = open(procs, O_WRONLY)) == -1)
+        return -1;
+
+    /* 0 stands for the writer itself */
+    rc = write(fd, "0\n", 2) == 2 ? 0 : -1;
+    close(fd);
+
+    return rc;
+}
+
 static int lpty_open(lua_State *L) {
     int top;
     int rc;
@@ -194,11 +662,14 @@ static int lpty_open(lua_State *L) {
     int slave;
     char name[64];
     struct winsize winp;
+    lpty_t *pty;
 
     top = lua_gettop(L);
 
-    if (top != 2 || !lua_isnumber(L, 1) || !lua_isnumber(L, 2))
-        return luaL_error(L, "open(cols: int, rows: int)");
+    if (top < 2 || top > 3 || !lua_isnumber(L, 1) || !lua_isnumber(L, 2))
+        return luaL_error(L, "open(cols: int, rows: int, termios: profile)");
+
+    lpty_checkprofile(L, 3);
 
     winp.ws_xpixel = 0;
     winp.ws_ypixel = 0;
@@ -213,17 +684,174 @@ static int lpty_open(lua_State *L) {
         return 2;
     }
 
-    lua_createtable(L, 0 /* narr */, 3 /* nrec */);
+    /* no child but the one spawned on it may hold either end */
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+    fcntl(slave, F_SETFD, FD_CLOEXEC);
+
+    /* the child inherits the slave's settings, so set them before spawn */
+    if (!lua_isnoneornil(L, 3) && lpty_applyprofile(L, 3, slave) == -1) {
+        close(master);
+        close(slave);
+        lua_pushnil(L);
+        lua_pushstring(L, "tcsetattr failed");
+        return 2;
+    }
+
+    pty = (lpty_t *)lua_newuserdata(L, sizeof(lpty_t));
+    handle_init(&pty->io, master);
+    pty->slave = slave;
+    pty->input = -1;
+    strncpy(pty->name, name, sizeof(pty->name) - 1);
+    pty->name[sizeof(pty->name) - 1] = '\0';
+
+    luaL_getmetatable(L, HANDLE_META);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Wraps a master fd obtained elsewhere, e.g. passed over a unix socket,
+* in a handle. The handle has no slave.
+\*-------------------------------------------------------------------------*/
+static int lpty_attach(lua_State *L) {
+    lpty_t *pty;
+
+    if (!lua_isnumber(L, 1))
+        return luaL_error(L, "attach(master: int, name: string)");
+
+    pty = (lpty_t *)lua_newuserdata(L, sizeof(lpty_t));
+    handle_init(&pty->io, lua_tointeger(L, 1));
+    pty->slave = -1;
+    pty->input = -1;
+    strncpy(pty->name, luaL_optstring(L, 2, ""), sizeof(pty->name) - 1);
+    pty->name[sizeof(pty->name) - 1] = '\0';
+
+    luaL_getmetatable(L, HANDLE_META);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* fds(pid) lists the descriptors above stderr that a process holds, as a
+* table from descriptor to what it refers to, to check spawned children
+* for leaked descriptors. Returns nil, err where /proc is not available.
+\*-------------------------------------------------------------------------*/
+static int lpty_fds(lua_State *L) {
+#if defined(__linux__)
+    char dir[64];
+    char path[64 + NAME_MAX + 2];
+    char target[PATH_MAX];
+    struct dirent *ent;
+    DIR *dp;
+    ssize_t len;
+    int fd;
+
+    snprintf(dir, sizeof(dir), "/proc/%d/fd", luaL_optint(L, 1, getpid()));
+    if ((dp = opendir(dir)) == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_newtable(L);
+    while ((ent = readdir(dp)) != NULL) {
+        fd = atoi(ent->d_name);
+        if (fd < 3 || fd == dirfd(dp))
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >=
+            (int)sizeof(path))
+            continue;
+        if ((len = readlink(path, target, sizeof(target) - 1)) < 0)
+            continue;
+        lua_pushlstring(L, target, len);
+        lua_rawseti(L, -2, fd);
+    }
+    closedir(dp);
+
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushstring(L, "not supported");
+    return 2;
+#endif
+}
+
+/*-------------------------------------------------------------------------*\
+* watch(pty, pid, opts) hands a session to the watchdog, which stops its
+* child pid after opts.idle seconds without output or opts.ttl seconds
+* in all, sending SIGHUP, SIGTERM and SIGKILL opts.grace seconds apart
+* (1 by default). Watching again replaces the limits.
+\*-------------------------------------------------------------------------*/
+static int lpty_watch(lua_State *L) {
+    lpty_t *pty;
+    double limits[3];
+    static const char *const names[] = {"idle", "ttl", "grace"};
+    int err;
+    int i;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    if (!lua_isnumber(L, 2) || !lua_istable(L, 3))
+        return luaL_error(L, "watch(pty: pty, pid: int, opts: table)");
+
+    for (i = 0; i < 3; i++) {
+        lua_getfield(L, 3, names[i]);
+        limits[i] = luaL_optnumber(L, -1, i == 2 ? 1 : 0);
+        lua_pop(L, 1);
+    }
+
+    err = watchdog_add(&pty->io, (pid_t)lua_tointeger(L, 2), limits[0],
+                       limits[1], limits[2]);
+    if (err != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+static int lpty_unwatch(lua_State *L) {
+    watchdog_remove(&((lpty_t *)luaL_checkudata(L, 1, HANDLE_META))->io);
+    return 0;
+}
 
-    lua_pushinteger(L, master);
-    lua_setfield(L, -2, "master");
+/*-------------------------------------------------------------------------*\
+* expired(pty) returns "idle" or "ttl" once the watchdog has stopped and
+* reaped the session's child, with its exit status (128 + signal if it
+* was killed); false otherwise
+\*-------------------------------------------------------------------------*/
+static int lpty_expired(lua_State *L) {
+    lpty_t *pty;
+    int reason;
+    int status;
 
-    lua_pushinteger(L, slave);
-    lua_setfield(L, -2, "slave");
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    watchdog_clearfd();
+    if (watchdog_state(&pty->io, &reason, &status) != 1 ||
+        reason == WATCHDOG_NONE) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
 
-    lua_pushstring(L, name);
-    lua_setfield(L, -2, "name");
+    lua_pushstring(L, reason == WATCHDOG_IDLE ? "idle" : "ttl");
+    if (WIFSIGNALED(status))
+        lua_pushinteger(L, 128 + WTERMSIG(status));
+    else
+        lua_pushinteger(L, WEXITSTATUS(status));
 
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* Descriptor that turns readable when the watchdog stopped a session, for
+* select loops; expired() clears it
+\*-------------------------------------------------------------------------*/
+static int lpty_watchfd(lua_State *L) {
+    lua_pushinteger(L, watchdog_getfd());
     return 1;
 }
 
@@ -249,13 +877,213 @@ static int lpty_turn_echoing_off(lua_State *L) {
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Applies a termios profile to a live session, given its handle or fd.
+* On the master side this changes the settings of the slave.
+\*-------------------------------------------------------------------------*/
+static int lpty_tcsetattr(lua_State *L) {
+    lpty_t *pty;
+    int fd;
+
+    if (lua_isnumber(L, 1)) {
+        fd = lua_tointeger(L, 1);
+    } else {
+        pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+        fd = pty->io.fd;
+    }
+
+    luaL_checkany(L, 2);
+    lpty_checkprofile(L, 2);
+
+    if (lpty_applyprofile(L, 2, fd) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, "tcsetattr failed");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Termios profiles
+*
+* A profile is either the name "raw" or "noecho", or a table with any of
+*   raw = true      no line editing, signals or output processing
+*   echo = false    do not echo input back
+*   onlcr = false   do not turn "\n" into "\r\n" on output
+*   vmin, vtime     VMIN/VTIME for non-canonical reads
+* applied in that order on top of the current settings.
+\*-------------------------------------------------------------------------*/
+static const char *const lpty_profiles[] = {"raw", "noecho", NULL};
+
+/*-------------------------------------------------------------------------*\
+* Raises errors for bad profiles before anything is allocated
+\*-------------------------------------------------------------------------*/
+static int lpty_checkprofile(lua_State *L, int idx) {
+    if (lua_isnoneornil(L, idx) || lua_istable(L, idx))
+        return 0;
+
+    return luaL_checkoption(L, idx, NULL, lpty_profiles);
+}
+
+static void lpty_profile(lua_State *L, int idx, struct termios *tp) {
+    if (lua_isstring(L, idx)) {
+        if (strcmp(lua_tostring(L, idx), "raw") == 0)
+            cfmakeraw(tp);
+        else
+            tp->c_lflag &= ~(ECHO | ECHONL);
+        return;
+    }
+
+    lua_getfield(L, idx, "raw");
+    if (lua_toboolean(L, -1))
+        cfmakeraw(tp);
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "echo");
+    if (!lua_isnil(L, -1)) {
+        if (lua_toboolean(L, -1))
+            tp->c_lflag |= ECHO;
+        else
+            tp->c_lflag &= ~(ECHO | ECHONL);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "onlcr");
+    if (!lua_isnil(L, -1)) {
+        if (lua_toboolean(L, -1))
+            tp->c_oflag |= OPOST | ONLCR;
+        else
+            tp->c_oflag &= ~ONLCR;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "vmin");
+    if (lua_isnumber(L, -1))
+        tp->c_cc[VMIN] = (cc_t)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "vtime");
+    if (lua_isnumber(L, -1))
+        tp->c_cc[VTIME] = (cc_t)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+}
+
+static int lpty_applyprofile(lua_State *L, int idx, int fd) {
+    struct termios tp;
+
+    if (tcgetattr(fd, &tp) == -1)
+        return -1;
+
+    lpty_profile(L, idx, &tp);
+
+    return tcsetattr(fd, TCSANOW, &tp);
+}
+
+/*-------------------------------------------------------------------------*\
+* Handle fields and methods
+*
+* master, slave and name read like the fields of a plain table; anything
+* else is looked up in the method table, the only upvalue.
+\*-------------------------------------------------------------------------*/
+static int lpty_index(lua_State *L) {
+    lpty_t *pty;
+    const char *key;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    key = luaL_checkstring(L, 2);
+
+    if (strcmp(key, "master") == 0) {
+        lua_pushinteger(L, pty->io.fd);
+    } else if (strcmp(key, "slave") == 0) {
+        lua_pushinteger(L, pty->slave);
+    } else if (strcmp(key, "name") == 0) {
+        lua_pushstring(L, pty->name);
+    } else {
+        lua_getfield(L, lua_upvalueindex(1), key);
+    }
+
+    return 1;
+}
+
+static int lpty_getfd(lua_State *L) {
+    lpty_t *pty;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    lua_pushinteger(L, pty->io.fd);
+
+    return 1;
+}
+
+static int lpty_dirty(lua_State *L) {
+    lpty_t *pty;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    lua_pushboolean(L, handle_dirty(&pty->io));
+
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Lets a buffering layer on top of the pty tell select that input is
+* pending, without select having to call back into Lua.
+\*-------------------------------------------------------------------------*/
+static int lpty_setdirty(lua_State *L) {
+    lpty_t *pty;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    pty->io.dirty = lua_toboolean(L, 2);
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Frees the input buffers; the descriptors stay open, they are closed
+* explicitly with lio.destroy.
+\*-------------------------------------------------------------------------*/
+static int lpty_gc(lua_State *L) {
+    lpty_t *pty;
+
+    pty = (lpty_t *)luaL_checkudata(L, 1, HANDLE_META);
+    watchdog_remove(&pty->io);
+    handle_free(&pty->io);
+
+    return 0;
+}
+
+static const struct luaL_Reg lpty_meths[] = {{"getfd", lpty_getfd},
+                                             {"dirty", lpty_dirty},
+                                             {"setdirty", lpty_setdirty},
+                                             {NULL, NULL}};
+
 static const struct luaL_Reg lpty_funcs[] = {
     {"open", lpty_open},
     {"spawn", lpty_spawn},
+    {"pipe", lpty_pipe},
+    {"spawn_pipe", lpty_spawn_pipe},
+    {"closeinput", lpty_closeinput},
     {"turn_echoing_off", lpty_turn_echoing_off},
+    {"tcsetattr", lpty_tcsetattr},
+    {"attach", lpty_attach},
+    {"fds", lpty_fds},
+    {"watch", lpty_watch},
+    {"unwatch", lpty_unwatch},
+    {"expired", lpty_expired},
+    {"watchfd", lpty_watchfd},
     {NULL, NULL}};
 
 int luaopen_lpty(lua_State *L) {
+    luaL_newmetatable(L, HANDLE_META);
+    lua_newtable(L);
+    luaL_register(L, NULL, lpty_meths);
+    lua_pushcclosure(L, lpty_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lpty_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     luaL_register(L, "lpty", lpty_funcs);
 
     return 1;
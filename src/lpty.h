@@ -1,14 +1,44 @@
 #ifndef LPTY_H
 #define LPTY_H
 
+#include "handle.h"
 #include "lua_compat.h"
 #include "pty_compat.h"
+#include "watchdog.h"
 
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
 #include <stdlib.h>
 
+/* pty pair returned by lpty.open */
+typedef struct lpty_s {
+    handle_t io; /* must come first, lio reads it in place */
+    int slave;   /* for pipes the write end of the child's stdout */
+    int input;   /* read end of the child's stdin pipe, -1 for a pty */
+    char name[64];
+} lpty_t;
+
+/* capacity asked for the pipes of lpty.pipe, in bytes */
+#define LPTY_PIPESIZE (1024 * 1024)
+
+/* resource limits a spawn option may set */
+#define LPTY_NRLIMITS 3
+
+/* settings applied to a spawned child before exec */
+typedef struct lpty_spawnopts_s {
+#if defined(__linux__)
+    cpu_set_t cpus;
+#endif
+    int hascpus;
+    int sched;     /* scheduling policy, -1 to keep */
+    int nice;
+    int hasnice;
+    struct rlimit rlim[LPTY_NRLIMITS];
+    int hasrlim[LPTY_NRLIMITS];
+    char *cgroup;  /* cgroup directory to join, NULL for none */
+} lpty_spawnopts_t;
+
 LUALIB_API int luaopen_lpty(lua_State *L);
 
 #endif /* LPTY_H */
@@ -0,0 +1,592 @@
+/*=========================================================================*\
+* Lua pattern matching over raw memory
+*
+* The matching engine is taken from Lua 5.1 lstrlib.c
+* Copyright (C) 1994-2012 Lua.org, PUC-Rio, under the MIT license.
+* Changes: the subject need not be NUL terminated, and patterns carry a
+* literal prefilter built by pattern_compile.
+\*=========================================================================*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memmem */
+#endif
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "match.h"
+
+#define L_ESC '%'
+#define SPECIALS "^$*+?.([%-"
+
+#define uchar(c) ((unsigned char)(c))
+
+static const char *match(match_state_t *ms, const char *s, const char *p);
+
+/*=========================================================================*\
+* Matching engine
+\*=========================================================================*/
+static int check_capture(match_state_t *ms, int l) {
+    l -= '1';
+    if (l < 0 || l >= ms->level ||
+        ms->capture[l].len == MATCH_CAP_UNFINISHED)
+        return luaL_error(ms->L, "invalid capture index");
+    return l;
+}
+
+static int capture_to_close(match_state_t *ms) {
+    int level = ms->level;
+    for (level--; level >= 0; level--)
+        if (ms->capture[level].len == MATCH_CAP_UNFINISHED)
+            return level;
+    return luaL_error(ms->L, "invalid pattern capture");
+}
+
+static const char *class_end(match_state_t *ms, const char *p) {
+    switch (*p++) {
+    case L_ESC:
+        if (*p == '\0')
+            luaL_error(ms->L, "malformed pattern (ends with '%%')");
+        return p + 1;
+    case '[':
+        if (*p == '^')
+            p++;
+        do { /* look for a ']' */
+            if (*p == '\0')
+                luaL_error(ms->L, "malformed pattern (missing ']')");
+            if (*(p++) == L_ESC && *p != '\0')
+                p++; /* skip escapes (e.g. '%]') */
+        } while (*p != ']');
+        return p + 1;
+    default:
+        return p;
+    }
+}
+
+static int match_class(int c, int cl) {
+    int res;
+    switch (tolower(cl)) {
+    case 'a':
+        res = isalpha(c);
+        break;
+    case 'c':
+        res = iscntrl(c);
+        break;
+    case 'd':
+        res = isdigit(c);
+        break;
+    case 'l':
+        res = islower(c);
+        break;
+    case 'p':
+        res = ispunct(c);
+        break;
+    case 's':
+        res = isspace(c);
+        break;
+    case 'u':
+        res = isupper(c);
+        break;
+    case 'w':
+        res = isalnum(c);
+        break;
+    case 'x':
+        res = isxdigit(c);
+        break;
+    case 'z':
+        res = (c == 0);
+        break;
+    default:
+        return (cl == c);
+    }
+    if (isupper(cl))
+        res = !res;
+    return res;
+}
+
+static int match_bracket_class(int c, const char *p, const char *ec) {
+    int sig = 1;
+    if (*(p + 1) == '^') {
+        sig = 0;
+        p++; /* skip the '^' */
+    }
+    while (++p < ec) {
+        if (*p == L_ESC) {
+            p++;
+            if (match_class(c, uchar(*p)))
+                return sig;
+        } else if ((*(p + 1) == '-') && (p + 2 < ec)) {
+            p += 2;
+            if (uchar(*(p - 2)) <= c && c <= uchar(*p))
+                return sig;
+        } else if (uchar(*p) == c) {
+            return sig;
+        }
+    }
+    return !sig;
+}
+
+static int single_match(int c, const char *p, const char *ep) {
+    switch (*p) {
+    case '.':
+        return 1;
+    case L_ESC:
+        return match_class(c, uchar(*(p + 1)));
+    case '[':
+        return match_bracket_class(c, p, ep - 1);
+    default:
+        return (uchar(*p) == c);
+    }
+}
+
+static const char *match_balance(match_state_t *ms, const char *s,
+                                 const char *p) {
+    if (*p == 0 || *(p + 1) == 0)
+        luaL_error(ms->L, "unbalanced pattern");
+    if (s >= ms->src_end || *s != *p) {
+        return NULL;
+    } else {
+        int b = *p;
+        int e = *(p + 1);
+        int cont = 1;
+        while (++s < ms->src_end) {
+            if (*s == e) {
+                if (--cont == 0)
+                    return s + 1;
+            } else if (*s == b) {
+                cont++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static const char *max_expand(match_state_t *ms, const char *s,
+                              const char *p, const char *ep) {
+    ptrdiff_t i = 0;
+    while ((s + i) < ms->src_end && single_match(uchar(*(s + i)), p, ep))
+        i++;
+    /* keeps trying to match with the maximum repetitions */
+    while (i >= 0) {
+        const char *res = match(ms, (s + i), ep + 1);
+        if (res)
+            return res;
+        i--; /* else didn't match; reduce 1 repetition to try again */
+    }
+    return NULL;
+}
+
+static const char *min_expand(match_state_t *ms, const char *s,
+                              const char *p, const char *ep) {
+    for (;;) {
+        const char *res = match(ms, s, ep + 1);
+        if (res != NULL)
+            return res;
+        else if (s < ms->src_end && single_match(uchar(*s), p, ep))
+            s++; /* try with one more repetition */
+        else
+            return NULL;
+    }
+}
+
+static const char *start_capture(match_state_t *ms, const char *s,
+                                 const char *p, int what) {
+    const char *res;
+    int level = ms->level;
+    if (level >= MATCH_MAXCAPTURES)
+        luaL_error(ms->L, "too many captures");
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    if ((res = match(ms, s, p)) == NULL) /* match failed? */
+        ms->level--;                      /* undo capture */
+    return res;
+}
+
+static const char *end_capture(match_state_t *ms, const char *s,
+                               const char *p) {
+    int l = capture_to_close(ms);
+    const char *res;
+    ms->capture[l].len = s - ms->capture[l].init; /* close capture */
+    if ((res = match(ms, s, p)) == NULL)           /* match failed? */
+        ms->capture[l].len = MATCH_CAP_UNFINISHED; /* undo capture */
+    return res;
+}
+
+static const char *match_capture(match_state_t *ms, const char *s, int l) {
+    size_t len;
+    l = check_capture(ms, l);
+    len = ms->capture[l].len;
+    if ((size_t)(ms->src_end - s) >= len &&
+        memcmp(ms->capture[l].init, s, len) == 0)
+        return s + len;
+    else
+        return NULL;
+}
+
+static const char *match(match_state_t *ms, const char *s, const char *p) {
+init: /* using goto's to optimize tail recursion */
+    switch (*p) {
+    case '(': /* start capture */
+        if (*(p + 1) == ')') /* position capture? */
+            return start_capture(ms, s, p + 2, MATCH_CAP_POSITION);
+        else
+            return start_capture(ms, s, p + 1, MATCH_CAP_UNFINISHED);
+    case ')': /* end capture */
+        return end_capture(ms, s, p + 1);
+    case L_ESC:
+        switch (*(p + 1)) {
+        case 'b': /* balanced string? */
+            s = match_balance(ms, s, p + 2);
+            if (s == NULL)
+                return NULL;
+            p += 4;
+            goto init; /* else return match(ms, s, p+4); */
+        case 'f': {    /* frontier? */
+            const char *ep;
+            char previous;
+            char current;
+            p += 2;
+            if (*p != '[')
+                luaL_error(ms->L, "missing '[' after '%%f' in pattern");
+            ep = class_end(ms, p); /* points to what is next */
+            previous = (s == ms->src_init) ? '\0' : *(s - 1);
+            /* the subject is not NUL terminated, fake it */
+            current = (s < ms->src_end) ? *s : '\0';
+            if (match_bracket_class(uchar(previous), p, ep - 1) ||
+                !match_bracket_class(uchar(current), p, ep - 1))
+                return NULL;
+            p = ep;
+            goto init; /* else return match(ms, s, ep); */
+        }
+        default:
+            if (isdigit(uchar(*(p + 1)))) { /* capture results (%0-%9)? */
+                s = match_capture(ms, s, uchar(*(p + 1)));
+                if (s == NULL)
+                    return NULL;
+                p += 2;
+                goto init; /* else return match(ms, s, p+2) */
+            }
+            goto dflt; /* case default */
+        }
+    case '\0': /* end of pattern */
+        return s;  /* match succeeded */
+    case '$':
+        if (*(p + 1) == '\0') /* is the '$' the last char in pattern? */
+            return (s == ms->src_end) ? s : NULL; /* check end of string */
+        else
+            goto dflt;
+    default:
+    dflt: { /* it is a pattern item */
+        const char *ep = class_end(ms, p); /* points to what is next */
+        int m = s < ms->src_end && single_match(uchar(*s), p, ep);
+        switch (*ep) {
+        case '?': { /* optional */
+            const char *res;
+            if (m && ((res = match(ms, s + 1, ep + 1)) != NULL))
+                return res;
+            p = ep + 1;
+            goto init; /* else return match(ms, s, ep+1); */
+        }
+        case '*': /* 0 or more repetitions */
+            return max_expand(ms, s, p, ep);
+        case '+': /* 1 or more repetitions */
+            return (m ? max_expand(ms, s + 1, p, ep) : NULL);
+        case '-': /* 0 or more repetitions (minimum) */
+            return min_expand(ms, s, p, ep);
+        default:
+            if (!m)
+                return NULL;
+            s++;
+            p = ep;
+            goto init; /* else return match(ms, s+1, ep); */
+        }
+    }
+    }
+}
+
+/*=========================================================================*\
+* Literal extraction
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Like class_end, but returns NULL on a malformed pattern instead of
+* raising an error; compiling never fails, matching reports the error.
+\*-------------------------------------------------------------------------*/
+static const char *item_end(const char *p) {
+    switch (*p++) {
+    case L_ESC:
+        return *p == '\0' ? NULL : p + 1;
+    case '[':
+        if (*p == '^')
+            p++;
+        do {
+            if (*p == '\0')
+                return NULL;
+            if (*(p++) == L_ESC && *p != '\0')
+                p++;
+        } while (*p != ']');
+        return p + 1;
+    default:
+        return p;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Finds the longest run of characters every match has to contain, in
+* order and back to back. Captures are transparent, since they do not
+* consume input; anything that can repeat or be skipped ends a run.
+* Also works out how far the run starts from the match, if that is fixed.
+\*-------------------------------------------------------------------------*/
+static void extract_literal(pattern_t *pat) {
+    const char *p;
+    const char *ep;
+    char *run;
+    size_t runlen;
+    long runprefix;
+    long fixed;
+    int lit;
+    int c;
+
+    run = pat->lit;
+    runlen = 0;
+    runprefix = 0;
+    fixed = 0;
+
+#define END_RUN()                                                              \
+    do {                                                                       \
+        if (runlen > pat->litlen) {                                            \
+            memmove(pat->lit, run, runlen);                                    \
+            pat->litlen = runlen;                                              \
+            pat->prefix = runprefix;                                           \
+        }                                                                      \
+        run = pat->lit + pat->litlen;                                          \
+        runlen = 0;                                                            \
+    } while (0)
+
+    p = pat->src;
+    while (*p != '\0') {
+        switch (*p) {
+        case '(':
+        case ')':
+            p++;
+            continue;
+        case '$':
+            if (*(p + 1) == '\0') {
+                p++;
+                continue;
+            }
+            break;
+        case L_ESC:
+            if (*(p + 1) == 'b') {
+                END_RUN();
+                fixed = -1;
+                if (*(p + 2) == '\0' || *(p + 3) == '\0')
+                    goto done;
+                p += 4;
+                continue;
+            }
+            if (*(p + 1) == 'f') {
+                /* zero width, the run goes on */
+                if (*(p + 2) != '[' || (ep = item_end(p + 2)) == NULL)
+                    goto done;
+                p = ep;
+                continue;
+            }
+            if (isdigit(uchar(*(p + 1)))) {
+                END_RUN();
+                fixed = -1;
+                p += 2;
+                continue;
+            }
+            break;
+        }
+
+        if ((ep = item_end(p)) == NULL)
+            goto done;
+
+        /* a plain character, or an escaped punctuation character */
+        lit = -1;
+        if (*p == L_ESC) {
+            if (!isalnum(uchar(*(p + 1))))
+                lit = uchar(*(p + 1));
+        } else if (*p != '[' && *p != '.') {
+            lit = uchar(*p);
+        }
+
+        c = *ep;
+        if (c == '*' || c == '-' || c == '?') {
+            END_RUN();
+            fixed = -1;
+            p = ep + 1;
+        } else if (c == '+') {
+            if (lit >= 0) {
+                if (runlen == 0)
+                    runprefix = fixed;
+                run[runlen++] = (char)lit;
+            }
+            END_RUN();
+            fixed = -1;
+            p = ep + 1;
+        } else {
+            if (lit >= 0) {
+                if (runlen == 0)
+                    runprefix = fixed;
+                run[runlen++] = (char)lit;
+            } else {
+                END_RUN();
+            }
+            if (fixed >= 0)
+                fixed++;
+            p = ep;
+        }
+    }
+
+done:
+    END_RUN();
+
+#undef END_RUN
+}
+
+/*=========================================================================*\
+* Exported functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Prepares a pattern for pattern_find
+* Returns
+*   0 on success, -1 if out of memory
+\*-------------------------------------------------------------------------*/
+int pattern_compile(pattern_t *pat, const char *src, size_t len) {
+    pat->anchor = (len > 0 && *src == '^');
+    if (pat->anchor) {
+        src++;
+        len--;
+    }
+
+    pat->src = (char *)malloc(len + 1);
+    /* a literal is never longer than the pattern */
+    pat->lit = (char *)malloc(len + 1);
+    if (pat->src == NULL || pat->lit == NULL) {
+        free(pat->src);
+        free(pat->lit);
+        return -1;
+    }
+    memcpy(pat->src, src, len);
+    pat->src[len] = '\0';
+    pat->len = len;
+    pat->litlen = 0;
+    pat->prefix = -1;
+
+    /* same test string.find does to pick a plain search */
+    pat->plain = !pat->anchor && strpbrk(pat->src, SPECIALS) == NULL;
+    if (pat->plain) {
+        memcpy(pat->lit, src, len);
+        pat->litlen = len;
+        pat->prefix = 0;
+    } else {
+        extract_literal(pat);
+    }
+
+    return 0;
+}
+
+void pattern_free(pattern_t *pat) {
+    free(pat->src);
+    free(pat->lit);
+    pat->src = NULL;
+    pat->lit = NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Finds the first match of pat in s, starting at offset init
+* Returns
+*   start of the match, or NULL; *end is set to one past its last byte
+*   and ms holds the captures
+\*-------------------------------------------------------------------------*/
+const char *pattern_find(pattern_t *pat, match_state_t *ms, lua_State *L,
+                         const char *s, size_t len, size_t init,
+                         const char **end) {
+    const char *s1;
+    const char *res;
+    const char *from;
+    const char *hit;
+
+    ms->L = L;
+    ms->src_init = s;
+    ms->src_end = s + len;
+    ms->level = 0;
+
+    if (init > len)
+        init = len;
+    s1 = s + init;
+
+    if (pat->plain) {
+        hit = pat->litlen == 0
+                  ? s1
+                  : (const char *)memmem(s1, len - init, pat->lit, pat->litlen);
+        if (hit != NULL)
+            *end = hit + pat->litlen;
+        return hit;
+    }
+
+    if (pat->litlen > 0) {
+        /* a match needs the literal somewhere past its start */
+        if (memmem(s1, len - init, pat->lit, pat->litlen) == NULL)
+            return NULL;
+        /* with a fixed distance, only hits can be match starts */
+        if (pat->prefix >= 0 && !pat->anchor) {
+            for (from = s1 + pat->prefix; from < ms->src_end; from = hit + 1) {
+                hit = (const char *)memmem(from, ms->src_end - from, pat->lit,
+                                           pat->litlen);
+                if (hit == NULL)
+                    return NULL;
+                ms->level = 0;
+                if ((res = match(ms, hit - pat->prefix, pat->src)) != NULL) {
+                    *end = res;
+                    return hit - pat->prefix;
+                }
+            }
+            return NULL;
+        }
+    }
+
+    do {
+        ms->level = 0;
+        if ((res = match(ms, s1, pat->src)) != NULL) {
+            *end = res;
+            return s1;
+        }
+    } while (s1++ < ms->src_end && !pat->anchor);
+
+    return NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes the captures of the last match; with no captures, pushes the
+* whole match s..e unless s is NULL, as string.find/string.match do.
+\*-------------------------------------------------------------------------*/
+int match_pushcaptures(match_state_t *ms, const char *s, const char *e) {
+    int i;
+    int nlevels;
+    lua_State *L;
+
+    L = ms->L;
+    nlevels = (ms->level == 0 && s) ? 1 : ms->level;
+    luaL_checkstack(L, nlevels, "too many captures");
+    for (i = 0; i < nlevels; i++) {
+        if (i >= ms->level) {
+            lua_pushlstring(L, s, e - s); /* add whole match */
+        } else {
+            ptrdiff_t l = ms->capture[i].len;
+            if (l == MATCH_CAP_UNFINISHED)
+                luaL_error(L, "unfinished capture");
+            if (l == MATCH_CAP_POSITION)
+                lua_pushinteger(L, ms->capture[i].init - ms->src_init + 1);
+            else
+                lua_pushlstring(L, ms->capture[i].init, l);
+        }
+    }
+
+    return nlevels;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,55 @@
+#ifndef MATCH_H
+#define MATCH_H
+/*=========================================================================*\
+* Lua pattern matching over raw memory
+*
+* The matcher is the one from Lua 5.1 (lstrlib.c), made to work on
+* buffers that are not Lua strings. Patterns are compiled once: the
+* longest literal every match must contain is extracted so that memmem,
+* which the C library vectorizes, can skip straight to the places where
+* a match is possible.
+\*=========================================================================*/
+
+#include <stddef.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+
+#define MATCH_MAXCAPTURES 32
+
+#define MATCH_CAP_UNFINISHED (-1)
+#define MATCH_CAP_POSITION (-2)
+
+/* state of a single match attempt */
+typedef struct match_state_s {
+    const char *src_init; /* start of the subject */
+    const char *src_end;  /* end of the subject */
+    lua_State *L;         /* for error reporting */
+    int level;            /* total number of captures */
+    struct {
+        const char *init;
+        ptrdiff_t len;
+    } capture[MATCH_MAXCAPTURES];
+} match_state_t;
+
+/* compiled pattern */
+typedef struct pattern_s {
+    char *src;     /* pattern text, NUL terminated, without the '^' */
+    size_t len;    /* length of src */
+    int anchor;    /* pattern started with '^' */
+    int plain;     /* no special characters, src is the literal itself */
+    char *lit;     /* longest literal every match contains */
+    size_t litlen; /* length of lit, 0 if there is none */
+    long prefix;   /* bytes between match start and lit, -1 if variable */
+} pattern_t;
+
+int pattern_compile(pattern_t *pat, const char *src, size_t len);
+void pattern_free(pattern_t *pat);
+const char *pattern_find(pattern_t *pat, match_state_t *ms, lua_State *L,
+                         const char *s, size_t len, size_t init,
+                         const char **end);
+int match_pushcaptures(match_state_t *ms, const char *s, const char *e);
+
+#endif /* MATCH_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -27,6 +27,21 @@
 
 #include <termios.h> /* tcgetattr, tty_ioctl */
 
+/* for lpty_closefrom and lpty.fds */
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* descriptors closed one by one without close_range */
+#define LPTY_MAXCLOSE 65536
+
+/* for spawn options */
+#include <sched.h>
+#include <sys/resource.h>
+
 /* environ for execvpe */
 /* node/src/node_child_process.cc */
 #if defined(__APPLE__) && !TARGET_OS_IPHONE
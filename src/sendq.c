@@ -0,0 +1,118 @@
+/*=========================================================================*\
+* Paced output
+\*=========================================================================*/
+#include "sendq.h"
+#include "io.h"
+
+#include <stdlib.h>
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Queues n bytes on h; the pacing given applies to everything still
+* queued. A chunk of 0 writes the data as fast as the descriptor takes it.
+* Returns
+*   0 on success, -1 if out of memory
+\*-------------------------------------------------------------------------*/
+int sendq_push(handle_t *h, const char *data, size_t n, size_t chunk,
+               double interval, double jitter) {
+    sendq_t *q;
+
+    if ((q = h->out) == NULL) {
+        if ((q = (sendq_t *)calloc(1, sizeof(sendq_t))) == NULL)
+            return -1;
+        buffer_init(&q->data);
+        h->out = q;
+    }
+
+    if (buffer_append(&q->data, data, n) < 0)
+        return -1;
+    q->queued += n;
+    q->chunk = chunk;
+    q->interval = interval > 0 ? interval : 0;
+    q->jitter = jitter > 0 ? jitter : 0;
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Writes the chunks that are due, without waiting for the descriptor
+* Output
+*   wait: seconds until the next chunk is due, -1 with nothing queued
+* Returns
+*   IO_DONE, or the error that stopped the write
+\*-------------------------------------------------------------------------*/
+int sendq_pump(handle_t *h, double *wait) {
+    sendq_t *q;
+    timeout_t tm;
+    size_t n;
+    size_t sent;
+    double now;
+    int rc;
+
+    *wait = -1;
+    if ((q = h->out) == NULL || buffer_len(&q->data) == 0)
+        return IO_DONE;
+
+    now = timeout_gettime();
+    while (buffer_len(&q->data) > 0 && now >= q->due) {
+        n = buffer_len(&q->data);
+        if (q->chunk > 0 && n > q->chunk)
+            n = q->chunk;
+
+        /* a total of 0 polls the descriptor once */
+        timeout_init(&tm, -1, 0);
+        timeout_markstart(&tm);
+        rc = io_write(&h->wfd, buffer_ptr(&q->data), n, &sent, &tm);
+        if (rc == IO_TIMEOUT) {
+            q->due = now + SENDQ_RETRY;
+            break;
+        } else if (rc != IO_DONE) {
+            return rc;
+        }
+
+        buffer_consume(&q->data, sent);
+        q->sent += sent;
+        if (q->interval > 0 || q->jitter > 0) {
+            q->due = now + q->interval +
+                     q->jitter * (rand() / (RAND_MAX + 1.0));
+        }
+    }
+
+    if (buffer_len(&q->data) == 0) {
+        /* the next send starts right away */
+        buffer_clear(&q->data);
+        return IO_DONE;
+    }
+    *wait = q->due > now ? q->due - now : 0;
+
+    return IO_DONE;
+}
+
+/*-------------------------------------------------------------------------*\
+* io_drain on a handle that pumps its queue while it waits
+\*-------------------------------------------------------------------------*/
+int sendq_drain(handle_t *h, buffer_t *buf, size_t limit, size_t *got,
+                timeout_t *tm) {
+    timeout_t slice;
+    double wait;
+    double left;
+    int rc;
+
+    for (;;) {
+        if ((rc = sendq_pump(h, &wait)) != IO_DONE)
+            return rc;
+        left = timeout_getretry(tm);
+        if (wait < 0 || (left >= 0 && left <= wait))
+            return io_drain(&h->fd, buf, limit, got, tm);
+
+        timeout_init(&slice, -1, wait);
+        timeout_markstart(&slice);
+        rc = io_drain(&h->fd, buf, limit, got, &slice);
+        if (rc != IO_TIMEOUT)
+            return rc;
+    }
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
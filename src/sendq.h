@@ -0,0 +1,26 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+/*=========================================================================*\
+* Paced output
+*
+* Data queued on a handle is written a chunk per interval, for targets
+* that drop input arriving too fast. Nothing blocks on the pacing: the
+* queue is pumped whenever the handle is waited on for input, and waits
+* wake up in time for the next chunk, so other work goes on meanwhile.
+\*=========================================================================*/
+
+#include "handle.h"
+#include "timeout.h"
+
+/* seconds before retrying a chunk the descriptor would not take */
+#define SENDQ_RETRY 0.01
+
+int sendq_push(handle_t *h, const char *data, size_t n, size_t chunk,
+               double interval, double jitter);
+int sendq_pump(handle_t *h, double *wait);
+int sendq_drain(handle_t *h, buffer_t *buf, size_t limit, size_t *got,
+                timeout_t *tm);
+
+#endif /* SENDQ_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,283 @@
+/*=========================================================================*\
+* Session watchdog
+*
+* Sessions are kept in a list scanned by a single thread every tick. The
+* thread only reads the byte counter of a session's input buffer, which
+* the owner keeps writing; a stale value just delays the idle check by a
+* tick. Everything else is under the list mutex, which is also what keeps
+* a session's handle alive while the thread looks at it.
+\*=========================================================================*/
+#include "watchdog.h"
+#include "timeout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* escalation stages of a watched session */
+enum {
+    WATCH_RUNNING = 0, /* watched, no signal sent yet */
+    WATCH_HUP,         /* SIGHUP sent */
+    WATCH_TERM,        /* SIGTERM sent */
+    WATCH_KILL,        /* SIGKILL sent */
+    WATCH_REAPED       /* child reaped, nothing left to do */
+};
+
+typedef struct watch_s {
+    struct watch_s *next;
+    handle_t *h;
+    pid_t pid;
+    double idle;   /* seconds without output, 0 for no limit */
+    double ttl;    /* seconds to live, 0 for no limit */
+    double grace;  /* seconds between signals */
+    double born;   /* when watching started */
+    double active; /* when output was last seen */
+    size_t seen;   /* input byte count at that time */
+    int stage;
+    double due;    /* when to send the next signal */
+    int reason;    /* WATCHDOG_IDLE or WATCHDOG_TTL once expired */
+    int status;    /* wait status once reaped */
+} watch_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int started;
+    watch_t *list;
+    int fds[2]; /* notification pipe */
+} watchdog = {PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, {-1, -1}};
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static void *watchdog_main(void *arg);
+static void watchdog_check(watch_t *w, double now);
+static void watchdog_signal(watch_t *w, double now);
+static watch_t *watchdog_find(handle_t *h);
+static int watchdog_pipe(void);
+
+/*=========================================================================*\
+* Exported functions.
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Starts watching the session of h, whose child is pid
+* Returns
+*   0, or an errno value
+\*-------------------------------------------------------------------------*/
+int watchdog_add(handle_t *h, pid_t pid, double idle, double ttl,
+                 double grace) {
+    watch_t *w;
+    int err;
+
+    if (watchdog.fds[0] < 0 && watchdog_pipe() < 0)
+        return errno;
+
+    pthread_mutex_lock(&watchdog.lock);
+    w = watchdog_find(h);
+    if (w == NULL) {
+        if ((w = (watch_t *)calloc(1, sizeof(watch_t))) == NULL) {
+            pthread_mutex_unlock(&watchdog.lock);
+            return ENOMEM;
+        }
+        w->next = watchdog.list;
+        watchdog.list = w;
+    }
+    w->h = h;
+    w->pid = pid;
+    w->idle = idle;
+    w->ttl = ttl;
+    w->grace = grace;
+    w->born = w->active = timeout_gettime();
+    w->seen = h->in.seen;
+    w->stage = WATCH_RUNNING;
+    w->reason = WATCHDOG_NONE;
+    w->status = 0;
+    pthread_mutex_unlock(&watchdog.lock);
+
+    if (!watchdog.started) {
+        err = pthread_create(&watchdog.thread, NULL, watchdog_main, NULL);
+        if (err != 0) {
+            watchdog_remove(h);
+            return err;
+        }
+        watchdog.started = 1;
+    }
+
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Stops watching h, which may then be freed; the thread ends with the
+* last session, so that nothing runs once the module is unloaded
+\*-------------------------------------------------------------------------*/
+void watchdog_remove(handle_t *h) {
+    watch_t **pw;
+    watch_t *w;
+    int last;
+
+    pthread_mutex_lock(&watchdog.lock);
+    for (pw = &watchdog.list; *pw != NULL; pw = &(*pw)->next) {
+        if ((*pw)->h == h) {
+            w = *pw;
+            *pw = w->next;
+            free(w);
+            break;
+        }
+    }
+    last = watchdog.list == NULL;
+    pthread_mutex_unlock(&watchdog.lock);
+
+    if (last && watchdog.started) {
+        pthread_join(watchdog.thread, NULL);
+        watchdog.started = 0;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Reports on a watched session
+* Output
+*   reason: WATCHDOG_IDLE or WATCHDOG_TTL if the watchdog stopped it
+*   status: wait status of the child once reaped
+* Returns
+*   1 once the child is reaped, 0 while it is not, -1 if h is not watched
+\*-------------------------------------------------------------------------*/
+int watchdog_state(handle_t *h, int *reason, int *status) {
+    watch_t *w;
+    int rc;
+
+    pthread_mutex_lock(&watchdog.lock);
+    w = watchdog_find(h);
+    if (w == NULL) {
+        rc = -1;
+    } else {
+        *reason = w->reason;
+        *status = w->status;
+        rc = w->stage == WATCH_REAPED;
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+
+    return rc;
+}
+
+/*-------------------------------------------------------------------------*\
+* Descriptor that becomes readable whenever the watchdog stopped a session
+\*-------------------------------------------------------------------------*/
+int watchdog_getfd(void) {
+    if (watchdog.fds[0] < 0)
+        watchdog_pipe();
+
+    return watchdog.fds[0];
+}
+
+void watchdog_clearfd(void) {
+    char junk[64];
+
+    if (watchdog.fds[0] >= 0)
+        while (read(watchdog.fds[0], junk, sizeof(junk)) > 0)
+            ;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static void *watchdog_main(void *arg) {
+    struct timespec tick;
+    watch_t *w;
+    double now;
+
+    (void)arg;
+    tick.tv_sec = 0;
+    tick.tv_nsec = (long)(WATCHDOG_TICK * 1.0e9);
+
+    pthread_mutex_lock(&watchdog.lock);
+    while (watchdog.list != NULL) {
+        now = timeout_gettime();
+        for (w = watchdog.list; w != NULL; w = w->next)
+            watchdog_check(w, now);
+        pthread_mutex_unlock(&watchdog.lock);
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&watchdog.lock);
+    }
+    pthread_mutex_unlock(&watchdog.lock);
+
+    return NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Moves a session along: notes output, reaps the child once it is gone
+* and escalates signals after an expiry
+\*-------------------------------------------------------------------------*/
+static void watchdog_check(watch_t *w, double now) {
+    if (w->stage == WATCH_REAPED)
+        return;
+
+    if (waitpid(w->pid, &w->status, WNOHANG) != 0) {
+        /* gone, or never ours to wait for */
+        w->stage = WATCH_REAPED;
+        if (w->reason != WATCHDOG_NONE)
+            (void)!write(watchdog.fds[1], "", 1);
+        return;
+    }
+
+    if (w->stage != WATCH_RUNNING) {
+        if (now >= w->due && w->stage < WATCH_KILL)
+            watchdog_signal(w, now);
+        return;
+    }
+
+    if (w->h->in.seen != w->seen) {
+        w->seen = w->h->in.seen;
+        w->active = now;
+    }
+    if (w->idle > 0 && now - w->active > w->idle)
+        w->reason = WATCHDOG_IDLE;
+    else if (w->ttl > 0 && now - w->born > w->ttl)
+        w->reason = WATCHDOG_TTL;
+    if (w->reason != WATCHDOG_NONE)
+        watchdog_signal(w, now);
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends the next signal of the escalation to the child's process group,
+* which it leads after setsid, so that its own children go as well
+\*-------------------------------------------------------------------------*/
+static void watchdog_signal(watch_t *w, double now) {
+    static const int sigs[] = {0, SIGHUP, SIGTERM, SIGKILL};
+
+    w->stage++;
+    w->due = now + w->grace;
+    if (kill(-w->pid, sigs[w->stage]) == -1)
+        kill(w->pid, sigs[w->stage]);
+}
+
+static watch_t *watchdog_find(handle_t *h) {
+    watch_t *w;
+
+    for (w = watchdog.list; w != NULL; w = w->next)
+        if (w->h == h)
+            return w;
+
+    return NULL;
+}
+
+static int watchdog_pipe(void) {
+    int i;
+
+    if (pipe(watchdog.fds) == -1) {
+        watchdog.fds[0] = watchdog.fds[1] = -1;
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(watchdog.fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(watchdog.fds[i], F_SETFL,
+              fcntl(watchdog.fds[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    return 0;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
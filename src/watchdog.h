@@ -0,0 +1,38 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+/*=========================================================================*\
+* Session watchdog
+*
+* A thread that watches spawned sessions for output and age. A session
+* that stays silent longer than its idle limit, or lives longer than its
+* time to live, has its child's process group sent SIGHUP, then SIGTERM,
+* then SIGKILL, a grace period apart, until the child can be reaped. Its
+* master then reads as closed, which ends any wait on it; the owner finds
+* out why from watchdog_state, and can wait for the notification
+* descriptor to become readable.
+\*=========================================================================*/
+
+#include "handle.h"
+
+#include <sys/types.h>
+
+/* how often the watchdog looks at its sessions, in seconds */
+#define WATCHDOG_TICK 0.1
+
+/* why a session was stopped */
+enum {
+    WATCHDOG_NONE = 0, /* still watched, or the child exited on its own */
+    WATCHDOG_IDLE,     /* no output for longer than the idle limit */
+    WATCHDOG_TTL       /* older than its time to live */
+};
+
+int watchdog_add(handle_t *h, pid_t pid, double idle, double ttl,
+                 double grace);
+void watchdog_remove(handle_t *h);
+int watchdog_state(handle_t *h, int *reason, int *status);
+int watchdog_getfd(void);
+void watchdog_clearfd(void);
+
+#endif /* WATCHDOG_H */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
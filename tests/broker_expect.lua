@@ -0,0 +1,54 @@
+-- usage: lua broker_expect.lua serve | lua broker_expect.lua client
+
+local Broker = require "broker"
+local Expect = require "expect"
+
+
+local path = "/tmp/expect-broker.sock"
+
+
+if arg[1] == "serve" then
+    local broker = Broker.new{
+        path = path,
+        targets = {
+            shell = {
+                spawn = function()
+                    local expect, err = Expect.new()
+                    if not expect then
+                        return nil, err
+                    end
+
+                    local ok, err = expect:spawn("sh", {}, "/tmp")
+                    if not ok then
+                        return nil, err
+                    end
+
+                    return expect
+                end,
+                min = 1,
+                max = 2,
+            },
+        },
+    }
+
+    local ok, err = broker:serve()
+    if not ok then
+        error("broker serve error: " .. err)
+    end
+else
+    local expect, err = Broker.checkout(path, "shell", 5)
+    if not expect then
+        error("broker checkout error: " .. err)
+    end
+
+    expect:send("echo $((6 * 7))\r")
+    local ok, err = expect:expect("42", 2)
+    if not ok then
+        error(err or "no answer")
+    end
+
+    ok, err = Broker.release(expect, 5)
+    if not ok then
+        error("broker release error: " .. err)
+    end
+end
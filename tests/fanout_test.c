@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "fanout.h"
+
+static int check(int ok, const char *what) {
+    if (!ok)
+        printf("failed: %s\n", what);
+
+    return ok ? 0 : 1;
+}
+
+/* a cursor lagging too far is detached, nothing is kept after it */
+static int test_detach(void) {
+    fanout_t *fan;
+    cursor_t cur;
+    const char *data;
+    char buf[16];
+    int failed;
+    int i;
+
+    failed = 0;
+    fan = fanout_new(16);
+    cursor_attach(&cur, fan, 20, FANOUT_DETACH);
+    for (i = 0; i < 3; i++) {
+        memset(buf, 'a' + i, sizeof(buf));
+        failed += check(fanout_append(fan, buf, sizeof(buf)) == 0,
+                        "detach: append");
+    }
+    failed += check(cur.fan == NULL, "detach: cursor detached");
+    failed += check(cursor_peek(&cur, &data) == 0, "detach: nothing to read");
+    failed += check(fan->head == NULL && fan->tail == NULL,
+                    "detach: chunks freed");
+    fanout_free(fan);
+
+    return failed;
+}
+
+/* a cursor lagging too far skips whole chunks and counts them */
+static int test_drop(void) {
+    fanout_t *fan;
+    cursor_t cur;
+    const char *data;
+    char buf[16];
+    size_t n;
+    int failed;
+    int i;
+
+    failed = 0;
+    fan = fanout_new(16);
+    cursor_attach(&cur, fan, 20, FANOUT_DROP);
+    for (i = 0; i < 3; i++) {
+        memset(buf, 'a' + i, sizeof(buf));
+        failed += check(fanout_append(fan, buf, sizeof(buf)) == 0,
+                        "drop: append");
+    }
+    failed += check(cur.fan == fan, "drop: cursor attached");
+    failed += check(cur.dropped == 32, "drop: bytes dropped");
+    failed += check(cursor_pending(&cur) == 16, "drop: bytes pending");
+    n = cursor_peek(&cur, &data);
+    failed += check(n == 16 && data[0] == 'c' && data[15] == 'c',
+                    "drop: reads the last chunk");
+    cursor_advance(&cur, n);
+    failed += check(cursor_pending(&cur) == 0, "drop: all read");
+    cursor_detach(&cur);
+    fanout_free(fan);
+
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int failed;
+
+    (void)argc;
+    (void)argv;
+
+    failed = test_detach();
+    failed += test_drop();
+    printf("%s\n", failed ? "FAILED" : "ok");
+
+    return failed ? 1 : 0;
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -0,0 +1,44 @@
+-- usage: expect-fleet run -w 4 -c 32 -r 2 -o results.jsonl \
+--            tests/fleet_expect.lua inventory
+--
+-- inventory lines are "host [port]"; watch progress with
+-- expect-fleet status
+
+local Expect = require "expect"
+
+
+return function(host, port)
+    local expect, err = Expect.new(nil, nil, 10, false)
+    if not expect then
+        return nil, err
+    end
+
+    local ok, err = expect:spawn("ssh", { "ssh@" .. host, "-p", port or "22" },
+                                 "/tmp")
+    if not ok then
+        return nil, err
+    end
+
+    fleet.note("login")
+
+    -- hand the worker to other hosts until the password prompt shows up
+    ok, err = fleet.wait(expect, "r", 10)
+    if not ok then
+        expect:clean()
+        return nil, err
+    end
+
+    expect:play("password", "ssh\r")
+    ok, err = expect:expect("Last login:", 5)
+    if not ok then
+        expect:clean()
+        return nil, err
+    end
+
+    expect:send("uptime\r")
+    local line = expect:readline(5)
+    expect:send("exit\r")
+    expect:clean()
+
+    return { uptime = line }
+end
@@ -0,0 +1,34 @@
+-- usage: lua tests/loop_expect.lua
+--
+-- three shells driven side by side from one thread, with a ticker in
+-- between to show the loop never stalls on any of them
+
+local Expect = require "expect"
+local Loop = require "loop"
+
+
+local loop = Loop.new()
+
+for i = 1, 3 do
+    loop:spawn(function(n)
+        local expect = assert(Expect.new(nil, nil, 5))
+        assert(expect:spawn("sh", {}, "/tmp"))
+
+        assert(expect:send("sleep " .. n .. "; echo done-" .. n .. "\r"))
+        assert(expect:expect("\ndone%-" .. n, n + 2))
+        print("shell " .. n .. " done")
+
+        expect:clean()
+    end, i)
+end
+
+local ticker = loop:spawn(function()
+    for i = 1, 6 do
+        Expect.wait(nil, 0.5)
+        print("tick " .. i)
+    end
+    return "ticked"
+end)
+
+loop:run()
+assert(ticker.results[1] == "ticked")
@@ -27,13 +27,14 @@ local stdin = {
     end
 }
 
-local rset = { stdin, expect }
-local wset = { expect }
+local rset = { stdin, expect.pty }
+local wset = { expect.pty }
+local rout, wout = {}, {}
 
 local buf = ""
 lpty.turn_echoing_off()
 while true do
-    local r, w, err = lio.select(rset, wset, 0)
+    local r, w, err = lio.select(rset, wset, 0, rout, wout)
     if err and err ~= "timeout" then
         error(err)
     end
@@ -47,7 +48,7 @@ while true do
 
             if obj == stdin then
                 buf = buf .. data
-            elseif obj == expect then
+            elseif obj == expect.pty then
                 io.write(data)
                 io.flush()
             end
@@ -55,7 +56,7 @@ while true do
     end
 
     if #w > 0 and #buf > 0 then
-        lio.write(expect:getfd(), buf, 0)
+        lio.write(expect.pty:getfd(), buf, 0)
         buf = ""
     end
 
@@ -0,0 +1,20 @@
+-- usage: lua tests/pipe_expect.lua
+--
+-- children without a tty: bulk output through large pipes, and input
+-- ended with eof() instead of ^D
+
+local Expect = require "expect"
+
+
+local expect = assert(Expect.pipe(10))
+assert(expect:spawn("seq", { "1", "1000000" }, "/tmp"))
+expect:sink(true)
+assert(expect:expect("\n1000000\n"))
+expect:clean()
+
+expect = assert(Expect.pipe(5))
+assert(expect:spawn("sort", {}, "/tmp"))
+assert(expect:send("pear\napple\n"))
+assert(expect:eof())
+assert(expect:expect("^apple\npear\n"))
+expect:clean()
@@ -11,7 +11,7 @@ if not ok then
     error("expect spawn error: " .. err)
 end
 
-expect:wait(1)
+expect:settle(300, 5)
 
 expect:play("yes/no", "yes\r")
 expect:play("password", "ssh\r")
@@ -21,6 +21,16 @@ if not ok then
     error(err or "login failed")
 end
 
-expect:send("ls -al $HOME && pwd\r")
-expect:play("/home/ssh", "exit\r")
+local results, err = expect:run_batch({ "ls -al $HOME", "pwd", "false" }, 5)
+if not results then
+    error("run_batch error: " .. err)
+end
+
+-- each output is what the command printed, nothing of prompt or echo
+print(results[1].output)
+assert(results[1].status == 0)
+assert(results[2].output == "/home/ssh")
+assert(results[3].status == 1 and results[3].output == "")
+
+expect:send("exit\r")
 expect:expect("logout")
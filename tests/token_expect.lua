@@ -0,0 +1,33 @@
+-- usage: lua tests/token_expect.lua
+--
+-- a cancelled token fails every wait until rearmed; tokens keep working
+-- once one is current or none is
+
+local lio = require "lio"
+
+
+local tok = assert(lio.token())
+local idle = assert(lio.token())
+local fd = idle:getfd("r")
+
+lio.settoken(tok)
+assert(lio.cancel(tok))
+local ok, err = lio.waitfd(fd, "r", 1)
+assert(not ok and err == "cancelled")
+
+lio.rearm(tok)
+ok, err = lio.waitfd(fd, "r", 0.1)
+assert(not ok and err == "timeout")
+assert(tok:getfd("w"))
+assert(lio.token():getfd("r"))
+
+lio.settoken(nil)
+local other = assert(lio.token())
+assert(lio.cancel(other))
+ok, err = lio.waitfd(fd, "r", 0.1)
+assert(not ok and err == "timeout")
+lio.rearm(other)
+
+tok, idle, other = nil, nil, nil
+collectgarbage()
+print("ok")